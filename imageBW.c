@@ -24,18 +24,51 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "instrumentation.h"
 
 // The data structure
 //
-// A BW image is stored in a structure containing 3 fields:
+// A BW image is stored in a structure containing these fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the pointers
+// The row field is a pointer to an array that stores the pointers
 // to the RLE compressed image rows.
+// The rows are stored in slabs: contiguous buffers holding many compressed
+// rows, one after the other.  A new image has a single slab, and its
+// row pointers point into it, so the array of pointers is the per-row
+// offset table.
+// The header and the array of row pointers share a single allocation,
+// so an image costs exactly two heap blocks, whatever its height.
+// Slabs are reference counted and may be shared by several images,
+// so that operations that only reorder or reuse whole rows (see
+// ImageHorizontalMirror, ImageReplicateAtBottom, ImageCopy) just copy
+// row pointers (see Slab).
+// Equal rows of an image may also be stored once, with several row
+// pointers to them (see RowBuilderRepeat and RowBuilderIntern).
+//
+// The encoding field tells how rows are stored.  With IMAGE_RLE_PACKED,
+// rows are kept in a compact byte code (see PackRow), and the array of row
+// pointers is used as packed instead of row.
+// With IMAGE_BITMAP, rows are kept uncompressed, one bit per pixel,
+// in a single slab, pointed to by bits (see RLERowToBitmap).
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -46,11 +79,42 @@
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
 const int EOR = -1;  // Stored as the last element of a RLE row
 
+// Reference-counted storage for rows
+//
+// Rows in a slab are never modified while the slab is shared (refs > 1).
+// Each image holds one reference to each slab its rows point into,
+// and ImageDestroy drops them: the last one frees the slab.
+// Functions that modify rows in place copy them first if they are shared
+// (see OwnRows).
+typedef struct {
+  atomic_ulong refs;  // number of images using the slab
+  uint64 data[];      // the rows (aligned for any encoding)
+} Slab;
+
+// Statistics of the BLACK pixels of an image (see ImageCountBlack)
+typedef struct {
+  uint64 black;          // number of BLACK pixels
+  uint32 x, y;           // bounding box of the BLACK pixels
+  uint32 width, height;  // (all 0 if there are none)
+  uint32 row_count[];    // number of BLACK pixels of each row
+} Stats;
+
 // Internal structure for storing RLE BW images
 struct image {
   uint32 width;
   uint32 height;
   int** row;  // pointer to an array of pointers referencing the compressed rows
+  int encoding;    // IMAGE_RLE, IMAGE_RLE_PACKED or IMAGE_BITMAP
+  uint8** packed;  // pointers to the packed rows (IMAGE_RLE_PACKED only)
+  uint64* bits;    // contiguous storage of all the bitmap rows
+  Slab** slabs;      // the slabs holding the rows
+  uint32 num_slabs;  // number of slabs
+  Slab* slab;        // storage for slabs[0], when there is a single one
+  int distinct_rows;  // no two row pointers point to the same row
+  uint64* _Atomic row_hash;  // cached row hashes, then digest, or NULL
+  uint32** _Atomic run_start;  // cached run index, or NULL (see BuildRunIndex)
+  Stats* _Atomic stats;  // cached statistics, or NULL (see ComputeStats)
+  uint64* _Atomic run_histogram;  // cached run lengths, or NULL (ditto)
 };
 
 // This module follows "design-by-contract" principles.
@@ -86,7 +150,7 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
-char* ImageErrMsg() {  ///
+char* ImageErrMsg(void) {  ///
   return errCause;
 }
 
@@ -137,16 +201,30 @@ static int check(int condition, const char* failmsg) {
   return condition;
 }
 
+static void SelectKernels(void);  // See the bitmap kernels below
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of instrumentation counters, and select the bitmap kernels
+/// for the running CPU.  Instrumentation is calibrated only when needed
+/// (see InstrGetCTU), so this is fast.
 void ImageInit(void) {  ///
-  InstrCalibrate();
+  SelectKernels();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "runmem";  // InstrCount[1] will count RLE run acesses
   // Name other counters here...
 }
 
+// The instrumentation counters of the running thread (see ParallelFor).
+static _Thread_local unsigned long* counters = NULL;
+
+static inline unsigned long* Counters(void) {
+  if (counters == NULL) counters = InstrThreadCounters();
+  return counters;
+}
+
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+#define PIXMEM Counters()[0]
+#define RUNMEM Counters()[1]
 // Add more macros here...
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
@@ -154,45 +232,140 @@ void ImageInit(void) {  ///
 /// Auxiliary (static) functions
 
 /// Create the header of an image data structure
-/// And allocate the array of pointers to RLE rows
+/// And allocate the array of pointers to RLE rows, in the same block
+/// The run storage is attached later (see RowBuilder)
 static Image AllocateImageHeader(uint32 width, uint32 height) {
   assert(width > 0 && height > 0);
-  Image newHeader = malloc(sizeof(struct image));
+  Image newHeader = malloc(sizeof(struct image) + height * sizeof(int*));
   assert(newHeader != NULL);
 
   newHeader->width = width;
   newHeader->height = height;
 
-  // Allocating the array of pointers to RLE rows
-  newHeader->row = malloc(height * sizeof(int*));
-  assert(newHeader->row != NULL);
+  // The array of pointers to RLE rows follows the header
+  newHeader->row = (int**)(newHeader + 1);
+  newHeader->encoding = IMAGE_RLE;
+  newHeader->packed = NULL;
+  newHeader->bits = NULL;
+  newHeader->slabs = NULL;
+  newHeader->num_slabs = 0;
+  newHeader->slab = NULL;
+  newHeader->distinct_rows = 1;
+  newHeader->row_hash = NULL;
+  newHeader->run_start = NULL;
+  newHeader->stats = NULL;
+  newHeader->run_histogram = NULL;
 
   return newHeader;
 }
 
-/// Allocate an array to store a RLE row with n elements
-static int* AllocateRLERowArray(uint32 n) {
-  assert(n > 2);
-  int* newArray = malloc(n * sizeof(int));
-  assert(newArray != NULL);
+/// Allocate a slab of size bytes, with a single reference
+static Slab* AllocateSlab(size_t size) {
+  Slab* slab = malloc(sizeof(Slab) + size);
+  assert(slab != NULL);
+  atomic_init(&slab->refs, 1);
+  return slab;
+}
+
+/// Resize a slab with a single reference
+static Slab* ResizeSlab(Slab* slab, size_t size) {
+  assert(atomic_load(&slab->refs) == 1);
+  slab = realloc(slab, sizeof(Slab) + size);
+  assert(slab != NULL);
+  return slab;
+}
+
+/// Drop a reference to a slab, and free it with the last one
+static void ReleaseSlab(Slab* slab) {
+  if (atomic_fetch_sub(&slab->refs, 1) == 1) {
+    free(slab);
+  }
+}
 
-  return newArray;
+/// Drop the references of img to its slabs
+static void ReleaseStorage(Image img) {
+  // The run index points into the rows
+  free(img->run_start);
+  img->run_start = NULL;
+  for (uint32 k = 0; k < img->num_slabs; k++) {
+    ReleaseSlab(img->slabs[k]);
+  }
+  if (img->slabs != &img->slab) free(img->slabs);
+  img->slabs = NULL;
+  img->num_slabs = 0;
+  img->slab = NULL;
 }
 
-/// Conpute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+/// Make slab the only storage of img, taking over a reference to it
+static void SetStorage(Image img, Slab* slab) {
+  ReleaseStorage(img);
+  img->slab = slab;
+  img->slabs = &img->slab;
+  img->num_slabs = 1;
+  img->distinct_rows = 1;
+}
 
-  // How many runs?
-  uint32 num_runs = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      num_runs++;
+/// Make img (with no storage) share the slabs of src1 and src2 (if any),
+/// taking a reference to each one
+static void ShareStorage(Image img, const Image src1, const Image src2) {
+  assert(img->num_slabs == 0);
+  uint32 max_slabs = src1->num_slabs + (src2 != NULL ? src2->num_slabs : 0);
+  img->slabs = max_slabs == 1 ? &img->slab : malloc(max_slabs * sizeof(Slab*));
+  assert(img->slabs != NULL);
+
+  for (int k = 0; k < 2; k++) {
+    const Image src = k == 0 ? src1 : src2;
+    if (src == NULL) continue;
+    for (uint32 j = 0; j < src->num_slabs; j++) {
+      // Each slab is referenced once, even if used by both sources
+      uint32 m = 0;
+      while (m < img->num_slabs && img->slabs[m] != src->slabs[j]) m++;
+      if (m < img->num_slabs) continue;
+      atomic_fetch_add(&src->slabs[j]->refs, 1);
+      img->slabs[img->num_slabs++] = src->slabs[j];
     }
   }
+}
 
-  return num_runs;
+// Maximum number of slabs of an image whose rows are shared.
+// Beyond that, rows are copied instead, to keep ShareStorage fast and
+// to avoid keeping many partly used slabs alive.
+#define MAX_SHARED_SLABS 64
+
+/// Check if the rows of src1 and src2 (which may be NULL) can be shared
+/// by a new image: they must be in the same encoding, with row pointers.
+static int CanShareRows(const Image src1, const Image src2) {
+  if (src1->encoding == IMAGE_BITMAP) return 0;
+  if (src2 == NULL) return 1;
+  return src2->encoding == src1->encoding &&
+         src1->num_slabs + src2->num_slabs <= MAX_SHARED_SLABS;
+}
+
+/// Create the header of an image whose rows are rows of src1 and src2
+/// (which may be NULL), sharing their storage.
+/// The row pointers are set by the caller (see ShareRow).
+/// Requires: CanShareRows(src1, src2).
+static Image AllocateSharingImage(uint32 width, uint32 height,
+                                  const Image src1, const Image src2) {
+  assert(CanShareRows(src1, src2));
+  Image newImage = AllocateImageHeader(width, height);
+  newImage->encoding = src1->encoding;
+  if (newImage->encoding == IMAGE_RLE_PACKED) {
+    newImage->row = NULL;
+    newImage->packed = (uint8**)(newImage + 1);
+  }
+  ShareStorage(newImage, src1, src2);
+  newImage->distinct_rows = 0;  // Rows may be used more than once
+  return newImage;
+}
+
+/// Make row j of img the (shared) row i of src
+static void ShareRow(Image img, uint32 j, const Image src, uint32 i) {
+  if (img->encoding == IMAGE_RLE) {
+    img->row[j] = src->row[i];
+  } else {
+    img->packed[j] = src->packed[i];
+  }
 }
 
 /// Get the number of runs of a compressed RLE image row
@@ -225,699 +398,4990 @@ static uint32 GetSizeRLERowArray(const int* RLE_row) {
   return (i + 1);
 }
 
-/// Compress into RLE format a RAW image row
-/// Allocates and returns the array storing the image row in RLE format
-static int* CompressRow(uint32 image_width, const uint8* RAW_row) {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+// Hashing rows (see ImageDigest and RowBuilderIntern)
 
-  // How many runs?
-  uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
+/// Mix x into hash h
+static uint64 MixHash(uint64 h, uint64 x) {
+  h = (h ^ x) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 32);
+}
 
-  // Allocate the RLE row array
-  int* RLE_row = malloc((num_runs + 2) * sizeof(int));
-  assert(RLE_row != NULL);
+/// Hash a RLE row
+static uint64 HashRLERow(const int* RLE_row) {
+  uint64 h = MixHash(0x5BD1E995ULL, (uint64)RLE_row[0]);
+  for (const int* run = RLE_row + 1; *run != EOR; run++) {
+    h = MixHash(h, (uint64)*run);
+    RUNMEM++;
+  }
+  return h;
+}
 
-  // Go through the RAW_row
-  RLE_row[0] = (int)RAW_row[0];  // Initial pixel value
-  uint32 index = 1;
-  int num_pixels = 1;
-  for (uint32 i = 1; i < image_width; i++) {
-    if (RAW_row[i] != RAW_row[i - 1]) {
-      RLE_row[index++] = num_pixels;
-      num_pixels = 0;
-    }
-    num_pixels++;
+/// Compute the digest of img from its dimensions and the hashes of its
+/// rows, and store it after them, in hash[height]
+static void ComputeDigest(const Image img, uint64* hash) {
+  uint64 h = MixHash(MixHash(0x27D4EB2FULL, img->width), img->height);
+  for (uint32 i = 0; i < img->height; i++) {
+    h = MixHash(h, hash[i]);
   }
-  RLE_row[index++] = num_pixels;
-  RLE_row[index] = EOR;  // Reached the end of the row
+  hash[img->height] = h;
+}
 
-  return RLE_row;
+// Building the run storage of an image
+//
+// Rows are appended, in order, to a growable buffer that becomes the slab
+// of the new image.  Row offsets are recorded while building, since the
+// buffer may move when it grows, and are turned into row pointers at the end.
+// Typical use:
+//   RowBuilder b;
+//   RowBuilderInit(&b, height, estimated_num_elems);
+//   for each row i:
+//     int* dst = RowBuilderReserve(&b, max_num_elems_of_row_i);
+//     ...write row i to dst...
+//     RowBuilderCommit(&b, num_elems_of_row_i);
+//   Image img = RowBuilderFinish(&b, width, height);
+//
+// A row equal to a row already built may be stored only once: either
+// explicitly, with RowBuilderRepeat, or by interning every committed row
+// (see RowBuilderIntern).  The image then has row pointers to the same row,
+// and does not own its rows (see OwnsRows).
+
+typedef struct {
+  Slab* slab;       // the storage being built
+  int* runs;        // the rows built so far, in slab
+  size_t size;      // number of elements used
+  size_t capacity;  // number of elements allocated
+  size_t* offset;   // offset of each row in runs
+  uint32 num_rows;  // number of rows built so far
+  uint32 max_rows;  // number of rows to build
+  int repeated;     // some row was repeated
+  uint64* hash;     // hash of each row (when interning), or NULL
+  uint32* table;    // hash table of distinct rows (row index + 1, or 0)
+  uint32 table_mask;  // table size - 1 (a power of 2)
+} RowBuilder;
+
+static void RowBuilderInit(RowBuilder* b, uint32 height, size_t capacity) {
+  assert(b != NULL);
+  assert(height > 0);
+  if (capacity < 3) capacity = 3;
+
+  b->slab = AllocateSlab(capacity * sizeof(int));
+  b->runs = (int*)b->slab->data;
+  b->offset = malloc(height * sizeof(size_t));
+  assert(b->offset != NULL);
+  b->size = 0;
+  b->capacity = capacity;
+  b->num_rows = 0;
+  b->max_rows = height;
+  b->repeated = 0;
+  b->hash = NULL;
+  b->table = NULL;
+  b->table_mask = 0;
 }
 
-static uint8* UncompressRow(uint32 image_width, const int* RLE_row) {
-  assert(image_width > 0);
-  assert(RLE_row != NULL);
+/// Intern the rows committed from now on: a row equal to a row already
+/// built is not stored again.
+/// Also keeps the hash of every row, which become the cached row hashes
+/// of the image (see ImageDigest).
+static void RowBuilderIntern(RowBuilder* b) {
+  assert(b->num_rows == 0);
+  uint32 size = 2;
+  while (size < 2 * b->max_rows) size *= 2;  // At most half full
+  b->table = calloc(size, sizeof(uint32));
+  assert(b->table != NULL);
+  b->table_mask = size - 1;
+  b->hash = malloc(((size_t)b->max_rows + 1) * sizeof(uint64));  // + digest
+  assert(b->hash != NULL);
+}
 
-  // The uncompressed row
-  uint8* row = (uint8*)malloc(image_width * sizeof(uint8));
-  assert(row != NULL);
+/// Ensure there is room for n more elements, and return where they go
+static int* RowBuilderReserve(RowBuilder* b, size_t n) {
+  assert(b != NULL);
+  if (b->size + n > b->capacity) {
+    size_t capacity = 2 * b->capacity;
+    if (capacity < b->size + n) capacity = b->size + n;
+    b->slab = ResizeSlab(b->slab, capacity * sizeof(int));
+    b->runs = (int*)b->slab->data;
+    b->capacity = capacity;
+  }
+  return b->runs + b->size;
+}
 
-  // Go through the RLE_row until EOR is found
-  int pixel_value = RLE_row[0];
-  uint32 i = 1;
-  uint32 dest_i = 0;
-  while (RLE_row[i] != EOR) {
-    // For each run
-    for (int aux = 0; aux < RLE_row[i]; aux++) {
-      row[dest_i++] = (uint8)pixel_value;
+/// Complete the current row, made of the n elements written after
+/// the last RowBuilderReserve
+static void RowBuilderCommit(RowBuilder* b, size_t n) {
+  assert(b != NULL);
+  assert(n > 2 && b->size + n <= b->capacity);
+  assert(b->num_rows < b->max_rows);
+  int* row = b->runs + b->size;
+  assert(row[n - 1] == EOR);
+
+  if (b->table != NULL) {
+    uint64 h = HashRLERow(row);
+    b->hash[b->num_rows] = h;
+    uint32 k = (uint32)h & b->table_mask;
+    for (; b->table[k] != 0; k = (k + 1) & b->table_mask) {
+      // An earlier row with the same hash: compare the elements.
+      // Equal canonical rows have EOR at the same place, and the earlier
+      // row is followed by other rows or by this one, so it can be read
+      // for n elements.
+      uint32 j = b->table[k] - 1;
+      if (b->hash[j] == h &&
+          memcmp(b->runs + b->offset[j], row, n * sizeof(int)) == 0) {
+        b->offset[b->num_rows++] = b->offset[j];
+        b->repeated = 1;
+        return;
+      }
     }
-    // Next run
-    i++;
-    pixel_value ^= 1;
+    b->table[k] = b->num_rows + 1;
   }
-
-  return row;
+  b->offset[b->num_rows++] = b->size;
+  b->size += n;
 }
 
-// Add your auxiliary functions here...
-
-/// Image management functions
+/// Complete the current row, equal to row j (already built)
+static void RowBuilderRepeat(RowBuilder* b, uint32 j) {
+  assert(b != NULL);
+  assert(j < b->num_rows && b->num_rows < b->max_rows);
+  if (b->hash != NULL) b->hash[b->num_rows] = b->hash[j];
+  b->offset[b->num_rows++] = b->offset[j];
+  b->repeated = 1;
+}
 
-/// Create a new BW image, either BLACK or WHITE.
-///   width, height : the dimensions of the new image.
-///   val: the pixel color (BLACK or WHITE).
-/// Requires: width and height must be non-negative, val is either BLACK or
-/// WHITE.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageCreate(uint32 width, uint32 height, uint8 val) {
-  assert(width > 0 && height > 0);
-  assert(val == WHITE || val == BLACK);
+/// Append a copy of a complete RLE row with n elements
+static void RowBuilderAppend(RowBuilder* b, const int* RLE_row, size_t n) {
+  int* dst = RowBuilderReserve(b, n);
+  memcpy(dst, RLE_row, n * sizeof(int));
+  RowBuilderCommit(b, n);
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+/// Forget the rows built, to build new ones in the same storage
+static void RowBuilderReset(RowBuilder* b) {
+  assert(b != NULL && b->table == NULL);
+  b->size = 0;
+  b->num_rows = 0;
+  b->repeated = 0;
+}
 
-  // All image pixels have the same value
-  int pixel_value = (int)val;
+/// Make the rows built the (RLE) storage of img, and release the builder
+/// The previous storage of img is released.
+static void RowBuilderAttach(RowBuilder* b, Image img) {
+  assert(b != NULL && img != NULL);
+  assert(b->num_rows == img->height);
 
-  // Creating the image rows, each row has just 1 run of pixels
-  // Each row is represented by an array of 3 elements [value,length,EOR]
-  for (uint32 i = 0; i < height; i++) {
-    newImage->row[i] = AllocateRLERowArray(3);
-    newImage->row[i][0] = pixel_value;
-    newImage->row[i][1] = (int)width;
-    newImage->row[i][2] = EOR;
+  // Give back unused capacity
+  SetStorage(img, ResizeSlab(b->slab, b->size * sizeof(int)));
+  int* runs = (int*)img->slab->data;
+  img->row = (int**)(img + 1);
+  for (uint32 i = 0; i < img->height; i++) {
+    img->row[i] = runs + b->offset[i];
   }
+  img->distinct_rows = !b->repeated;
+  free(b->offset);
+  free(b->table);
+  if (b->hash != NULL) {
+    // The hashes of the interned rows
+    ComputeDigest(img, b->hash);
+    free(img->row_hash);
+    img->row_hash = b->hash;
+  }
+
+  b->slab = NULL;
+  b->runs = NULL;
+  b->offset = NULL;
+  b->hash = NULL;
+  b->table = NULL;
+}
 
+/// Create the image whose rows were built, and release the builder
+static Image RowBuilderFinish(RowBuilder* b, uint32 width, uint32 height) {
+  Image newImage = AllocateImageHeader(width, height);
+  RowBuilderAttach(b, newImage);
   return newImage;
 }
 
-/// Create a new BW image, with a perfect CHESSBOARD pattern.
-///   width, height : the dimensions of the new image.
-///   square_edge : the lenght of the edges of the sqares making up the
-///   chessboard pattern.
-///   first_value: the pixel color (BLACK or WHITE) of the
-///   first image pixel.
-/// Requires: width and height must be non-negative, val is either BLACK or
-/// WHITE.
-/// Requires: for the squares, width and height must be multiples of the
-/// edge lenght of the squares
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
-                            uint8 first_value) {
-  // COMPLETE THE CODE
-  // ...
-  assert(width > 0 && height > 0);                                                   // Verifica se o width e o height não são negativos
-  assert(first_value == WHITE || first_value == BLACK);                              // Se o first_value é white ou black
-  assert(width%square_edge == 0 && height%square_edge == 0);                         // Verifica se o width e o heigt são múltiplos do tamanho de um lado do quadrado            
+// Memo of the rows built from given operand rows
+//
+// When the rows of an operand are repeated (see RowBuilderRepeat), the
+// result rows computed from them are repeated too: a RowMemo maps the
+// pointers to the operand rows (one or two) to the index of the result row
+// in a RowBuilder, so that each distinct operand row (or pair of rows) is
+// processed once.  Only stored rows (IMAGE_RLE) have stable pointers.
+//   RowMemo m;
+//   RowMemoInit(&m, num_rows);
+//   for each row i:
+//     RowMemoEntry* e = RowMemoFind(&m, row1, row2);
+//     if (e->row1 != NULL) { RowBuilderRepeat(&b, e->row); continue; }
+//     ...build the result row...
+//     RowMemoSet(e, row1, row2, index_of_the_result_row);
+//   free(m.entries);
+
+typedef struct {
+  const int* row1;  // the operand rows (NULL if the entry is free)
+  const int* row2;
+  uint32 row;       // the index of the result row
+} RowMemoEntry;
+
+typedef struct {
+  RowMemoEntry* entries;
+  uint32 mask;  // number of entries - 1 (a power of 2)
+} RowMemo;
+
+static void RowMemoInit(RowMemo* m, uint32 num_rows) {
+  uint32 size = 2;
+  while (size < 2 * num_rows) size *= 2;  // At most half full
+  m->entries = calloc(size, sizeof(RowMemoEntry));
+  assert(m->entries != NULL);
+  m->mask = size - 1;
+}
 
-  Image newImageChessboard = AllocateImageHeader(width, height);                     // Aloca o cabeçalho da imagem
+/// Find the entry of a pair of operand rows, or the free entry for it
+static RowMemoEntry* RowMemoFind(RowMemo* m, const int* row1,
+                                 const int* row2) {
+  uint64 h = MixHash(MixHash(0, (uint64)(uintptr_t)row1),
+                     (uint64)(uintptr_t)row2);
+  uint32 k = (uint32)h & m->mask;
+  while (m->entries[k].row1 != NULL &&
+         (m->entries[k].row1 != row1 || m->entries[k].row2 != row2)) {
+    k = (k + 1) & m->mask;
+  }
+  return &m->entries[k];
+}
 
-  int first_pixel = (int)first_value;
-  uint32 num = width/square_edge;                                                    // Números de quadrados existentes
+static void RowMemoSet(RowMemoEntry* e, const int* row1, const int* row2,
+                       uint32 row) {
+  e->row1 = row1;
+  e->row2 = row2;
+  e->row = row;
+}
 
-  for(uint32 i = 0; i < height; i++){                                                // Percorre as linhas 
-    newImageChessboard->row[i] = AllocateRLERowArray((int)num + 2);                  // Cada linha da imagem que vai ser criada terá alocado em um array o número de quadrados + first_pixel + EOR
+/// Get the total number of elements of the rows of an image
+/// (For packed images, the number of bytes, which is an upper bound.
+/// For bitmap images, an estimate.)
+static size_t GetSizeRLEImage(const Image img) {
+  assert(img != NULL);
 
-    if (i%square_edge == 0 && i != 0) {                                              // Para o 1º elemento de cada linha muda a cor entre WHITE e BLACK alternadamente
-      first_pixel = first_pixel == BLACK ? WHITE : BLACK;
+  size_t size = 0;
+  if (img->encoding == IMAGE_BITMAP) {
+    return (2 * (size_t)((img->width + 63) / 64) + 2) * img->height;
+  }
+  if (img->encoding == IMAGE_RLE_PACKED) {
+    // No code byte is 0 before the end mark
+    for (uint32 i = 0; i < img->height; i++) {
+      size += strlen((const char*)img->packed[i] + 1) + 2;
     }
+    return size;
+  }
+  for (uint32 i = 0; i < img->height; i++) {
+    size += GetSizeRLERowArray(img->row[i]);
+  }
+  return size;
+}
 
-    newImageChessboard->row[i][0] = first_pixel;                                     // O 1º elemento de cada linha vai ter o valor do first_pixel
+/// Check if img is the only user of its rows, which may then be modified
+/// in place: a single slab, not shared, with no row used twice.
+static int OwnsRows(const Image img) {
+  return img->num_slabs == 1 && atomic_load(&img->slabs[0]->refs) == 1 &&
+         img->distinct_rows;
+}
 
-    for (uint32 j = 0; j < num; j++) {                                               // Para cada quadrado possível
-      newImageChessboard->row[i][j+1] = (int)square_edge;                            // Os próximos elementos vão ter a largura do quadrado
+/// Copy on write: make img the only user of its rows, copying them
+/// (in the same encoding) if they are shared.
+static void OwnRows(Image img) {
+  if (OwnsRows(img)) return;
+  assert(img->encoding != IMAGE_BITMAP);  // Bitmap rows are never shared
+
+  if (img->encoding == IMAGE_RLE) {
+    RowBuilder b;
+    RowBuilderInit(&b, img->height, GetSizeRLEImage(img));
+    for (uint32 i = 0; i < img->height; i++) {
+      RowBuilderAppend(&b, img->row[i], GetSizeRLERowArray(img->row[i]));
     }
-
-    newImageChessboard->row[i][(int)num + 1] = EOR;                                  // O último elemento da linha será o end of row (EOR)
+    RowBuilderAttach(&b, img);
+    return;
   }
 
-  return newImageChessboard;
+  // Copy each packed row, and point to the copy
+  Slab* slab = AllocateSlab(GetSizeRLEImage(img));
+  uint8* bytes = (uint8*)slab->data;
+  for (uint32 i = 0; i < img->height; i++) {
+    size_t n = strlen((const char*)img->packed[i] + 1) + 2;
+    memcpy(bytes, img->packed[i], n);
+    img->packed[i] = bytes;
+    bytes += n;
+  }
+  SetStorage(img, slab);
 }
 
-/// Destroy the image pointed to by (*imgp).
-///   imgp : address of an Image variable.
-/// If (*imgp)==NULL, no operation is performed.
-/// Ensures: (*imgp)==NULL.
-/// Should never fail.
-void ImageDestroy(Image* imgp) {
-  assert(imgp != NULL);
+// Packed row encoding (IMAGE_RLE_PACKED)
+//
+// A packed row stores the same information as a RLE row, in bytes:
+//   [color] [run] [run] ... [0]
+// Each run length is a variable-length code (LEB128): 7 bits per byte,
+// least significant group first, with the top bit set on all bytes but the
+// last.  Runs below 128 take 1 byte, runs below 16384 take 2 bytes.
+// Run lengths are never 0, so a 0 byte marks the end of the row.
+
+/// Get the number of bytes needed to pack a RLE row
+static size_t GetSizePackedRow(const int* RLE_row) {
+  assert(RLE_row != NULL);
 
-  Image img = *imgp;
+  size_t size = 2;  // color and end mark
+  for (uint32 i = 1; RLE_row[i] != EOR; i++) {
+    uint32 run = (uint32)RLE_row[i];
+    do {
+      size++;
+      run >>= 7;
+    } while (run != 0);
+  }
+  return size;
+}
 
-  for (uint32 i = 0; i < img->height; i++) {
-    free(img->row[i]);
+/// Pack a RLE row into code, which must have room for
+/// GetSizePackedRow(RLE_row) bytes.
+/// Returns the number of bytes written.
+static size_t PackRow(const int* RLE_row, uint8* code) {
+  assert(RLE_row != NULL);
+  assert(code != NULL);
+
+  size_t n = 0;
+  code[n++] = (uint8)RLE_row[0];
+  for (uint32 i = 1; RLE_row[i] != EOR; i++) {
+    uint32 run = (uint32)RLE_row[i];
+    while (run >= 0x80) {
+      code[n++] = (uint8)(run | 0x80);
+      run >>= 7;
+    }
+    code[n++] = (uint8)run;
   }
-  free(img->row);
-  free(img);
+  code[n++] = 0;
+  return n;
+}
 
-  *imgp = NULL;
+/// Read the run length at *code (which must not be the final 0), and
+/// advance *code past it.
+static inline uint32 ReadPackedRun(const uint8** code) {
+  const uint8* p = *code;
+  uint32 run = *p++;
+  if (run & 0x80) {
+    // Multi-byte code (uncommon)
+    run &= 0x7F;
+    int shift = 7;
+    uint32 byte;
+    do {
+      byte = *p++;
+      run |= (byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+  }
+  *code = p;
+  return run;
 }
 
-/// Printing on the console
+/// Unpack a packed row into RLE_row, which must have room for
+/// (image_width + 2) elements.
+/// Returns the number of elements written, including EOR.
+static uint32 UnpackRow(const uint8* code, int* RLE_row) {
+  assert(code != NULL);
+  assert(RLE_row != NULL);
 
-/// Output the raw BW image
-void ImageRAWPrint(const Image img) {
-  assert(img != NULL);
+  RLE_row[0] = *code++;
+  uint32 n = 1;
+  while (*code != 0) {
+    RLE_row[n++] = (int)ReadPackedRun(&code);
+  }
+  RLE_row[n++] = EOR;
+  return n;
+}
 
-  printf("width = %d height = %d\n", img->width, img->height);
-  printf(" RAW image\n");
+// Bitmap row encoding (IMAGE_BITMAP)
+//
+// A bitmap row stores one bit per pixel, in 64-bit words:
+// pixel x is bit (x % 64) of word (x / 64).  The padding bits after the
+// last pixel are always 0.  All rows have the same number of words, and
+// are stored one after the other in the bits slab.
+// For noisy images, with more than about width/32 runs per row, a bitmap
+// row is smaller than a RLE row, and boolean operations on bitmap rows
+// can process 64 pixels (or more, with SIMD) per instruction.
+
+/// Number of 64-bit words of a bitmap row
+static uint32 GetNumWordsBitmapRow(uint32 image_width) {
+  return (image_width + 63) / 64;
+}
 
-  // Print the pixels of each image row
-  for (uint32 i = 0; i < img->height; i++) {
-    // The value of the first pixel in the current row
-    int pixel_value = img->row[i][0];
-    for (uint32 j = 1; img->row[i][j] != EOR; j++) {
-      // Print the current run of pixels
-      for (int k = 0; k < img->row[i][j]; k++) {
-        printf("%d", pixel_value);
-      }
-      // Switch (XOR) to the pixel value for the next run, if any
-      pixel_value ^= 1;
-    }
-    // At current row end
-    printf("\n");
-  }
-  printf("\n");
+/// Get the bitmap row i of img
+static uint64* GetBitmapRow(const Image img, uint32 i) {
+  assert(img->encoding == IMAGE_BITMAP);
+  assert(i < img->height);
+  return img->bits + (size_t)i * GetNumWordsBitmapRow(img->width);
 }
 
-/// Output the compressed RLE image
-void ImageRLEPrint(const Image img) {
-  assert(img != NULL);
+/// Create the header of an image data structure
+/// And allocate its (uninitialized) bitmap rows
+static Image AllocateBitmapImage(uint32 width, uint32 height) {
+  Image newImage = AllocateImageHeader(width, height);
 
-  printf("width = %d height = %d\n", img->width, img->height);
-  printf(" RLE encoding\n");
+  size_t num_words = (size_t)GetNumWordsBitmapRow(width) * height;
+  SetStorage(newImage, AllocateSlab(num_words * sizeof(uint64)));
+  newImage->bits = newImage->slab->data;
+  newImage->row = NULL;
+  newImage->encoding = IMAGE_BITMAP;
 
-  // Print the compressed rows information
-  for (uint32 i = 0; i < img->height; i++) {
-    uint32 j;
-    for (j = 0; img->row[i][j] != EOR; j++) {
-      printf("%d ", img->row[i][j]);
-    }
-    printf("%d\n", img->row[i][j]);
+  return newImage;
+}
+
+/// Set the bits of positions [start, end) of a bitmap row
+static void SetBitmapRange(uint64* bits, uint32 start, uint32 end) {
+  assert(start < end);
+  uint32 first = start / 64;
+  uint32 last = (end - 1) / 64;
+  uint64 first_mask = ~(uint64)0 << (start % 64);
+  uint64 last_mask = ~(uint64)0 >> (63 - (end - 1) % 64);
+  if (first == last) {
+    bits[first] |= first_mask & last_mask;
+    return;
   }
-  printf("\n");
+  bits[first] |= first_mask;
+  for (uint32 w = first + 1; w < last; w++) {
+    bits[w] = ~(uint64)0;
+  }
+  bits[last] |= last_mask;
 }
 
-/// PBM BW file operations
+/// Convert a RLE row into a bitmap row, in O(runs + words)
+static void RLERowToBitmap(uint32 image_width, const int* RLE_row,
+                           uint64* bits) {
+  assert(RLE_row != NULL && bits != NULL);
 
-// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+  memset(bits, 0, GetNumWordsBitmapRow(image_width) * sizeof(uint64));
+  int pixel_value = RLE_row[0];
+  uint32 x = 0;
+  for (uint32 i = 1; RLE_row[i] != EOR; i++) {
+    if (pixel_value == BLACK) SetBitmapRange(bits, x, x + RLE_row[i]);
+    x += RLE_row[i];
+    pixel_value ^= 1;
+  }
+}
 
-// Auxiliary function
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
+/// Convert a bitmap row into a RLE row, which must have room for
+/// (image_width + 2) elements.
+/// Whole words without transitions are skipped, and the position of each
+/// transition is found with a count-trailing-zeros instruction.
+/// Returns the number of elements written, including EOR.
+static uint32 BitmapRowToRLE(uint32 image_width, const uint64* bits,
+                             int* RLE_row) {
+  assert(bits != NULL && RLE_row != NULL);
+
+  uint32 num_words = GetNumWordsBitmapRow(image_width);
+  int pixel_value = (int)(bits[0] & 1);
+  // flip has all bits equal to the current pixel value, so that
+  // (word ^ flip) has 1s where the pixels differ from it
+  uint64 flip = pixel_value ? ~(uint64)0 : 0;
+  RLE_row[0] = pixel_value;
+  uint32 n = 1;
+  uint32 start = 0;  // Start of the current run
+  uint32 w = 0;
+  uint64 pending = bits[0] ^ flip;
+  for (;;) {
+    while (pending == 0) {
+      if (++w == num_words) goto end_of_row;
+      pending = bits[w] ^ flip;
     }
-    mask >>= 1;
-    offset++;
+    uint32 x = w * 64 + (uint32)__builtin_ctzll(pending);
+    // With BLACK pixels, the padding bits look like a transition
+    if (x >= image_width) break;
+    RLE_row[n++] = (int)(x - start);
+    start = x;
+    flip = ~flip;
+    pending = (bits[w] ^ flip) & (~(uint64)0 << (x % 64));
   }
+end_of_row:
+  RLE_row[n++] = (int)(image_width - start);
+  RLE_row[n++] = EOR;
+  return n;
 }
 
-// Auxiliary function
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[]) {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8) {  // or (mask > 0)
-    for (int b = 0; b < nbytes; b++) {
-      if (offset == 0) bytes[b] = 0;
-      bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
-    }
-    mask >>= 1;
-    offset++;
-  }
-}
-
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// Boolean operation codes
+//
+// Binary boolean operations are given by their truth table:
+// bit (2*a + b) of the op code holds the result for pixel values a and b.
+#define OP_AND 0x8     // a & b
+#define OP_OR 0xE      // a | b
+#define OP_XOR 0x6     // a ^ b
+#define OP_NOTA 0x3    // ~a
+
+// Word-parallel kernels for bitmap rows
+//
+// WordsOp applies a boolean op to n words of two bitmaps,
+// WordsTransitions counts the pixel transitions in a bitmap row, and
+// WordsCount counts the BLACK pixels (set bits) of n words.
+// Each kernel has a portable version, and on x86 versions for the vector
+// and popcount instructions.  The best ones supported by the running CPU
+// are selected by ImageInit (see SelectKernels).
+
+/// Apply op to n words of a and b (portable version)
+static void WordsOpGeneric(const uint64* a, const uint64* b, uint64* out,
+                           size_t n, int op) {
+  switch (op) {
+    case OP_AND:
+      for (size_t k = 0; k < n; k++) out[k] = a[k] & b[k];
+      break;
+    case OP_OR:
+      for (size_t k = 0; k < n; k++) out[k] = a[k] | b[k];
+      break;
+    case OP_XOR:
+      for (size_t k = 0; k < n; k++) out[k] = a[k] ^ b[k];
+      break;
+    case OP_NOTA:
+      for (size_t k = 0; k < n; k++) out[k] = ~a[k];
+      break;
+    default: {
+      // Any other op, from its truth table
+      uint64 m0 = (op & 1) ? ~(uint64)0 : 0;
+      uint64 m1 = (op & 2) ? ~(uint64)0 : 0;
+      uint64 m2 = (op & 4) ? ~(uint64)0 : 0;
+      uint64 m3 = (op & 8) ? ~(uint64)0 : 0;
+      for (size_t k = 0; k < n; k++) {
+        out[k] = (a[k] & b[k] & m3) | (a[k] & ~b[k] & m2) |
+                 (~a[k] & b[k] & m1) | (~a[k] & ~b[k] & m0);
+      }
+    }
   }
-  return i;
 }
 
-/// Load a raw PBM file.
-/// Only binary PBM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageLoad(const char* filename) {  ///
-  int w, h;
-  char c;
-  FILE* f = NULL;
-  Image img = NULL;
-
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
-  // Parse PBM header
-  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
-  skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
-  skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
-
-  // Allocate image
-  img = AllocateImageHeader(w, h);
-
-  // Read pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
-  for (uint32 i = 0; i < img->height; i++) {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Reading pixels");
-    unpackBits(nbytes, bytes, raw_row);
-    img->row[i] = CompressRow(w, raw_row);
+/// Count the transitions between consecutive pixels of a bitmap row
+/// (portable version)
+static uint64 WordsTransitionsGeneric(const uint64* bits, uint32 image_width) {
+  uint32 num_words = GetNumWordsBitmapRow(image_width);
+  uint64 count = 0;
+  uint64 prev = bits[0] & 1;  // No transition before the first pixel
+  for (uint32 w = 0; w < num_words; w++) {
+    // Bit k is set if pixel k differs from pixel k-1
+    uint64 t = bits[w] ^ ((bits[w] << 1) | prev);
+    prev = bits[w] >> 63;
+    if (w == num_words - 1 && image_width % 64 != 0) {
+      t &= ~(~(uint64)0 << (image_width % 64));  // Ignore padding
+    }
+    for (; t != 0; t &= t - 1) count++;
   }
+  return count;
+}
 
-  fclose(f);
-  return img;
+/// Count the set bits of n words (portable version)
+static uint64 WordsCountGeneric(const uint64* bits, size_t n) {
+  uint64 count = 0;
+  for (size_t k = 0; k < n; k++) {
+    // Add up the bits in pairs, nibbles, and then bytes
+    uint64 w = bits[k];
+    w -= (w >> 1) & 0x5555555555555555ull;
+    w = (w & 0x3333333333333333ull) + ((w >> 2) & 0x3333333333333333ull);
+    w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    count += (w * 0x0101010101010101ull) >> 56;
+  }
+  return count;
 }
 
-/// Save image to PBM file.
-/// On success, returns nonzero.
-/// On failure, returns 0, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(const Image img, const char* filename) {  ///
-  assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
-  FILE* f = NULL;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/// Apply op to n words of a and b (SSE2 version)
+__attribute__((target("sse2"))) static void WordsOpSSE2(const uint64* a,
+                                                        const uint64* b,
+                                                        uint64* out, size_t n,
+                                                        int op) {
+  size_t k = 0;
+  const __m128i ones = _mm_set1_epi32(-1);
+  for (; k + 2 <= n; k += 2) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + k));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + k));
+    __m128i r;
+    switch (op) {
+      case OP_AND: r = _mm_and_si128(va, vb); break;
+      case OP_OR: r = _mm_or_si128(va, vb); break;
+      case OP_XOR: r = _mm_xor_si128(va, vb); break;
+      case OP_NOTA: r = _mm_xor_si128(va, ones); break;
+      default: goto tail;
+    }
+    _mm_storeu_si128((__m128i*)(out + k), r);
+  }
+tail:
+  WordsOpGeneric(a + k, b + k, out + k, n - k, op);
+}
 
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+/// Apply op to n words of a and b (AVX2 version)
+__attribute__((target("avx2"))) static void WordsOpAVX2(const uint64* a,
+                                                        const uint64* b,
+                                                        uint64* out, size_t n,
+                                                        int op) {
+  size_t k = 0;
+  const __m256i ones = _mm256_set1_epi32(-1);
+  for (; k + 4 <= n; k += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + k));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + k));
+    __m256i r;
+    switch (op) {
+      case OP_AND: r = _mm256_and_si256(va, vb); break;
+      case OP_OR: r = _mm256_or_si256(va, vb); break;
+      case OP_XOR: r = _mm256_xor_si256(va, vb); break;
+      case OP_NOTA: r = _mm256_xor_si256(va, ones); break;
+      default: goto tail;
+    }
+    _mm256_storeu_si256((__m256i*)(out + k), r);
+  }
+tail:
+  WordsOpGeneric(a + k, b + k, out + k, n - k, op);
+}
 
-  // Write pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  // unit8 raw_row[nbytes*8];
-  for (uint32 i = 0; i < img->height; i++) {
-    // UncompressRow...
-    uint8* raw_row = UncompressRow(nbytes * 8, img->row[i]);
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    check(fwrite(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Writing pixels failed");
-    free(raw_row);
+/// Count the transitions of a bitmap row (POPCNT version)
+__attribute__((target("popcnt"))) static uint64 WordsTransitionsPOPCNT(
+    const uint64* bits, uint32 image_width) {
+  uint32 num_words = GetNumWordsBitmapRow(image_width);
+  uint64 count = 0;
+  uint64 prev = bits[0] & 1;
+  for (uint32 w = 0; w < num_words; w++) {
+    uint64 t = bits[w] ^ ((bits[w] << 1) | prev);
+    prev = bits[w] >> 63;
+    if (w == num_words - 1 && image_width % 64 != 0) {
+      t &= ~(~(uint64)0 << (image_width % 64));
+    }
+    count += (uint64)__builtin_popcountll(t);
   }
+  return count;
+}
 
-  // Cleanup
-  fclose(f);
-  return 0;
+/// Count the set bits of n words (POPCNT version)
+__attribute__((target("popcnt"))) static uint64 WordsCountPOPCNT(
+    const uint64* bits, size_t n) {
+  uint64 count = 0;
+  for (size_t k = 0; k < n; k++) count += (uint64)__builtin_popcountll(bits[k]);
+  return count;
 }
 
-/// Information queries
+#endif
+
+// The selected kernels
+static void (*WordsOp)(const uint64*, const uint64*, uint64*, size_t,
+                       int) = WordsOpGeneric;
+static uint64 (*WordsTransitions)(const uint64*,
+                                  uint32) = WordsTransitionsGeneric;
+static uint64 (*WordsCount)(const uint64*, size_t) = WordsCountGeneric;
+
+/// Select the fastest kernels supported by the CPU
+static void SelectKernels(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    WordsOp = WordsOpAVX2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    WordsOp = WordsOpSSE2;
+  }
+  if (__builtin_cpu_supports("popcnt")) {
+    WordsTransitions = WordsTransitionsPOPCNT;
+    WordsCount = WordsCountPOPCNT;
+  }
+#endif
+}
 
-/// Get image width
-int ImageWidth(const Image img) {
-  assert(img != NULL);
-  return img->width;
+/// Apply op to num_rows consecutive bitmap rows,
+/// keeping the padding bits at 0
+static void BitmapRowsOp(uint32 image_width, uint32 num_rows,
+                         const uint64* bits1, const uint64* bits2,
+                         uint64* out, int op) {
+  uint32 num_words = GetNumWordsBitmapRow(image_width);
+  // Rows are contiguous: a single pass over all their words
+  WordsOp(bits1, bits2, out, (size_t)num_words * num_rows, op);
+  PIXMEM += (size_t)num_words * num_rows;
+  if ((op & 1) && image_width % 64 != 0) {
+    // op(0, 0) is 1, so the padding bits were set
+    uint64 mask = ~(~(uint64)0 << (image_width % 64));
+    for (uint32 i = 1; i <= num_rows; i++) {
+      out[(size_t)i * num_words - 1] &= mask;
+    }
+  }
 }
 
-/// Get image height
-int ImageHeight(const Image img) {
+// Reading rows regardless of the encoding
+//
+// Operations read the rows of their operands through GetRLERow.
+// For IMAGE_RLE images, it simply returns the stored row.
+// For other encodings, it decodes the row into a buffer supplied by the
+// caller, obtained from AllocateRowBuffer, and freed with free().
+//   int* buf = AllocateRowBuffer(img);
+//   for each row i:
+//     const int* row = GetRLERow(img, i, buf);
+//   free(buf);
+
+/// Allocate a buffer to decode rows of img, if needed (may return NULL)
+static int* AllocateRowBuffer(const Image img) {
   assert(img != NULL);
-  return img->height;
-}
+  if (img->encoding == IMAGE_RLE) return NULL;
 
-/// Image comparison
+  int* buf = malloc((img->width + 2) * sizeof(int));
+  assert(buf != NULL);
+  return buf;
+}
 
-int ImageIsEqual(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
+/// Get row i of img in RLE format
+static const int* GetRLERow(const Image img, uint32 i, int* buf) {
+  assert(img != NULL);
+  assert(i < img->height);
 
-  // COMPLETE THE CODE
-  uint32 width1 = img1->width;    // Largura da 1ª imagem
-  uint32 height1 = img1->height;  // Altura da 1ª imagem
+  if (img->encoding == IMAGE_RLE) return img->row[i];
 
-  uint32 witdh2 = img2->width;    // Largura da 2ª imagem
-  uint32 height2 = img2->height;   // Altura da 2ª imagem
+  assert(buf != NULL);
+  if (img->encoding == IMAGE_BITMAP) {
+    BitmapRowToRLE(img->width, GetBitmapRow(img, i), buf);
+  } else {
+    UnpackRow(img->packed[i], buf);
+  }
+  return buf;
+}
 
-  int** rows1 = img1->row;          // Ponteiro para as linhas da 1ª imagem
-  int** rows2 = img2->row;          // Ponteiro para as linhas da 2ª imagem                                  
-  
-  for(uint32 i = 0; i < height1; i++){                            // Para cada linha da imagem
-    uint8* row1 = UncompressRow(width1, rows1[i]);                 // Passa de RLE para RAW
-    uint8* row2 = UncompressRow(witdh2, rows2[i]);                  
+// Parallel execution
+//
+// Operations process rows independently, so their rows can be split into
+// chunks of consecutive rows, run by a pool of worker threads
+// (see ImageSetThreads).  The calling thread runs chunks too, and waits
+// for all of them to finish.
+// When building an image, each chunk builds its rows with its own
+// RowBuilder, and the chunks are joined in order at the end, so the result
+// does not depend on the number of threads or on scheduling.
+// Chunk boundaries are chosen so that chunks have about the same number of
+// row elements (runs), not the same number of rows.
+// Worker threads count operations in their own instrumentation counters,
+// which are added to the counters of the calling thread when the job ends,
+// so that its regions include the work of the workers.
+
+#define MAX_THREADS 256
+#define CHUNKS_PER_THREAD 4   // More chunks than threads, for balance
+#define MIN_PARALLEL_WORK 16384  // Less work (in elements) runs serially
+
+typedef struct {
+  void (*run)(void* ctx, uint32 chunk);
+  void* ctx;
+  uint32 num_chunks;
+  uint32 next_chunk;  // Next chunk to be taken by a thread
+  uint32 num_done;    // Number of chunks finished
+} ParallelJob;
+
+static int num_threads = 1;  // Including the calling thread
+static pthread_t workers[MAX_THREADS];
+// The counters of each worker, once it has started, and their values then
+// (a new thread may get the counters of an ended one, with its counts)
+static unsigned long* worker_counters[MAX_THREADS];
+static unsigned long worker_start[MAX_THREADS][NUMCOUNTERS];
+// The pool state is protected by pool_mutex
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;  // New job
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;  // Job finished
+static ParallelJob* pool_job = NULL;
+static unsigned long pool_generation = 0;  // Incremented for every job
+static int pool_quit = 0;
+// Only one job (and pool resize) at a time
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Set in threads running chunks: nested jobs run serially
+static _Thread_local int in_parallel_job = 0;
+
+/// Take and run chunks of job until none is left.
+/// Called, and returns, with pool_mutex locked.
+static void RunChunks(ParallelJob* job) {
+  while (job->next_chunk < job->num_chunks) {
+    uint32 chunk = job->next_chunk++;
+    pthread_mutex_unlock(&pool_mutex);
+    job->run(job->ctx, chunk);
+    pthread_mutex_lock(&pool_mutex);
+    if (++job->num_done == job->num_chunks) {
+      pthread_cond_broadcast(&pool_done);
+    }
+  }
+}
 
-    for(uint32 j = 0; j < width1; j++){                            // Para cada pixel da linha
-      if(row1[j] != row2[j]){                                      // Se os pixels forem diferentes
-        return 0;                                                  // Retorna 0
-      }
+static void* WorkerMain(void* arg) {
+  int id = (int)(intptr_t)arg;
+  in_parallel_job = 1;
+
+  pthread_mutex_lock(&pool_mutex);
+  worker_counters[id] = Counters();
+  memcpy(worker_start[id], worker_counters[id], sizeof(worker_start[id]));
+  unsigned long seen = pool_generation;
+  for (;;) {
+    while (!pool_quit && (pool_job == NULL || pool_generation == seen)) {
+      pthread_cond_wait(&pool_work, &pool_mutex);
     }
-  free(row1);
-  free(row2);
+    if (pool_quit) break;
+    seen = pool_generation;
+    RunChunks(pool_job);
   }
-  return 1;
+  pthread_mutex_unlock(&pool_mutex);
+  return NULL;
 }
 
-int ImageIsDifferent(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  return !ImageIsEqual(img1, img2);
+/// Run run(ctx, chunk) for chunk = 0 .. num_chunks-1, in parallel.
+/// Returns when all have finished.
+static void ParallelFor(uint32 num_chunks, void (*run)(void*, uint32),
+                        void* ctx) {
+  if (num_threads == 1 || num_chunks < 2 || in_parallel_job) {
+    for (uint32 chunk = 0; chunk < num_chunks; chunk++) run(ctx, chunk);
+    return;
+  }
+
+  pthread_mutex_lock(&job_mutex);
+  ParallelJob job = {run, ctx, num_chunks, 0, 0};
+  pthread_mutex_lock(&pool_mutex);
+  pool_job = &job;
+  pool_generation++;
+  pthread_cond_broadcast(&pool_work);
+  in_parallel_job = 1;
+  RunChunks(&job);
+  while (job.num_done < job.num_chunks) {
+    pthread_cond_wait(&pool_done, &pool_mutex);
+  }
+  in_parallel_job = 0;
+  pool_job = NULL;
+
+  // Move the operations counted by the workers to this thread
+  unsigned long* mine = Counters();
+  for (int t = 1; t < num_threads; t++) {
+    if (worker_counters[t] == NULL) continue;  // Not started yet
+    for (int k = 0; k < NUMCOUNTERS; k++) {
+      mine[k] += worker_counters[t][k] - worker_start[t][k];
+      worker_counters[t][k] = worker_start[t][k];
+    }
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  pthread_mutex_unlock(&job_mutex);
 }
 
-/// Boolean Operations on image pixels
+/// Split rows [0, height) into chunks of about the same weight.
+/// weight(ctx, i) estimates the work for row i (NULL means 1 for all).
+/// Fills first[0..num_chunks] with the first row of each chunk (and height),
+/// and returns the number of chunks, at most max_chunks.
+static uint32 SplitRows(uint32 height, size_t (*weight)(void*, uint32),
+                        void* ctx, uint32 max_chunks, uint32* first) {
+  if (max_chunks > height) max_chunks = height;
+  if (weight == NULL) {
+    for (uint32 k = 0; k <= max_chunks; k++) {
+      first[k] = (uint32)((uint64)height * k / max_chunks);
+    }
+    return max_chunks;
+  }
 
-/// These functions apply boolean operations to images,
-/// returning a new image as a result.
-///
-/// Operand images are left untouched and must be of the same size.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+  uint64 total = 0;
+  for (uint32 i = 0; i < height; i++) total += weight(ctx, i);
+
+  // Start a new chunk each time the running total passes a multiple of
+  // total / max_chunks
+  uint32 num_chunks = 0;
+  uint64 sum = 0;
+  first[num_chunks++] = 0;
+  for (uint32 i = 0; i < height && num_chunks < max_chunks; i++) {
+    sum += weight(ctx, i);
+    if (sum * max_chunks >= total * num_chunks && i + 1 < height) {
+      first[num_chunks++] = i + 1;
+    }
+  }
+  first[num_chunks] = height;
+  return num_chunks;
+}
 
-Image ImageNEG(const Image img) {
-  assert(img != NULL);
+/// Estimated number of elements of row i of img, in O(1) time.
+/// Rows are normally stored in order in the slab, so the distance to the
+/// next row is the size of a row; the row is scanned only otherwise.
+static size_t RowWeight(const Image img, uint32 i) {
+  switch (img->encoding) {
+    case IMAGE_RLE:
+      if (i + 1 < img->height && img->row[i + 1] > img->row[i] &&
+          img->row[i + 1] - img->row[i] <= (ptrdiff_t)img->width + 2) {
+        return img->row[i + 1] - img->row[i];
+      }
+      return GetSizeRLERowArray(img->row[i]);
+    case IMAGE_RLE_PACKED:
+      if (i + 1 < img->height && img->packed[i + 1] > img->packed[i] &&
+          img->packed[i + 1] - img->packed[i] <= 5 * (ptrdiff_t)img->width + 2) {
+        return img->packed[i + 1] - img->packed[i];
+      }
+      return strlen((const char*)img->packed[i] + 1) + 2;
+    default:
+      return GetNumWordsBitmapRow(img->width);
+  }
+}
 
-  uint32 width = img->width;
-  uint32 height = img->height;
+// Building the rows of an image with a RowsTask
+//
+// A RowsTask computes rows [first, last) of a new image, appending them
+// to b (see RowBuilder).  BuildImage runs it on chunks of rows, in parallel
+// when worthwhile, and joins the chunks into the new image.
+
+typedef void (*RowsTask)(void* ctx, uint32 first, uint32 last, RowBuilder* b);
+
+typedef struct {
+  RowsTask task;
+  size_t (*weight)(void*, uint32);
+  void* ctx;
+  const uint32* first;  // First row of each chunk
+  RowBuilder* parts;    // The rows built by each chunk
+} BuildJob;
+
+static void BuildChunk(void* ctx, uint32 chunk) {
+  BuildJob* job = ctx;
+  uint32 first = job->first[chunk];
+  uint32 last = job->first[chunk + 1];
+  size_t estimate = 0;
+  for (uint32 i = first; i < last; i++) estimate += job->weight(job->ctx, i);
+  RowBuilderInit(&job->parts[chunk], last - first, estimate);
+  job->task(job->ctx, first, last, &job->parts[chunk]);
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+/// Create an image with rows built by task.
+///   weight(ctx, i): estimated number of elements of row i of the result,
+///   used to size the slab and to balance the chunks.
+static Image BuildImage(uint32 width, uint32 height,
+                        size_t (*weight)(void*, uint32), RowsTask task,
+                        void* ctx) {
+  uint64 total = 0;
+  for (uint32 i = 0; i < height; i++) total += weight(ctx, i);
+
+  if (num_threads == 1 || in_parallel_job || height < 2 ||
+      total < MIN_PARALLEL_WORK) {
+    RowBuilder b;
+    RowBuilderInit(&b, height, total);
+    task(ctx, 0, height, &b);
+    return RowBuilderFinish(&b, width, height);
+  }
 
-  // Directly copying the rows, one by one
-  // And changing the value of row[i][0]
+  uint32 first[MAX_THREADS * CHUNKS_PER_THREAD + 1];
+  uint32 num_chunks = SplitRows(height, weight, ctx,
+                                num_threads * CHUNKS_PER_THREAD, first);
+  RowBuilder parts[MAX_THREADS * CHUNKS_PER_THREAD];
+  BuildJob job = {task, weight, ctx, first, parts};
+  ParallelFor(num_chunks, BuildChunk, &job);
 
-  for (uint32 i = 0; i < height; i++) {
-    uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-    newImage->row[i] = AllocateRLERowArray(num_elems);
-    memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-    newImage->row[i][0] ^= 1;  // Just negate the value of the first pixel run
+  // Join the chunks in order, in a single slab
+  size_t size = 0;
+  for (uint32 k = 0; k < num_chunks; k++) size += parts[k].size;
+  Image newImage = AllocateImageHeader(width, height);
+  SetStorage(newImage, AllocateSlab(size * sizeof(int)));
+  int* runs = (int*)newImage->slab->data;
+  int hashed = 1;
+  for (uint32 k = 0; k < num_chunks; k++) hashed &= parts[k].hash != NULL;
+  uint64* hash = NULL;
+  if (hashed) {
+    hash = malloc(((size_t)height + 1) * sizeof(uint64));
+    assert(hash != NULL);
+  }
+  size_t base = 0;
+  for (uint32 k = 0; k < num_chunks; k++) {
+    memcpy(runs + base, parts[k].runs, parts[k].size * sizeof(int));
+    for (uint32 j = 0; j < parts[k].num_rows; j++) {
+      newImage->row[first[k] + j] = runs + base + parts[k].offset[j];
+    }
+    if (hashed) {
+      memcpy(hash + first[k], parts[k].hash,
+             parts[k].num_rows * sizeof(uint64));
+    }
+    if (parts[k].repeated) newImage->distinct_rows = 0;
+    base += parts[k].size;
+    ReleaseSlab(parts[k].slab);
+    free(parts[k].offset);
+    free(parts[k].hash);
+    free(parts[k].table);
+  }
+  if (hashed) {
+    ComputeDigest(newImage, hash);
+    newImage->row_hash = hash;
   }
-
   return newImage;
 }
 
-// Image ImageAND(const Image img1, const Image img2) {
-//   assert(img1 != NULL && img2 != NULL);                                               // Verifica se elas existem
-//   assert(img1->width == img2->width && img1->height == img2->height);                 // Verifica se tem ambas a mesma altura e largura
-//   // COMPLETE THE CODE
-//   // You might consider using the UncompressRow and CompressRow auxiliary files
-//   // Or devise a more efficient alternative
-//   // ...
+// Processing rows in place
+//
+// ParallelRows runs task(ctx, first, last) on chunks of rows [0, height),
+// for operations that write to storage allocated beforehand.
+
+typedef struct {
+  void (*task)(void* ctx, uint32 first, uint32 last);
+  void* ctx;
+  const uint32* first;
+} RowsJob;
+
+static void RowsChunk(void* ctx, uint32 chunk) {
+  RowsJob* job = ctx;
+  job->task(job->ctx, job->first[chunk], job->first[chunk + 1]);
+}
 
-//   InstrReset();
-//   InstrName[0] = "Opps";
+/// Run task on chunks of rows [0, height), in parallel when worthwhile
+///   work: estimated total work (in elements), split evenly among rows.
+static void ParallelRows(uint32 height, uint64 work,
+                         void (*task)(void*, uint32, uint32), void* ctx) {
+  if (num_threads == 1 || in_parallel_job || height < 2 ||
+      work < MIN_PARALLEL_WORK) {
+    task(ctx, 0, height);
+    return;
+  }
+  uint32 first[MAX_THREADS * CHUNKS_PER_THREAD + 1];
+  uint32 num_chunks =
+      SplitRows(height, NULL, NULL, num_threads * CHUNKS_PER_THREAD, first);
+  RowsJob job = {task, ctx, first};
+  ParallelFor(num_chunks, RowsChunk, &job);
+}
 
-//   uint32 width = img1->width;                                                         
-//   uint32 height = img1->height;
-//   Image newImageAND = AllocateImageHeader(width,height);                              
+// Row hashes
+//
+// ImageDigest computes a 64-bit hash of each row, from its RLE form, so that
+// rows with the same pixels have the same hash, whatever their encoding.
+// The hashes are cached in the image (row_hash), together with the digest
+// of the whole image, until its pixels are modified (see DropRowHashes).
+// The digest follows the hashes of the rows, in the same block, which is
+// built privately and then published: as with the run index, threads
+// hashing the same image at once each build their own block, and the first
+// one to publish it wins.
+// ImageIsEqual uses them, when available, to reject different rows
+// without comparing their runs.
+// Images made of rows of other images (ImageCopy, ImageHorizontalMirror,
+// ImageReplicateAtBottom) inherit their hashes.
+
+typedef struct {
+  Image img;
+  uint64* hash;
+} HashArgs;
+
+/// Hash rows [first, last) of an image
+static void HashRows(void* ctx, uint32 first, uint32 last) {
+  HashArgs* args = ctx;
+  int* buf = AllocateRowBuffer(args->img);
+  for (uint32 i = first; i < last; i++) {
+    args->hash[i] = HashRLERow(GetRLERow(args->img, i, buf));
+  }
+  free(buf);
+}
 
-//   for(uint32 i = 0; i < height; i++){
-//     uint8* row_img1 = UncompressRow(width,img1->row[i]);                              // Cada linha da 1ª imagem vai passar de RLE para RAW
-//     uint8* row_img2 = UncompressRow(width,img2->row[i]);
+/// Get the cached row hashes of img (followed by its digest), or NULL
+static inline const uint64* GetRowHashes(const Image img) {
+  return atomic_load_explicit(&img->row_hash, memory_order_acquire);
+}
 
-//     uint8* newImagerow = malloc(width * sizeof(uint8));                               // A nova imagem vai guardar o tamnho da largura que precisa de ter
-//     for(uint32 j = 0; j < width; j++){
-//       newImagerow[j] = row_img1[j] & row_img2[j];                                     // A cada linha das duas imagens foi aplicada a operação de AND 
-//       InstrCount[0] += 1;
-//     }
+/// Compute the hash of each row of img, and the digest, if not cached
+/// (thread-safe).
+/// Returns the hashes, followed by the digest.
+static const uint64* ComputeRowHashes(Image img) {
+  uint64* cached = atomic_load_explicit(&img->row_hash, memory_order_acquire);
+  if (cached != NULL) return cached;
+
+  uint64* hash = malloc(((size_t)img->height + 1) * sizeof(uint64));
+  assert(hash != NULL);
+  HashArgs args = {img, hash};
+  uint64 work = 0;
+  for (uint32 i = 0; i < img->height; i++) work += RowWeight(img, i);
+  ParallelRows(img->height, work, HashRows, &args);
+  ComputeDigest(img, hash);
+
+  // Publish the hashes, unless another thread did it first
+  if (!atomic_compare_exchange_strong(&img->row_hash, &cached, hash)) {
+    free(hash);
+    return cached;
+  }
+  return hash;
+}
 
-//     newImageAND->row[i] = CompressRow(width, newImagerow);                            // Passa de RAW para RLE
-//     free(row_img1);                            
-//     free(row_img2);
-//   }  
+/// Forget the cached hashes of img (when its pixels change)
+static void DropRowHashes(Image img) {
+  free(img->row_hash);
+  img->row_hash = NULL;
+}
 
-//   InstrPrint();
+/// Give img, made of the rows of src1 followed by those of src2 (if any),
+/// in reverse order if flip, the cached hashes of those rows, if available
+static void InheritRowHashes(Image img, const Image src1, const Image src2,
+                             int flip) {
+  const uint64* hash1 = GetRowHashes(src1);
+  const uint64* hash2 = src2 != NULL ? GetRowHashes(src2) : NULL;
+  if (hash1 == NULL || (src2 != NULL && hash2 == NULL)) return;
+  uint64* hash = malloc(((size_t)img->height + 1) * sizeof(uint64));
+  assert(hash != NULL);
+  for (uint32 i = 0; i < src1->height; i++) {
+    hash[flip ? img->height - i - 1 : i] = hash1[i];
+  }
+  if (src2 != NULL) {
+    memcpy(hash + src1->height, hash2, src2->height * sizeof(uint64));
+  }
+  ComputeDigest(img, hash);
+  img->row_hash = hash;
+}
 
-//   return newImageAND;
-// }
+// Run index
+//
+// To find the run containing a column without walking the row, the first
+// column of each run can be kept: run_start[i][k] is the first column of
+// run k of row i, run_start[i][n] is the width (n is the number of runs),
+// and run_start[i][-1] is n.  Then a binary search finds a run in
+// O(log runs).
+// The index is built when first needed (IMAGE_RLE rows only), in a single
+// block, once per distinct row, and dropped when the rows change (see
+// ReleaseStorage and ImageVerticalMirrorInPlace).
+// Threads may build the index of the same image at once: each builds its
+// own block, and the first one to publish it wins (the others free theirs).
+
+/// Get the run index of img, or NULL if it is not built
+static inline uint32** GetRunIndex(const Image img) {
+  return atomic_load_explicit(&img->run_start, memory_order_acquire);
+}
 
+/// Build the run index of img (IMAGE_RLE), if not built yet
+/// (Thread-safe.)
+static void BuildRunIndex(Image img) {
+  assert(img->encoding == IMAGE_RLE);
+  if (GetRunIndex(img) != NULL) return;
 
-Image ImageAND(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);                                                           // Verifica se as imagens não são nulas e têm as mesmas dimensões
-    assert(ImageWidth(img1) == ImageWidth(img2) && ImageHeight(img1) == ImageHeight(img2));
-    
-    InstrReset();                                                                                   // Reset dos contadores de operações
-    InstrName[0] = "Opps";
-
-    int height = ImageHeight(img1);
-    int width = ImageWidth(img1);
-    
-    Image result = AllocateImageHeader(width, height);                                              // Aloca uma nova imagem para armazenar o resultado
-    assert(result != NULL);
-
-    for (uint32 y = 0; y < height; y++) {                                                           // Itera sobre cada linha da imagem     
-        const int* rle_row1 = img1->row[y];                                                         // Ponteiro que aponta para cada linha da imagem 1
-        const int* rle_row2 = img2->row[y];
-        int* rle_result = AllocateRLERowArray(width);
-
-        int idx1 = 1, idx2 = 1;                                                                     // Começa no 1, pois o 0 é o first pixel
-        int index_res = 0;                                                                          // Index do retorno
-        int sum_0s = 0;                                                                             // Run de cor branca (0s)
-        int val1 = rle_row1[0];                                                                     // Cor da run atual da imagem 1
-        int val2 = rle_row2[0];
-        int rest1 = 0, rest2 = 0;                                                                   // Resto da run atual                                                                        
-
-        rle_result[index_res++] = val1 == val2 && val1 == BLACK ? BLACK : WHITE;                    // Se ambos as primeiras runs são BLACK então a 1 run da nova imagem é BLACK
-
-        while (rle_row1[idx1] != EOR && rle_row2[idx2] != EOR) {                                    // While até pelo menos uma das linhas terminar as runs
-            
-            int val_row1 = rest1 == 0 ? rle_row1[idx1] : rest1;                                     // Utiliza o resto antes de utilizar o valor da próxima run
-            int val_row2 = rest2 == 0 ? rle_row2[idx2] : rest2;                                     
-            int min_val = (val_row1 < val_row2) ? val_row1 : val_row2;                              // Valor minimo
-
-            if (val1 == val2 && val1 == BLACK) {                                                    // Se ambas as runs forem BLACK
-
-              if (sum_0s != 0) {
-                rle_result[index_res++] = sum_0s;                                                   // Tamanho de uma run de WHITE (0)
-                sum_0s = 0;
-              }
-
-              rle_result[index_res++] = min_val;                                                    // Guarda o valor da run
-
-            } else {                                                                                // Se uma run for da cor WHITE
-              sum_0s += min_val;                                                                    // Soma do tamanho minimo
-              rest1 = 0; rest2 = 0;
-            }
-
-            if (val_row1 > min_val) {                                                               // Se for maior que o valor guardado
-              rest1 = val_row1 - min_val;                                                           // A esse valor subtrai-se o valor minimo
-            } else {
-              val1 = val1 == BLACK ? WHITE : BLACK;                                                 // Senão guarda-se que a cor da próxima run é diferente
-              idx1++;                                                                               // Passar para a próxima run
-            }
-
-            if (val_row2 > min_val) {
-              rest2 = val_row2 - min_val;
-            } else {
-              val2 = val2 == BLACK ? WHITE : BLACK;
-              idx2++;
-            }
-
-            InstrCount[0]++;                                                                        // Incrementar a operação
-        }
+  uint32 height = img->height;
+  // Rows stored once are indexed once
+  int memo = !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, height);
+
+  // Where the index of each row goes, in the start columns
+  size_t size = 0;
+  size_t* offset = malloc(height * sizeof(size_t));
+  assert(offset != NULL);
+  for (uint32 i = 0; i < height; i++) {
+    const int* row = img->row[i];
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      offset[i] = offset[e->row];
+      continue;
+    }
+    offset[i] = size + 1;  // After the number of runs
+    size += GetNumRunsInRLERow(row) + 2;
+    if (e != NULL) RowMemoSet(e, row, NULL, i);
+  }
+  free(m.entries);
 
-        if (sum_0s != 0) {
-          rle_result[index_res++] = sum_0s;                                                         // Guardar no final os 0s
-          sum_0s = 0;
-        }
+  // The row pointers, followed by the start columns
+  uint32** index = malloc(height * sizeof(uint32*) + size * sizeof(uint32));
+  assert(index != NULL);
+  uint32* data = (uint32*)(index + height);
+  size_t filled = 0;  // Rows at offsets below were indexed
+  for (uint32 i = 0; i < height; i++) {
+    uint32* start = data + offset[i];
+    index[i] = start;
+    if (offset[i] < filled) continue;  // Repeated row
+    const int* row = img->row[i];
+    uint32 x = 0;
+    uint32 k = 0;
+    for (; row[k + 1] != EOR; k++) {
+      start[k] = x;
+      x += (uint32)row[k + 1];
+    }
+    start[k] = x;
+    start[-1] = k;
+    filled = offset[i] + k + 1;
+    RUNMEM += k;
+  }
+  free(offset);
+
+  // Publish the index, unless another thread did it first
+  uint32** expected = NULL;
+  if (!atomic_compare_exchange_strong(&img->run_start, &expected, index)) {
+    free(index);
+  }
+}
+
+/// Forget the run index of img (when its rows change)
+static void DropRunIndex(Image img) {
+  free(img->run_start);
+  img->run_start = NULL;
+}
 
-        rle_result[index_res] = EOR;                                                                // Adicionar a linha da nova imagem o EOR
-        result->row[y] = rle_result;                                                                // Adicionar a linha a imagem
+/// Find the run containing column x, from run first on, given the start
+/// columns of the runs of a row (from the run index)
+static uint32 FindRunFrom(const uint32* start, uint32 first, uint32 x) {
+  // The run is the last one starting at or before x
+  uint32 lo = first;
+  uint32 hi = start[-1];  // start[lo] <= x < start[hi]
+  while (hi - lo > 1) {
+    uint32 mid = lo + (hi - lo) / 2;
+    if (start[mid] <= x) {
+      lo = mid;
+    } else {
+      hi = mid;
     }
+    RUNMEM++;
+  }
+  return lo;
+}
 
-    InstrPrint();
+/// Find the run containing column x (see FindRunFrom)
+static uint32 FindRun(const uint32* start, uint32 x) {
+  return FindRunFrom(start, 0, x);
+}
 
-    return result;
+// Add your auxiliary functions here...
+
+/// Image management functions
+
+/// Create a new BW image, either BLACK or WHITE.
+///   width, height : the dimensions of the new image.
+///   val: the pixel color (BLACK or WHITE).
+/// Requires: width and height must be non-negative, val is either BLACK or
+/// WHITE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreate(uint32 width, uint32 height, uint8 val) {
+  InstrBegin("ImageCreate");
+  assert(width > 0 && height > 0);
+  assert(val == WHITE || val == BLACK);
+
+  RowBuilder b;
+  RowBuilderInit(&b, height, 3);
+
+  // All image pixels have the same value
+  int pixel_value = (int)val;
+
+  // Creating the image rows, each row has just 1 run of pixels
+  // Each row is represented by an array of 3 elements [value,length,EOR]
+  // All rows are equal: the row is stored once
+  int* row = RowBuilderReserve(&b, 3);
+  row[0] = pixel_value;
+  row[1] = (int)width;
+  row[2] = EOR;
+  RowBuilderCommit(&b, 3);
+  for (uint32 i = 1; i < height; i++) {
+    RowBuilderRepeat(&b, 0);
+  }
+
+  Image result = RowBuilderFinish(&b, width, height);
+  InstrEnd();
+  return result;
 }
 
-Image ImageOR(const Image img1, const Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  assert(img1->width == img2->width && img1->height == img2->height);
+/// Create a new BW image, with a perfect CHESSBOARD pattern.
+///   width, height : the dimensions of the new image.
+///   square_edge : the lenght of the edges of the sqares making up the
+///   chessboard pattern.
+///   first_value: the pixel color (BLACK or WHITE) of the
+///   first image pixel.
+/// Requires: width and height must be non-negative, val is either BLACK or
+/// WHITE.
+/// Requires: for the squares, width and height must be multiples of the
+/// edge lenght of the squares
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
+                            uint8 first_value) {
+  InstrBegin("ImageCreateChessboard");
   // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
   // ...
+  assert(width > 0 && height > 0);                                                   // Verifica se o width e o height não são negativos
+  assert(first_value == WHITE || first_value == BLACK);                              // Se o first_value é white ou black
+  assert(width%square_edge == 0 && height%square_edge == 0);                         // Verifica se o width e o heigt são múltiplos do tamanho de um lado do quadrado            
 
-  uint32 width = img1->width;
-  uint32 height = img1->height;
-  Image newImageOR = AllocateImageHeader(width,height);
+  int first_pixel = (int)first_value;
+  uint32 num = width/square_edge;                                                    // Números de quadrados existentes
 
-  for(uint32 i = 0; i < height; i++){
-    uint8* row_img1 = UncompressRow(width,img1->row[i]);                              // Cada linha da 1ª imagem vai passar de RLE para RAW  
-    uint8* row_img2 = UncompressRow(width,img2->row[i]);
+  RowBuilder b;                                                                      // Todas as linhas têm o mesmo tamanho
+  RowBuilderInit(&b, height, 2 * ((size_t)num + 2));                                 // Só há dois padrões de linhas diferentes
 
-    uint8* newImagerow = malloc(width * sizeof(uint8));                               // A nova imagem vai guardar o tamnho da largura que precisa de ter
-    for(uint32 j = 0; j < width; j++){
-      newImagerow[j] = row_img1[j] | row_img2[j];                                     // A cada linha das duas imagens foi aplicada a operação de OR 
+  for(uint32 i = 0; i < height; i++){                                                // Percorre as linhas 
+    if (i % square_edge != 0) {                                                      // Igual à linha anterior
+      RowBuilderRepeat(&b, i - 1);
+      continue;
+    }
+    if (i >= 2 * square_edge) {                                                      // Igual à linha de duas filas de quadrados acima
+      RowBuilderRepeat(&b, i - 2 * square_edge);
+      continue;
     }
-    newImageOR->row[i] = CompressRow(width, newImagerow);                             // Passa de RAW para RLE
-    free(row_img1);                            
-    free(row_img2);
-  }  
-  return newImageOR;
-}
 
-Image ImageXOR(Image img1, Image img2) {
-  assert(img1 != NULL && img2 != NULL);
-  assert(img1->width == img2->width && img1->height == img2->height);
-  // COMPLETE THE CODE
-  // You might consider using the UncompressRow and CompressRow auxiliary files
-  // Or devise a more efficient alternative
-  // ...
+    int* row = RowBuilderReserve(&b, num + 2);                                       // Cada linha da imagem que vai ser criada terá o número de quadrados + first_pixel + EOR
 
-  uint32 width = img1->width;
-  uint32 height = img1->height;
-  Image newImageXOR = AllocateImageHeader(width,height);
+    if (i%square_edge == 0 && i != 0) {                                              // Para o 1º elemento de cada linha muda a cor entre WHITE e BLACK alternadamente
+      first_pixel = first_pixel == BLACK ? WHITE : BLACK;
+    }
 
-  for(uint32 i = 0; i < height; i++){
-    uint8* row_img1 = UncompressRow(width,img1->row[i]);                              // Cada linha da 1ª imagem vai passar de RLE para RAW
-    uint8* row_img2 = UncompressRow(width,img2->row[i]);
+    row[0] = first_pixel;                                                            // O 1º elemento de cada linha vai ter o valor do first_pixel
 
-    uint8* newImagerow = malloc(width * sizeof(uint8));                               // A nova imagem vai guardar o tamnho da largura que precisa de ter
-    for(uint32 j = 0; j < width; j++){
-      newImagerow[j] = row_img1[j] ^ row_img2[j];                                     // A cada linha das duas imagens foi aplicada a operação de XOR 
+    for (uint32 j = 0; j < num; j++) {                                               // Para cada quadrado possível
+      row[j+1] = (int)square_edge;                                                   // Os próximos elementos vão ter a largura do quadrado
     }
-    newImageXOR->row[i] = CompressRow(width, newImagerow);                            // Passa de RAW para RLE
-    free(row_img1);                            
-    free(row_img2);
-  }  
-  return newImageXOR;
-}
 
-/// Geometric transformations
+    row[num + 1] = EOR;                                                              // O último elemento da linha será o end of row (EOR)
+    RowBuilderCommit(&b, num + 2);
+  }
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+  Image result = RowBuilderFinish(&b, width, height);
+  InstrEnd();
+  return result;
+}
 
-/// Mirror an image = flip top-bottom.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
+/// Create a copy of img.
+/// The copy shares the rows of img (except for IMAGE_BITMAP).
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
-Image ImageHorizontalMirror(const Image img) {
+Image ImageCopy(const Image img) {
+  InstrBegin("ImageCopy");
   assert(img != NULL);
 
   uint32 width = img->width;
   uint32 height = img->height;
 
-  Image newImageHMirror = AllocateImageHeader(width, height);
-
-  // COMPLETE THE CODE
-  // ...
+  if (!CanShareRows(img, NULL)) {
+    Image newImage = AllocateBitmapImage(width, height);
+    size_t num_words = (size_t)GetNumWordsBitmapRow(width) * height;
+    memcpy(newImage->bits, img->bits, num_words * sizeof(uint64));
+    PIXMEM += num_words;
+    InheritRowHashes(newImage, img, NULL, 0);
+    InstrEnd();
+    return newImage;
+  }
 
-  for(uint32 i = 0; i < height; i++){                                                 // Vai percorrer todas as linhas                                                  
-    uint32 inverted = height - i - 1;                                                 // Calcula o índice da linha correspondente no espelho horizontal. 
-    newImageHMirror->row[i] = img->row[inverted];                                     // A primeira linha da nova imagem será a última da original, a segunda será a penúltima, e assim sucessivamente.
+  Image newImage = AllocateSharingImage(width, height, img, NULL);
+  for (uint32 i = 0; i < height; i++) {
+    ShareRow(newImage, i, img, i);
   }
-  return newImageHMirror;
+  InheritRowHashes(newImage, img, NULL, 0);
+  InstrEnd();
+  return newImage;
 }
 
-/// Mirror an image = flip left-right.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageVerticalMirror(const Image img) {
-  assert(img != NULL);
+/// Destroy the image pointed to by (*imgp).
+///   imgp : address of an Image variable.
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail.
+void ImageDestroy(Image* imgp) {
+  assert(imgp != NULL);
 
-  uint32 width = img->width;
-  uint32 height = img->height;
+  Image img = *imgp;
+  if (img == NULL) return;
 
-  Image newImageVMirror = AllocateImageHeader(width, height);
+  // All rows live in slabs, the row pointers live with the header
+  ReleaseStorage(img);
+  free(img->row_hash);
+  free(img->stats);
+  free(img->run_histogram);
+  free(img);
 
-  // COMPLETE THE CODE
-  // ...
+  *imgp = NULL;
+}
+
+/// Printing on the console
+
+/// Output the raw BW image
+void ImageRAWPrint(const Image img) {
+  assert(img != NULL);
 
-  for(uint32 i = 0; i < height; i++){
-    uint8* row = UncompressRow(width,img->row[i]);                                    // Descomprime a linha atual da imagem original
-    uint8* newImagerow = malloc(width * sizeof(uint8));
+  printf("width = %d height = %d\n", img->width, img->height);
+  printf(" RAW image\n");
 
-    for(uint32 j = 0; j < width; j++){
-      uint32 inverted = width - j - 1;                                                // Calcula o índice da linha correspondente no espelho vertical.
-      newImagerow[j] = row[inverted];                                                 // Copia o valor do pixel invertido para a nova linha.
+  // Print the pixels of each image row
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = 0; i < img->height; i++) {
+    const int* row = GetRLERow(img, i, buf);
+    // The value of the first pixel in the current row
+    int pixel_value = row[0];
+    for (uint32 j = 1; row[j] != EOR; j++) {
+      // Print the current run of pixels
+      for (int k = 0; k < row[j]; k++) {
+        printf("%d", pixel_value);
+      }
+      // Switch (XOR) to the pixel value for the next run, if any
+      pixel_value ^= 1;
     }
-    newImageVMirror->row[i] = CompressRow(width, newImagerow);                        // Comprime a nova linha  
-    free(row);
+    // At current row end
+    printf("\n");
   }
-  return newImageVMirror;
+  printf("\n");
+  free(buf);
 }
 
-/// Replicate img2 at the bottom of imag1, creating a larger image
-/// Requires: the width of the two images must be the same.
-/// Returns the new larger image.
-/// Ensures: The original images are not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageReplicateAtBottom(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);
-    assert(img1->width == img2->width);
+/// Output the compressed RLE image
+void ImageRLEPrint(const Image img) {
+  assert(img != NULL);
 
-    uint32 new_width = img1->width;
-    uint32 new_height = img1->height + img2->height;
+  printf("width = %d height = %d\n", img->width, img->height);
+  printf(" RLE encoding\n");
+
+  // Print the compressed rows information
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = 0; i < img->height; i++) {
+    const int* row = GetRLERow(img, i, buf);
+    uint32 j;
+    for (j = 0; row[j] != EOR; j++) {
+      printf("%d ", row[j]);
+    }
+    printf("%d\n", row[j]);
+  }
+  printf("\n");
+  free(buf);
+}
 
-    Image newImage = AllocateImageHeader(new_width, new_height);
+/// PBM BW file operations
 
-                                                                    
-    for (uint32 i = 0; i < new_height; i++) {                                         // Copia as rows da imagem 1 para a nova imagem
-      uint8* newIamgerow;
+// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
 
-      if(i < img1->height){                                                           // Copia as rows da imagem 1
-        newIamgerow = UncompressRow(new_width, img1->row[i]);    
-      } else {                                                                        // Quando acaba de copiar as rows da imagem 1, copia as rows da imagem 2
-        newIamgerow = UncompressRow(new_width, img2->row[i - img1->height]);   
-      }
+// Auxiliary function
+// Load 8 bytes (or the n < 8 available, padded with 0s) as a 64-bit word,
+// with the first byte in the most significant position
+static uint64 LoadBigEndian(const uint8* bytes, size_t n) {
+  uint64 word = 0;
+  memcpy(&word, bytes, n < 8 ? n : 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
 
-      newImage->row[i] = CompressRow(new_width, newIamgerow);                         // Comprime as rows da nova imagem
+// Auxiliary function
+// Compress a row of packed PBM pixels (first pixel in the top bit of the
+// first byte, 1 for BLACK) straight into RLE_row, which must have room for
+// (image_width + 2) elements.
+// The bytes are scanned 64 bits at a time: words with no transition
+// (only 0x00 or 0xFF bytes, as far as the current run goes) are skipped,
+// and each transition is found with a count-leading-zeros instruction.
+// Returns the number of elements written, including EOR.
+static uint32 BytesRowToRLE(uint32 image_width, const uint8* bytes,
+                            int* RLE_row) {
+  size_t nbytes = (image_width + 8 - 1) / 8;
+  int pixel_value = bytes[0] >> 7;
+  // flip has all bits equal to the current pixel value, so that
+  // (word ^ flip) has 1s where the pixels differ from it
+  uint64 flip = pixel_value ? ~(uint64)0 : 0;
+  RLE_row[0] = pixel_value;
+  uint32 n = 1;
+  uint32 start = 0;  // Start of the current run
+  for (size_t b = 0; b < nbytes; b += 8) {
+    uint64 word = LoadBigEndian(bytes + b, nbytes - b);
+    uint64 pending = word ^ flip;
+    PIXMEM++;
+    while (pending != 0) {
+      uint32 bit = (uint32)__builtin_clzll(pending);
+      uint32 x = (uint32)(8 * b) + bit;
+      // Padding bits (and missing bytes) are not pixels
+      if (x >= image_width) goto end_of_row;
+      RLE_row[n++] = (int)(x - start);
+      start = x;
+      flip = ~flip;
+      pending = (word ^ flip) & (~(uint64)0 >> bit);
     }
-    
+  }
+end_of_row:
+  RLE_row[n++] = (int)(image_width - start);
+  RLE_row[n++] = EOR;
+  return n;
+}
 
-    return newImage;
+// Auxiliary function
+// Set the bits of pixels [start, end) of a row of packed PBM pixels
+// (first pixel in the top bit of the first byte)
+static void SetBytesRange(uint8* bytes, uint32 start, uint32 end) {
+  uint32 first = start / 8;
+  uint32 last = (end - 1) / 8;
+  uint8 first_mask = 0xFF >> (start % 8);
+  uint8 last_mask = 0xFF << (7 - (end - 1) % 8);
+  if (first == last) {
+    bytes[first] |= first_mask & last_mask;
+    return;
+  }
+  bytes[first] |= first_mask;
+  memset(bytes + first + 1, 0xFF, last - first - 1);
+  bytes[last] |= last_mask;
 }
 
+// Auxiliary function
+// Expand a RLE row into packed PBM pixels, with WHITE padding bits.
+// The row is cleared with a single memset, then each BLACK run sets its
+// edge bytes with masks and its inner bytes with memset.
+// Costs O(runs + bytes).
+static void RLERowToBytes(uint32 image_width, const int* RLE_row,
+                          uint8* bytes) {
+  memset(bytes, 0x00, (image_width + 8 - 1) / 8);
+  int pixel_value = RLE_row[0];
+  uint32 x = 0;
+  for (uint32 i = 1; RLE_row[i] != EOR; i++) {
+    if (pixel_value == BLACK) SetBytesRange(bytes, x, x + RLE_row[i]);
+    x += RLE_row[i];
+    pixel_value ^= 1;
+    RUNMEM++;
+  }
+}
 
+// Auxiliary function
+// Map a whole file into memory, read-only.
+// On success, returns 1 and sets (*data) and (*size).
+// On failure, returns 0 and preserves errno.
+static int MapFile(const char* filename, const uint8** data, size_t* size) {
+#if defined(__linux__) || defined(__APPLE__)
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0) {
+    if (st.st_size > 0) {
+      map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    } else {
+      errno = EINVAL;  // Empty file: nothing to map
+    }
+  }
+  errsave = errno;
+  close(fd);
+  errno = errsave;
+  if (map == MAP_FAILED) return 0;
+  // Rows are read once, from first to last
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  *data = map;
+  *size = (size_t)st.st_size;
+  return 1;
+#else
+  // No mmap: read the whole file into memory
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) return 0;
+  long end;
+  uint8* buf = NULL;
+  int success = fseek(f, 0, SEEK_END) == 0 && (end = ftell(f)) > 0 &&
+                fseek(f, 0, SEEK_SET) == 0 &&
+                (buf = malloc((size_t)end)) != NULL &&
+                fread(buf, 1, (size_t)end, f) == (size_t)end;
+  errsave = errno;
+  fclose(f);
+  if (!success) free(buf);
+  errno = errsave;
+  if (!success) return 0;
+  *data = buf;
+  *size = (size_t)end;
+  return 1;
+#endif
+}
 
-/// Replicate img2 to the right of imag1, creating a larger image
-/// Requires: the height of the two images must be the same.
-/// Returns the new larger image.
-/// Ensures: The original images are not modified.
-///
-/// On success, a new image is returned.
+// Auxiliary function
+// Release a file mapped by MapFile
+static void UnmapFile(const uint8* data, size_t size) {
+  if (data == NULL) return;
+#if defined(__linux__) || defined(__APPLE__)
+  munmap((void*)data, size);
+#else
+  (void)size;
+  free((void*)data);
+#endif
+}
+
+// Auxiliary function
+// Skip whitespace and comments in a PBM header, starting at data[pos].
+// Comments start with a # and continue until the end-of-line.
+// Returns the position of the next header character.
+static size_t SkipHeaderSpace(const uint8* data, size_t size, size_t pos) {
+  while (pos < size) {
+    if (data[pos] == '#') {
+      while (pos < size && data[pos] != '\n') pos++;
+    } else if (isspace(data[pos])) {
+      pos++;
+    } else {
+      break;
+    }
+  }
+  return pos;
+}
+
+// Auxiliary function
+// Parse a positive decimal number of a PBM header, starting at data[*pos],
+// and advance (*pos) past it.
+// Returns the number, or 0 if there is none (or it is too large).
+static int ParseHeaderNumber(const uint8* data, size_t size, size_t* pos) {
+  size_t p = SkipHeaderSpace(data, size, *pos);
+  int value = 0;
+  for (; p < size && isdigit(data[p]); p++) {
+    if (value > (INT_MAX - 2) / 10) return 0;  // Runs must fit an int
+    value = 10 * value + (data[p] - '0');
+  }
+  *pos = p;
+  return value;
+}
+
+// Rows of packed PBM pixels, stored one after the other
+typedef struct {
+  const uint8* bytes;
+  size_t nbytes;  // number of bytes for each row
+  uint32 width;
+} PixelRows;
+
+// Auxiliary function
+// Estimated size of a row compressed from packed pixels: the work is
+// proportional to the number of 64-bit words scanned.
+static size_t PixelRowWeight(void* ctx, uint32 i) {
+  (void)i;
+  return ((PixelRows*)ctx)->nbytes / 8 + 3;
+}
+
+// Auxiliary function
+// Compress rows [first, last) of packed pixels
+static void LoadRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  PixelRows* pixels = ctx;
+  RowBuilderIntern(b);  // Scanned pages have many blank rows
+  for (uint32 i = first; i < last; i++) {
+    int* row = RowBuilderReserve(b, pixels->width + 2);
+    RowBuilderCommit(b, BytesRowToRLE(pixels->width,
+                                      pixels->bytes + i * pixels->nbytes, row));
+  }
+}
+
+/// Load a raw PBM file.
+/// Only binary PBM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+///
+/// The file is mapped into memory, and each row of packed pixels is
+/// compressed directly from the mapped bytes (see BytesRowToRLE).
+Image ImageLoad(const char* filename) {  ///
+  InstrBegin("ImageLoad");
+  int w = 0, h = 0;
+  const uint8* data = NULL;
+  size_t size = 0;
+  size_t pos = 2;  // After the magic number
+  Image img = NULL;
+
+  int success =
+      check(MapFile(filename, &data, &size), "Open failed") &&
+      // Parse PBM header
+      check(size > 2 && data[0] == 'P' && data[1] == '4',
+            "Invalid file format") &&
+      check((w = ParseHeaderNumber(data, size, &pos)) > 0, "Invalid width") &&
+      check((h = ParseHeaderNumber(data, size, &pos)) > 0,
+            "Invalid height") &&
+      check(pos < size && isspace(data[pos++]), "Whitespace expected") &&
+      check((size - pos) / h >= (size_t)(w + 8 - 1) / 8, "Reading pixels");
+
+  if (success) {
+    // Compress the pixels, row by row, straight into the image slab
+    PixelRows pixels = {data + pos, (w + 8 - 1) / 8, w};
+    img = BuildImage(w, h, PixelRowWeight, LoadRows, &pixels);
+  }
+
+  // Cleanup
+  errsave = errno;
+  UnmapFile(data, size);
+  errno = errsave;
+  InstrEnd();
+  return img;
+}
+
+// Size of the output buffer of ImageSave
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+// A batch of rows being expanded by ImageSave
+typedef struct {
+  Image img;
+  uint8* bytes;   // the output buffer
+  size_t nbytes;  // number of bytes for each row
+  uint32 first;   // the image row in the start of the buffer
+} SaveArgs;
+
+// Auxiliary function
+// Expand rows [first, last) of the batch into the buffer
+static void SaveRows(void* ctx, uint32 first, uint32 last) {
+  SaveArgs* args = ctx;
+  int* buf = AllocateRowBuffer(args->img);
+  for (uint32 i = first; i < last; i++) {
+    RLERowToBytes(args->img->width, GetRLERow(args->img, args->first + i, buf),
+                  args->bytes + i * args->nbytes);
+  }
+  free(buf);
+}
+
+/// Save image to PBM file.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+///
+/// Rows are expanded from the runs straight into packed pixels
+/// (see RLERowToBytes), in a large buffer written with few calls.
+/// The rows of each batch are expanded in parallel.
+int ImageSave(const Image img, const char* filename) {  ///
+  InstrBegin("ImageSave");
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  FILE* f = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+
+  if (success) {
+    // Write pixels, as many whole rows at a time as fit in the buffer
+    size_t nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
+    size_t capacity = SAVE_BUFFER_SIZE / nbytes * nbytes;
+    if (capacity == 0) capacity = nbytes;
+    uint8* bytes = malloc(capacity);
+    assert(bytes != NULL);
+
+    SaveArgs args = {img, bytes, nbytes, 0};
+    uint32 batch = capacity / nbytes;  // number of rows in the buffer
+    for (int i = 0; success && i < h; i += batch) {
+      uint32 num_rows = (uint32)(h - i) < batch ? (uint32)(h - i) : batch;
+      size_t used = num_rows * nbytes;
+      args.first = i;
+      ParallelRows(num_rows, used, SaveRows, &args);
+      success = check(fwrite(bytes, 1, used, f) == used,
+                      "Writing pixels failed");
+    }
+
+    free(bytes);
+  }
+
+  // Cleanup
+  if (f != NULL) {
+    errsave = errno;
+    if (fclose(f) != 0 && success) {
+      success = check(0, "Closing failed");  // Buffered data not written
+    } else {
+      errno = errsave;
+    }
+  }
+  InstrEnd();
+  return success;
+}
+
+/// Information queries
+
+/// Get image width
+int ImageWidth(const Image img) {
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(const Image img) {
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get the color of pixel x of a packed row, walking its codes
+static uint8 GetPackedPixel(const uint8* code, uint32 x) {
+  int color = *code++;
+  for (uint32 end = ReadPackedRun(&code); x >= end;
+       end += ReadPackedRun(&code)) {
+    RUNMEM++;
+    color ^= 1;
+  }
+  return (uint8)color;
+}
+
+/// Get the color of pixel (x, y) of a bitmap image
+static uint8 GetBitmapPixel(const Image img, uint32 x, uint32 y) {
+  PIXMEM++;
+  return (uint8)((GetBitmapRow(img, y)[x / 64] >> (x % 64)) & 1);
+}
+
+/// Get the color of pixel (x, y).
+/// For IMAGE_RLE, the run is found with the run index (see ImageCrop).
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y) {
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+
+  switch (img->encoding) {
+    case IMAGE_RLE:
+      BuildRunIndex(img);
+      return (uint8)(img->row[y][0] ^
+                     (int)(FindRun(GetRunIndex(img)[y], x) & 1));
+    case IMAGE_RLE_PACKED:
+      return GetPackedPixel(img->packed[y], x);
+    default:
+      return GetBitmapPixel(img, x, y);
+  }
+}
+
+// A pixel query: queries are sorted by row, then column
+typedef struct {
+  uint32 y;
+  uint32 x;
+  uint32 k;  // The index of the point
+} PixelQuery;
+
+static int ComparePixelQueries(const void* p1, const void* p2) {
+  const PixelQuery* q1 = p1;
+  const PixelQuery* q2 = p2;
+  if (q1->y != q2->y) return q1->y < q2->y ? -1 : 1;
+  if (q1->x != q2->x) return q1->x < q2->x ? -1 : 1;
+  return 0;
+}
+
+/// Sort the queries of n points by row, then column.
+/// Large batches are sorted by counting, by column and then by row (stable),
+/// in O(n + width + height).
+static PixelQuery* SortPixelQueries(const Image img, const ImagePoint* points,
+                                    uint32 n) {
+  PixelQuery* queries = malloc((size_t)n * sizeof(PixelQuery) + 1);
+  assert(queries != NULL);
+
+  if ((uint64)n * 4 < (uint64)img->width + img->height) {
+    for (uint32 k = 0; k < n; k++) {
+      assert(points[k].x < img->width && points[k].y < img->height);
+      queries[k] = (PixelQuery){points[k].y, points[k].x, k};
+    }
+    qsort(queries, n, sizeof(PixelQuery), ComparePixelQueries);
+    return queries;
+  }
+
+  uint32 size = img->width > img->height ? img->width : img->height;
+  uint32* count = malloc(((size_t)size + 1) * sizeof(uint32));
+  assert(count != NULL);
+  PixelQuery* by_column = malloc((size_t)n * sizeof(PixelQuery) + 1);
+  assert(by_column != NULL);
+
+  // By column
+  memset(count, 0, ((size_t)img->width + 1) * sizeof(uint32));
+  for (uint32 k = 0; k < n; k++) {
+    assert(points[k].x < img->width && points[k].y < img->height);
+    count[points[k].x + 1]++;
+  }
+  for (uint32 x = 0; x < img->width; x++) count[x + 1] += count[x];
+  for (uint32 k = 0; k < n; k++) {
+    by_column[count[points[k].x]++] =
+        (PixelQuery){points[k].y, points[k].x, k};
+  }
+
+  // By row
+  memset(count, 0, ((size_t)img->height + 1) * sizeof(uint32));
+  for (uint32 k = 0; k < n; k++) count[by_column[k].y + 1]++;
+  for (uint32 y = 0; y < img->height; y++) count[y + 1] += count[y];
+  for (uint32 k = 0; k < n; k++) {
+    queries[count[by_column[k].y]++] = by_column[k];
+  }
+
+  free(by_column);
+  free(count);
+  return queries;
+}
+
+typedef struct {
+  Image img;
+  const PixelQuery* queries;
+  uint8* out;
+} PixelsArgs;
+
+/// Answer queries [first, last) of a RLE or packed image
+static void PixelsQueries(void* ctx, uint32 first, uint32 last) {
+  PixelsArgs* args = ctx;
+  const Image img = args->img;
+  const PixelQuery* q = args->queries;
+
+  if (img->encoding == IMAGE_RLE) {
+    // The queries of a row have increasing columns: each search starts at
+    // the run found by the previous one
+    uint32** index = GetRunIndex(img);
+    uint32 run = 0;
+    for (uint32 j = first; j < last; j++) {
+      if (j == first || q[j].y != q[j - 1].y) run = 0;
+      run = FindRunFrom(index[q[j].y], run, q[j].x);
+      args->out[q[j].k] = (uint8)(img->row[q[j].y][0] ^ (int)(run & 1));
+    }
+    return;
+  }
+
+  // Packed: the code of each row is walked once, along its queries
+  const uint8* code = NULL;
+  int color = 0;
+  uint32 end = 0;  // End of the current run
+  for (uint32 j = first; j < last; j++) {
+    if (j == first || q[j].y != q[j - 1].y) {
+      code = img->packed[q[j].y];
+      color = *code++;
+      end = ReadPackedRun(&code);
+    }
+    while (q[j].x >= end) {
+      end += ReadPackedRun(&code);
+      RUNMEM++;
+      color ^= 1;
+    }
+    args->out[q[j].k] = (uint8)color;
+  }
+}
+
+/// Get the colors of n pixels: out[k] is the color of points[k].
+/// The queries are sorted by row, so that each row is visited once.
+void ImageGetPixels(const Image img, const ImagePoint* points, int n,
+                    uint8* out) {
+  InstrBegin("ImageGetPixels");
+  assert(img != NULL);
+  assert(n >= 0 && (n == 0 || (points != NULL && out != NULL)));
+
+  if (img->encoding == IMAGE_BITMAP) {
+    // Direct access
+    for (int k = 0; k < n; k++) {
+      assert(points[k].x < img->width && points[k].y < img->height);
+      out[k] = GetBitmapPixel(img, points[k].x, points[k].y);
+    }
+    InstrEnd();
+    return;
+  }
+
+  PixelQuery* queries = SortPixelQueries(img, points, (uint32)n);
+
+  if (img->encoding == IMAGE_RLE) BuildRunIndex(img);
+  PixelsArgs args = {img, queries, out};
+  ParallelRows((uint32)n, (uint64)n * 16, PixelsQueries, &args);
+  free(queries);
+  InstrEnd();
+}
+
+// Statistics of the BLACK pixels
+//
+// The BLACK pixel counts of the rows, their total and their bounding box
+// are computed together, in a single pass over the runs (or, for bitmaps,
+// by counting the bits of whole words), and cached in the image (stats).
+// The histograms of the run lengths are computed, and cached, separately
+// (run_histogram).  Both are kept until the pixels of the image change.
+// As with the run index, threads computing them at once for the same image
+// each compute their own, and the first one to publish it wins.
+
+typedef struct {
+  Image img;
+  Stats* stats;
+  uint32* first;  // First BLACK column of each row (width if none)
+  uint32* end;    // End of the last BLACK run of each row (0 if none)
+} StatsArgs;
+
+/// Compute the statistics of rows [first, last) of the image in ctx
+static void StatsRows(void* ctx, uint32 first, uint32 last) {
+  StatsArgs* args = ctx;
+  const Image img = args->img;
+  uint32 width = img->width;
+
+  if (img->encoding == IMAGE_BITMAP) {
+    uint32 num_words = GetNumWordsBitmapRow(width);
+    for (uint32 i = first; i < last; i++) {
+      const uint64* bits = GetBitmapRow(img, i);
+      uint32 count = (uint32)WordsCount(bits, num_words);
+      PIXMEM += num_words;
+      args->stats->row_count[i] = count;
+      args->first[i] = width;
+      args->end[i] = 0;
+      if (count == 0) continue;
+      // The first and last words with BLACK pixels (the padding bits are 0)
+      uint32 w = 0;
+      while (bits[w] == 0) w++;
+      args->first[i] = w * 64 + (uint32)__builtin_ctzll(bits[w]);
+      w = num_words - 1;
+      while (bits[w] == 0) w--;
+      args->end[i] = w * 64 + 64 - (uint32)__builtin_clzll(bits[w]);
+    }
+    return;
+  }
+
+  // Repeated rows are counted once
+  int memo = img->encoding == IMAGE_RLE && !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = first; i < last; i++) {
+    const int* row = GetRLERow(img, i, buf);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      args->stats->row_count[i] = args->stats->row_count[e->row];
+      args->first[i] = args->first[e->row];
+      args->end[i] = args->end[e->row];
+      continue;
+    }
+    // Runs alternate in color: add up the runs at odd and at even
+    // positions separately, without branches
+    uint32 sum[2] = {0, 0};
+    uint32 k = 1;
+    for (; row[k] != EOR; k++) sum[k & 1] += (uint32)row[k];
+    RUNMEM += k - 1;
+    int black_first = row[0] == BLACK;  // The first run is BLACK
+    int black_last = row[0] == ((k - 2) & 1 ? WHITE : BLACK);
+    uint32 count = sum[black_first ? 1 : 0];
+    args->stats->row_count[i] = count;
+    args->first[i] = count == 0 ? width : black_first ? 0 : (uint32)row[1];
+    args->end[i] = count == 0 ? 0
+                   : black_last ? width
+                                : width - (uint32)row[k - 1];
+    if (e != NULL) RowMemoSet(e, row, NULL, i);
+  }
+  free(buf);
+  free(m.entries);
+}
+
+/// Compute the statistics of img, if not cached (thread-safe).
+/// Returns the statistics.
+static const Stats* ComputeStats(Image img) {
+  Stats* cached = atomic_load_explicit(&img->stats, memory_order_acquire);
+  if (cached != NULL) return cached;
+
+  uint32 height = img->height;
+  Stats* stats = malloc(sizeof(Stats) + (size_t)height * sizeof(uint32));
+  uint32* first = malloc((size_t)height * sizeof(uint32) + 1);
+  uint32* end = malloc((size_t)height * sizeof(uint32) + 1);
+  assert(stats != NULL && first != NULL && end != NULL);
+
+  StatsArgs args = {img, stats, first, end};
+  uint64 work = 0;
+  for (uint32 i = 0; i < height; i++) work += RowWeight(img, i);
+  ParallelRows(height, work, StatsRows, &args);
+
+  // Add up the rows
+  stats->black = 0;
+  uint32 x0 = img->width, x1 = 0;  // Columns [x0, x1)
+  uint32 y0 = height, y1 = 0;      // Rows [y0, y1)
+  for (uint32 i = 0; i < height; i++) {
+    if (stats->row_count[i] == 0) continue;
+    stats->black += stats->row_count[i];
+    if (y0 == height) y0 = i;
+    y1 = i + 1;
+    if (first[i] < x0) x0 = first[i];
+    if (end[i] > x1) x1 = end[i];
+  }
+  if (stats->black == 0) x0 = x1 = y0 = y1 = 0;
+  stats->x = x0;
+  stats->y = y0;
+  stats->width = x1 - x0;
+  stats->height = y1 - y0;
+
+  free(first);
+  free(end);
+
+  // Publish the statistics, unless another thread did it first
+  if (!atomic_compare_exchange_strong(&img->stats, &cached, stats)) {
+    free(stats);
+    return cached;
+  }
+  return stats;
+}
+
+/// Compute the histograms of the run lengths of img, if not cached
+/// (thread-safe): run_histogram[color * (width + 1) + n] is the number of
+/// runs of color with n pixels.
+/// Returns the histograms.
+static const uint64* ComputeRunHistogram(Image img) {
+  uint64* cached =
+      atomic_load_explicit(&img->run_histogram, memory_order_acquire);
+  if (cached != NULL) return cached;
+
+  size_t size = (size_t)img->width + 1;
+  uint64* histogram = calloc(2 * size, sizeof(uint64));
+  assert(histogram != NULL);
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = 0; i < img->height; i++) {
+    const int* row = GetRLERow(img, i, buf);
+    size_t color = (size_t)row[0];
+    for (uint32 k = 1; row[k] != EOR; k++, color ^= 1) {
+      histogram[color * size + (size_t)row[k]]++;
+      RUNMEM++;
+    }
+  }
+  free(buf);
+
+  if (!atomic_compare_exchange_strong(&img->run_histogram, &cached,
+                                      histogram)) {
+    free(histogram);
+    return cached;
+  }
+  return histogram;
+}
+
+/// Get the number of BLACK pixels
+uint64 ImageCountBlack(const Image img) {
+  InstrBegin("ImageCountBlack");
+  assert(img != NULL);
+  uint64 result = ComputeStats(img)->black;
+  InstrEnd();
+  return result;
+}
+
+/// Get the bounding box of the BLACK pixels
+int ImageBoundingBox(const Image img, uint32* x, uint32* y, uint32* width,
+                     uint32* height) {
+  InstrBegin("ImageBoundingBox");
+  assert(img != NULL);
+  assert(x != NULL && y != NULL && width != NULL && height != NULL);
+  const Stats* stats = ComputeStats(img);
+  *x = stats->x;
+  *y = stats->y;
+  *width = stats->width;
+  *height = stats->height;
+  int result = stats->black > 0;
+  InstrEnd();
+  return result;
+}
+
+/// Get the number of BLACK pixels of each row
+void ImageRowCounts(const Image img, uint32* counts) {
+  InstrBegin("ImageRowCounts");
+  assert(img != NULL);
+  assert(counts != NULL);
+  memcpy(counts, ComputeStats(img)->row_count, img->height * sizeof(uint32));
+  InstrEnd();
+}
+
+/// Get the histogram of the lengths of the runs of color
+void ImageRunLengthHistogram(const Image img, int color, uint64* histogram) {
+  InstrBegin("ImageRunLengthHistogram");
+  assert(img != NULL);
+  assert(color == BLACK || color == WHITE);
+  assert(histogram != NULL);
+  const uint64* cached = ComputeRunHistogram(img);
+  size_t size = (size_t)img->width + 1;
+  memcpy(histogram, cached + (size_t)color * size,
+         size * sizeof(uint64));
+  InstrEnd();
+}
+
+/// Memory representation
+
+/// Get the encoding of the image rows
+int ImageEncoding(const Image img) {
+  assert(img != NULL);
+  return img->encoding;
+}
+
+/// Get the total number of runs of an image
+static uint64 GetNumRunsImage(const Image img) {
+  assert(img != NULL);
+
+  uint64 num_runs = 0;
+  switch (img->encoding) {
+    case IMAGE_RLE:
+      for (uint32 i = 0; i < img->height; i++) {
+        num_runs += GetNumRunsInRLERow(img->row[i]);
+      }
+      break;
+    case IMAGE_RLE_PACKED:
+      // Each run code has exactly one byte without the top bit set
+      for (uint32 i = 0; i < img->height; i++) {
+        for (const uint8* code = img->packed[i] + 1; *code != 0; code++) {
+          num_runs += (*code & 0x80) == 0;
+        }
+      }
+      break;
+    case IMAGE_BITMAP:
+      for (uint32 i = 0; i < img->height; i++) {
+        num_runs += 1 + WordsTransitions(GetBitmapRow(img, i), img->width);
+      }
+      break;
+  }
+  return num_runs;
+}
+
+/// Store the rows of img in the given encoding.
+void ImageSetEncoding(Image img, int encoding) {
+  assert(img != NULL);
+  assert(encoding == IMAGE_RLE || encoding == IMAGE_RLE_PACKED ||
+         encoding == IMAGE_BITMAP);
+  if (encoding == img->encoding) return;
+  InstrBegin("ImageSetEncoding");
+
+  // Conversions go through IMAGE_RLE
+  if (img->encoding != IMAGE_RLE) {
+    RowBuilder b;
+    RowBuilderInit(&b, img->height, GetSizeRLEImage(img));
+    for (uint32 i = 0; i < img->height; i++) {
+      int* row = RowBuilderReserve(&b, img->width + 2);
+      GetRLERow(img, i, row);  // Decodes directly into the slab
+      RowBuilderCommit(&b, GetSizeRLERowArray(row));
+    }
+    img->bits = NULL;
+    img->packed = NULL;
+    RowBuilderAttach(&b, img);
+    img->encoding = IMAGE_RLE;
+  }
+
+  if (encoding == IMAGE_RLE_PACKED) {
+    // Exact size first, then pack every row into the new slab.
+    // Rows stored once are packed once, and their code is shared.
+    int memo = !img->distinct_rows;
+    RowMemo m = {NULL, 0};
+    if (memo) RowMemoInit(&m, img->height);
+    size_t size = 0;
+    for (uint32 i = 0; i < img->height; i++) {
+      RowMemoEntry* e = memo ? RowMemoFind(&m, img->row[i], NULL) : NULL;
+      if (e != NULL && e->row1 != NULL) continue;
+      size += GetSizePackedRow(img->row[i]);
+      if (e != NULL) RowMemoSet(e, img->row[i], NULL, i);
+    }
+    Slab* slab = AllocateSlab(size);
+    uint8* bytes = (uint8*)slab->data;
+
+    // The packed row pointers take the place of the RLE row pointers
+    // (each RLE row pointer is read before being overwritten)
+    if (memo) memset(m.entries, 0, (m.mask + 1) * sizeof(RowMemoEntry));
+    uint8** packed = (uint8**)(img + 1);
+    size_t offset = 0;
+    int repeated = 0;
+    for (uint32 i = 0; i < img->height; i++) {
+      RowMemoEntry* e = memo ? RowMemoFind(&m, img->row[i], NULL) : NULL;
+      if (e != NULL && e->row1 != NULL) {
+        packed[i] = packed[e->row];
+        repeated = 1;
+        continue;
+      }
+      if (e != NULL) RowMemoSet(e, img->row[i], NULL, i);
+      uint8* code = bytes + offset;
+      offset += PackRow(img->row[i], code);
+      packed[i] = code;
+    }
+    free(m.entries);
+    SetStorage(img, slab);
+    img->distinct_rows = !repeated;
+    img->row = NULL;
+    img->packed = packed;
+  } else if (encoding == IMAGE_BITMAP) {
+    size_t num_words = GetNumWordsBitmapRow(img->width);
+    Slab* slab = AllocateSlab(num_words * img->height * sizeof(uint64));
+    uint64* bits = slab->data;
+    for (uint32 i = 0; i < img->height; i++) {
+      RLERowToBitmap(img->width, img->row[i], bits + i * num_words);
+    }
+    SetStorage(img, slab);
+    img->row = NULL;
+    img->bits = bits;
+  }
+  img->encoding = encoding;
+  InstrEnd();
+}
+
+/// Store the rows of img in IMAGE_RLE or IMAGE_BITMAP, whichever is smaller.
+int ImageChooseEncoding(Image img) {
+  assert(img != NULL);
+
+  // A RLE row takes (runs + 2) ints, a bitmap row one bit per pixel,
+  // so bitmaps are smaller with more than about width/32 runs per row
+  uint64 rle_size = (GetNumRunsImage(img) + 2 * (uint64)img->height) *
+                    sizeof(int);
+  uint64 bitmap_size = (uint64)GetNumWordsBitmapRow(img->width) *
+                       img->height * sizeof(uint64);
+  int encoding = bitmap_size < rle_size ? IMAGE_BITMAP : IMAGE_RLE;
+  ImageSetEncoding(img, encoding);
+  return encoding;
+}
+
+/// Parallel execution
+
+/// Stop all the worker threads
+static void StopWorkers(void) {
+  pthread_mutex_lock(&pool_mutex);
+  pool_quit = 1;
+  pthread_cond_broadcast(&pool_work);
+  pthread_mutex_unlock(&pool_mutex);
+  for (int t = 1; t < num_threads; t++) {
+    pthread_join(workers[t], NULL);
+    worker_counters[t] = NULL;
+  }
+  pool_quit = 0;
+  num_threads = 1;
+}
+
+void ImageSetThreads(int n) {
+  if (n <= 0) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n <= 0) n = 1;
+  if (n > MAX_THREADS) n = MAX_THREADS;
+
+  pthread_mutex_lock(&job_mutex);
+  StopWorkers();
+  // Start the workers (with fewer threads, if some cannot be created)
+  while (num_threads < n &&
+         pthread_create(&workers[num_threads], NULL, WorkerMain,
+                        (void*)(intptr_t)num_threads) == 0) {
+    num_threads++;
+  }
+  pthread_mutex_unlock(&job_mutex);
+}
+
+int ImageGetThreads(void) {
+  return num_threads;
+}
+
+/// Image comparison
+
+/// Compare two RLE rows, which are canonical: equal rows have equal runs
+static int IsEqualRLERow(const int* RLE_row1, const int* RLE_row2) {
+  // Colors are never EOR, so the first mismatch or EOR ends the loop
+  uint32 k = 0;
+  while (RLE_row1[k] == RLE_row2[k] && RLE_row1[k] != EOR) k++;
+  RUNMEM += k;
+  return RLE_row1[k] == RLE_row2[k];
+}
+
+/// Compare the pixels of two images.
+/// Images of different sizes are different.
+/// Rows are compared in their own encoding when both images have the same:
+/// the run arrays of RLE rows, the codes of packed rows, the words of
+/// bitmap rows (with memcmp).  Shared rows are equal without comparing
+/// them, and cached row hashes (see ImageDigest) reject different rows.
+int ImageIsEqual(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+
+  uint32 width1 = img1->width;    // Largura da 1ª imagem
+  uint32 height1 = img1->height;  // Altura da 1ª imagem
+
+  if (width1 != img2->width || height1 != img2->height) return 0;
+  if (img1 == img2) return 1;
+  const uint64* hash1 = GetRowHashes(img1);
+  const uint64* hash2 = GetRowHashes(img2);
+  int hashed = hash1 != NULL && hash2 != NULL;
+  if (hashed && hash1[height1] != hash2[height1]) return 0;
+  InstrBegin("ImageIsEqual");
+
+  if (img1->encoding == IMAGE_BITMAP && img2->encoding == IMAGE_BITMAP) {
+    // The padding bits are 0, so whole rows can be compared
+    size_t num_words = (size_t)GetNumWordsBitmapRow(width1) * height1;
+    PIXMEM += num_words;
+    int equal = memcmp(img1->bits, img2->bits, num_words * sizeof(uint64)) == 0;
+    InstrEnd();
+    return equal;
+  }
+
+  int same_encoding = img1->encoding == img2->encoding;
+  int* buf1 = AllocateRowBuffer(img1);  // Para descodificar as linhas de imagens compactas
+  int* buf2 = AllocateRowBuffer(img2);
+  int equal = 1;
+  for (uint32 i = 0; equal && i < height1; i++) {                // Para cada linha da imagem
+    if (hashed && hash1[i] != hash2[i]) {
+      equal = 0;
+    } else if (same_encoding && img1->encoding == IMAGE_RLE) {
+      equal = img1->row[i] == img2->row[i] ||                      // Linha partilhada
+              IsEqualRLERow(img1->row[i], img2->row[i]);
+    } else if (same_encoding) {
+      // Packed rows: the color byte, then the codes, up to the 0 byte
+      const uint8* code1 = img1->packed[i];
+      const uint8* code2 = img2->packed[i];
+      equal = code1 == code2 ||
+              (code1[0] == code2[0] &&
+               strcmp((const char*)code1 + 1, (const char*)code2 + 1) == 0);
+    } else {
+      equal = IsEqualRLERow(GetRLERow(img1, i, buf1),
+                            GetRLERow(img2, i, buf2));
+    }
+  }
+  free(buf1);
+  free(buf2);
+  InstrEnd();
+  return equal;
+}
+
+int ImageIsDifferent(const Image img1, const Image img2) {
+  assert(img1 != NULL && img2 != NULL);
+  return !ImageIsEqual(img1, img2);
+}
+
+/// Get a 64-bit digest of the image dimensions and pixels.
+uint64 ImageDigest(const Image img) {
+  InstrBegin("ImageDigest");
+  assert(img != NULL);
+  uint64 result = ComputeRowHashes(img)[img->height];
+  InstrEnd();
+  return result;
+}
+
+/// Boolean Operations on image pixels
+
+/// These functions apply boolean operations to images,
+/// returning a new image as a result.
+///
+/// Operand images are left untouched and must be of the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+// Operands of a boolean operation
+typedef struct {
+  Image img1;
+  Image img2;
+  int op;
+  Image result;  // Preallocated result, in IMAGE_BITMAP
+} BooleanOpArgs;
+
+/// Apply a boolean op to rows [first, last) of two images of the same size,
+/// one of them (at least) in IMAGE_BITMAP, into the bitmap result.
+static void BitmapBooleanRows(void* ctx, uint32 first, uint32 last) {
+  BooleanOpArgs* args = ctx;
+  const Image img1 = args->img1;
+  const Image img2 = args->img2;
+  uint32 width = img1->width;
+
+  if (img1->encoding == IMAGE_BITMAP && img2->encoding == IMAGE_BITMAP) {
+    BitmapRowsOp(width, last - first, GetBitmapRow(img1, first),
+                 GetBitmapRow(img2, first), GetBitmapRow(args->result, first),
+                 args->op);
+    return;
+  }
+
+  // Expand the rows of the other operand, one at a time
+  const Image other = img1->encoding == IMAGE_BITMAP ? img2 : img1;
+  int* buf = AllocateRowBuffer(other);
+  uint64* bits = malloc(GetNumWordsBitmapRow(width) * sizeof(uint64));
+  assert(bits != NULL);
+  for (uint32 i = first; i < last; i++) {
+    RLERowToBitmap(width, GetRLERow(other, i, buf), bits);
+    const uint64* bits1 = other == img1 ? bits : GetBitmapRow(img1, i);
+    const uint64* bits2 = other == img2 ? bits : GetBitmapRow(img2, i);
+    BitmapRowsOp(width, 1, bits1, bits2, GetBitmapRow(args->result, i),
+                 args->op);
+  }
+  free(bits);
+  free(buf);
+}
+
+/// Estimated size of row i of an image (a weight function for BuildImage)
+static size_t ImageRowWeight(void* ctx, uint32 i) {
+  return RowWeight((const Image)ctx, i);
+}
+
+/// Negate rows [first, last) of the image in ctx
+static void NEGRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  const Image img = ctx;
+
+  // Repeated rows are negated once
+  int memo = img->encoding == IMAGE_RLE && !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  // Directly copying the rows, one by one
+  // And changing the value of row[i][0]
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = first; i < last; i++) {
+    const int* src = GetRLERow(img, i, buf);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, src, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    uint32 num_elems = GetSizeRLERowArray(src);
+    int* row = RowBuilderReserve(b, num_elems);
+    memcpy(row, src, num_elems * sizeof(int));
+    row[0] ^= 1;  // Just negate the value of the first pixel run
+    RowBuilderCommit(b, num_elems);
+    if (e != NULL) RowMemoSet(e, src, NULL, b->num_rows - 1);
+  }
+  free(buf);
+  free(m.entries);
+}
+
+Image ImageNEG(const Image img) {
+  InstrBegin("ImageNEG");
+  assert(img != NULL);
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  if (img->encoding == IMAGE_BITMAP) {
+    // Negate all the words
+    BooleanOpArgs args = {img, img, OP_NOTA,
+                          AllocateBitmapImage(width, height)};
+    ParallelRows(height, (uint64)GetNumWordsBitmapRow(width) * height,
+                 BitmapBooleanRows, &args);
+    InstrEnd();
+    return args.result;
+  }
+
+  Image result = BuildImage(width, height, ImageRowWeight, NEGRows, img);
+  InstrEnd();
+  return result;
+}
+
+// Binary boolean operations on RLE rows are all implemented by a single
+// run-merging kernel (MergeRLERows), parameterized by the op code.
+
+/// Merge two RLE rows of the same width, applying op to each pixel pair.
+/// Walks both run lists in lockstep, so it takes O(runs1 + runs2) steps.
+/// The result is written to out, in canonical RLE form (no empty runs,
+/// adjacent runs of the same color are joined).
+/// out must have room for (runs1 + runs2 + 1) elements.
+/// Returns the number of elements written to out, including EOR.
+static uint32 MergeRLERows(const int* RLE_row1, const int* RLE_row2, int op,
+                           int* out) {
+  assert(RLE_row1 != NULL && RLE_row2 != NULL);
+  assert(out != NULL);
+
+  int a = RLE_row1[0];
+  int b = RLE_row2[0];
+  const int* p1 = RLE_row1 + 1;
+  const int* p2 = RLE_row2 + 1;
+  int left1 = *p1;  // Pixels left in the current run of each row
+  int left2 = *p2;
+
+  int color = (op >> (2 * a + b)) & 1;
+  out[0] = color;
+  uint32 n = 1;
+  int run = 0;
+  for (;;) {
+    // Next segment where both pixel values are constant
+    int step = left1 < left2 ? left1 : left2;
+    int c = (op >> (2 * a + b)) & 1;
+    if (c != color) {
+      out[n++] = run;
+      run = 0;
+      color = c;
+    }
+    run += step;
+    left1 -= step;
+    left2 -= step;
+    RUNMEM++;
+    // Both rows have the same width, so they end together
+    if (left1 == 0) {
+      if (*++p1 == EOR) break;
+      left1 = *p1;
+      a ^= 1;
+    }
+    if (left2 == 0) {
+      left2 = *++p2;
+      b ^= 1;
+    }
+  }
+  out[n++] = run;
+  out[n++] = EOR;
+
+  return n;
+}
+
+/// Estimated size of row i of the result of a boolean op:
+/// usually about as many runs as the larger operand
+static size_t MergeRowWeight(void* ctx, uint32 i) {
+  BooleanOpArgs* args = ctx;
+  size_t size1 = RowWeight(args->img1, i);
+  size_t size2 = RowWeight(args->img2, i);
+  return size1 > size2 ? size1 : size2;
+}
+
+/// Merge rows [first, last) of two images of the same size
+static void MergeRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  BooleanOpArgs* args = ctx;
+  const Image img1 = args->img1;
+  const Image img2 = args->img2;
+
+  // Pairs of repeated rows are merged once,
+  // and equal results are stored once
+  int memo = img1->encoding == IMAGE_RLE && img2->encoding == IMAGE_RLE &&
+             (!img1->distinct_rows || !img2->distinct_rows);
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+  RowBuilderIntern(b);
+
+  // Merge each pair of rows directly into the slab of the result
+  int* buf1 = AllocateRowBuffer(img1);
+  int* buf2 = AllocateRowBuffer(img2);
+  for (uint32 i = first; i < last; i++) {
+    const int* row1 = GetRLERow(img1, i, buf1);
+    const int* row2 = GetRLERow(img2, i, buf2);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row1, row2) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    size_t max_elems =
+        GetSizeRLERowArray(row1) + GetSizeRLERowArray(row2) - 1;
+    int* row = RowBuilderReserve(b, max_elems);
+    RowBuilderCommit(b, MergeRLERows(row1, row2, args->op, row));
+    if (e != NULL) RowMemoSet(e, row1, row2, b->num_rows - 1);
+  }
+  free(buf1);
+  free(buf2);
+  free(m.entries);
+}
+
+/// Apply a binary boolean op to two images of the same size.
+/// If any operand is in IMAGE_BITMAP, so is the result.
+static Image ImageBooleanOp(const Image img1, const Image img2, int op) {
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+
+  uint32 width = img1->width;
+  uint32 height = img1->height;
+  BooleanOpArgs args = {img1, img2, op, NULL};
+
+  if (img1->encoding == IMAGE_BITMAP || img2->encoding == IMAGE_BITMAP) {
+    args.result = AllocateBitmapImage(width, height);
+    ParallelRows(height, (uint64)GetNumWordsBitmapRow(width) * height,
+                 BitmapBooleanRows, &args);
+    return args.result;
+  }
+
+  return BuildImage(width, height, MergeRowWeight, MergeRows, &args);
+}
+
+Image ImageAND(const Image img1, const Image img2) {
+  InstrBegin("ImageAND");
+  Image result = ImageBooleanOp(img1, img2, OP_AND);
+  InstrEnd();
+  return result;
+}
+
+Image ImageOR(const Image img1, const Image img2) {
+  InstrBegin("ImageOR");
+  Image result = ImageBooleanOp(img1, img2, OP_OR);
+  InstrEnd();
+  return result;
+}
+
+Image ImageXOR(const Image img1, const Image img2) {
+  InstrBegin("ImageXOR");
+  Image result = ImageBooleanOp(img1, img2, OP_XOR);
+  InstrEnd();
+  return result;
+}
+
+// N-ary boolean operations
+//
+// The rows of n images are merged in a single pass: a min-heap holds the
+// position of the next transition of each row, so each transition costs
+// O(log n) steps, and the whole row O(total runs * log n).
+// The number of BLACK pixels at the current position decides the color
+// of the result: all of them for AND, any for OR, at least k for the
+// threshold, and its parity for XOR.
+
+// An entry of the transitions heap
+typedef struct {
+  uint32 pos;  // the position of the next transition
+  uint32 j;    // the row
+} Transition;
+
+/// Restore the heap order of heap[0..n) after heap[i] was increased
+static void SiftDown(Transition* heap, uint32 n, uint32 i) {
+  Transition t = heap[i];
+  for (;;) {
+    uint32 c = 2 * i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && heap[c + 1].pos < heap[c].pos) c++;
+    if (heap[c].pos >= t.pos) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = t;
+}
+
+// Operands of an n-ary operation, and scratch space for merging rows
+typedef struct {
+  const Image* imgs;
+  uint32 n;
+  uint32 k;    // minimum number of BLACK pixels for a BLACK result
+  int parity;  // use the parity of the number of BLACK pixels instead
+  int op;      // the binary op (for bitmaps): OP_AND, OP_OR or OP_XOR
+} NaryArgs;
+
+/// Merge the n RLE rows of the same width.
+///   heap, p: scratch space for n elements.
+/// The result is written to out, in canonical RLE form.
+/// out must have room for (runs1 + ... + runsn + 1) elements.
+/// Returns the number of elements written to out, including EOR.
+static uint32 MergeRLERowsN(const NaryArgs* args, uint32 width,
+                            const int** rows, Transition* heap,
+                            const int** p, int* out) {
+  uint32 num_black = 0;
+  uint32 size = 0;
+  for (uint32 j = 0; j < args->n; j++) {
+    num_black += (uint32)rows[j][0];
+    p[j] = rows[j] + 1;
+    if ((uint32)*p[j] < width) {
+      heap[size].pos = (uint32)*p[j];
+      heap[size].j = j;
+      size++;
+    }
+  }
+  for (uint32 i = size / 2; i-- > 0;) SiftDown(heap, size, i);
+
+  int color = args->parity ? (int)(num_black & 1) : num_black >= args->k;
+  out[0] = color;
+  uint32 n = 1;
+  uint32 start = 0;  // Start of the current run
+  while (size > 0) {
+    // All the transitions at this position
+    uint32 x = heap[0].pos;
+    do {
+      uint32 j = heap[0].j;
+      // The color of row j flips: BLACK if it was WHITE before
+      int was_black = (int)((p[j] - rows[j]) & 1) ^ (rows[j][0] ^ 1);
+      num_black += was_black ? (uint32)-1 : 1;
+      p[j]++;
+      RUNMEM++;
+      if ((uint32)*p[j] < width - x) {
+        heap[0].pos = x + (uint32)*p[j];
+      } else {
+        heap[0] = heap[--size];  // The last run of row j
+      }
+      SiftDown(heap, size, 0);
+    } while (size > 0 && heap[0].pos == x);
+
+    int c = args->parity ? (int)(num_black & 1) : num_black >= args->k;
+    if (c != color) {
+      out[n++] = (int)(x - start);
+      start = x;
+      color = c;
+    }
+  }
+  out[n++] = (int)(width - start);
+  out[n++] = EOR;
+
+  return n;
+}
+
+/// Estimated size of row i of the result: the largest operand row
+static size_t NaryRowWeight(void* ctx, uint32 i) {
+  NaryArgs* args = ctx;
+  size_t size = 3;
+  for (uint32 j = 0; j < args->n; j++) {
+    size_t s = RowWeight(args->imgs[j], i);
+    if (s > size) size = s;
+  }
+  return size;
+}
+
+/// Compute rows [first, last) of an n-ary operation
+static void NaryRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  NaryArgs* args = ctx;
+  uint32 n = args->n;
+  uint32 width = args->imgs[0]->width;
+
+  int** bufs = malloc(n * sizeof(int*));
+  const int** rows = malloc(n * sizeof(int*));
+  const int** p = malloc(n * sizeof(int*));
+  Transition* heap = malloc(n * sizeof(Transition));
+  assert(bufs != NULL && rows != NULL && p != NULL && heap != NULL);
+  for (uint32 j = 0; j < n; j++) bufs[j] = AllocateRowBuffer(args->imgs[j]);
+  RowBuilderIntern(b);
+
+  for (uint32 i = first; i < last; i++) {
+    size_t max_elems = 2;
+    for (uint32 j = 0; j < n; j++) {
+      rows[j] = GetRLERow(args->imgs[j], i, bufs[j]);
+      max_elems += GetSizeRLERowArray(rows[j]) - 2;
+    }
+    if (max_elems > width + 2) max_elems = width + 2;
+    int* row = RowBuilderReserve(b, max_elems);
+    RowBuilderCommit(b, MergeRLERowsN(args, width, rows, heap, p, row));
+  }
+
+  for (uint32 j = 0; j < n; j++) free(bufs[j]);
+  free(bufs);
+  free(rows);
+  free(p);
+  free(heap);
+}
+
+/// Apply the binary op of an n-ary operation to rows [first, last), into
+/// the bitmap result (args->imgs[n]).  Bitmap operands are combined whole
+/// words at a time; the rows of the others are expanded one at a time.
+static void NaryBitmapRows(void* ctx, uint32 first, uint32 last) {
+  NaryArgs* args = ctx;
+  uint32 width = args->imgs[0]->width;
+  uint32 num_rows = last - first;
+  size_t num_words = GetNumWordsBitmapRow(width);
+  uint64* out = GetBitmapRow(args->imgs[args->n], first);
+  int* buf = malloc((width + 2) * sizeof(int));
+  uint64* bits = malloc(num_words * sizeof(uint64));
+  assert(buf != NULL && bits != NULL);
+
+  for (uint32 j = 0; j < args->n; j++) {
+    const Image img = args->imgs[j];
+    if (img->encoding == IMAGE_BITMAP) {
+      const uint64* src = GetBitmapRow(img, first);
+      if (j == 0) {
+        memcpy(out, src, num_words * num_rows * sizeof(uint64));
+        PIXMEM += num_words * num_rows;
+      } else {
+        BitmapRowsOp(width, num_rows, out, src, out, args->op);
+      }
+      continue;
+    }
+    for (uint32 i = first; i < last; i++) {
+      uint64* row = out + (i - first) * num_words;
+      RLERowToBitmap(width, GetRLERow(img, i, buf), j == 0 ? row : bits);
+      if (j > 0) BitmapRowsOp(width, 1, row, bits, row, args->op);
+    }
+  }
+  free(buf);
+  free(bits);
+}
+
+/// Apply an n-ary operation.
+/// The result is in IMAGE_BITMAP when an operand is, and in IMAGE_RLE
+/// otherwise, as for ImageBooleanOp.
+static Image ImageNaryOp(const Image* imgs, int n, NaryArgs* args) {
+  assert(imgs != NULL && n > 0);
+  uint32 width = imgs[0]->width;
+  uint32 height = imgs[0]->height;
+  int any_bitmap = 0;
+  for (int j = 0; j < n; j++) {
+    assert(imgs[j] != NULL);
+    assert(imgs[j]->width == width && imgs[j]->height == height);
+    any_bitmap |= imgs[j]->encoding == IMAGE_BITMAP;
+  }
+  args->imgs = imgs;
+  args->n = (uint32)n;
+
+  // Two operands: the usual operations, which follow the same rule
+  if (n == 2 && args->op != 0) return ImageBooleanOp(imgs[0], imgs[1], args->op);
+
+  if (any_bitmap && args->op != 0) {
+    // Whole words, one operand at a time
+    Image* operands = malloc((n + 1) * sizeof(Image));
+    assert(operands != NULL);
+    memcpy(operands, imgs, n * sizeof(Image));
+    operands[n] = AllocateBitmapImage(width, height);
+    args->imgs = operands;
+    ParallelRows(height, (uint64)GetNumWordsBitmapRow(width) * height * n,
+                 NaryBitmapRows, args);
+    Image result = operands[n];
+    free(operands);
+    return result;
+  }
+
+  Image result;
+  if (args->k == 0 && !args->parity) {
+    result = ImageCreate(width, height, BLACK);
+  } else if (args->k > args->n) {
+    result = ImageCreate(width, height, WHITE);
+  } else if (n == 1) {
+    result = ImageCopy(imgs[0]);
+  } else {
+    result = BuildImage(width, height, NaryRowWeight, NaryRows, args);
+  }
+  ImageSetEncoding(result, any_bitmap ? IMAGE_BITMAP : IMAGE_RLE);
+  return result;
+}
+
+Image ImageANDn(const Image* imgs, int n) {
+  InstrBegin("ImageANDn");
+  NaryArgs args = {NULL, 0, (uint32)n, 0, OP_AND};
+  Image result = ImageNaryOp(imgs, n, &args);
+  InstrEnd();
+  return result;
+}
+
+Image ImageORn(const Image* imgs, int n) {
+  InstrBegin("ImageORn");
+  NaryArgs args = {NULL, 0, 1, 0, OP_OR};
+  Image result = ImageNaryOp(imgs, n, &args);
+  InstrEnd();
+  return result;
+}
+
+Image ImageXORn(const Image* imgs, int n) {
+  InstrBegin("ImageXORn");
+  NaryArgs args = {NULL, 0, 1, 1, OP_XOR};
+  Image result = ImageNaryOp(imgs, n, &args);
+  InstrEnd();
+  return result;
+}
+
+Image ImageAtLeast(const Image* imgs, int n, int k) {
+  InstrBegin("ImageAtLeast");
+  NaryArgs args = {NULL, 0, k < 0 ? 0 : (uint32)k, 0, 0};
+  if (k == 1) args.op = OP_OR;  // Same as ImageORn
+  if (k == n) args.op = OP_AND;
+  Image result = ImageNaryOp(imgs, n, &args);
+  InstrEnd();
+  return result;
+}
+
+/// Deferred evaluation of boolean expressions
+
+// An expression is a tree of nodes: images (leaves), NEG nodes and binary
+// boolean operation nodes.  Nothing is computed when it is built.
+// ImageExprEval compiles the tree into a truth table over its distinct
+// leaf images, and computes each output row in a single pass over the runs
+// of all the leaf rows (see MergeRLERowsTable), with no intermediate rows.
+// The truth table simplifies the expression: operands that do not affect
+// the result are dropped (x XOR x is constant, a OR (a AND b) is a...),
+// and expressions of one or two images are computed by the usual
+// functions (ImageCopy, ImageNEG, ImageBooleanOp).
+
+#define EXPR_IMAGE 0   // A leaf
+#define EXPR_NEG 1     // Negation of a
+#define EXPR_BINARY 2  // op applied to a and b
+#define EXPR_CONST 3   // All pixels op (BLACK or WHITE), as in x XOR x
+
+// Maximum number of distinct images evaluated in a single pass:
+// the truth table has one bit per combination of their pixel values.
+#define MAX_EXPR_LEAVES 6
+
+struct imageExpr {
+  int kind;      // EXPR_IMAGE, EXPR_NEG, EXPR_BINARY or EXPR_CONST
+  int op;        // the op code (EXPR_BINARY), or the color (EXPR_CONST)
+  Image img;     // the image (EXPR_IMAGE only)
+  ImageExpr a;   // the operands
+  ImageExpr b;
+  uint32 width;  // the size of the result
+  uint32 height;
+};
+
+static ImageExpr AllocateExpr(int kind, uint32 width, uint32 height) {
+  ImageExpr e = malloc(sizeof(struct imageExpr));
+  assert(e != NULL);
+  e->kind = kind;
+  e->op = 0;
+  e->img = NULL;
+  e->a = NULL;
+  e->b = NULL;
+  e->width = width;
+  e->height = height;
+  return e;
+}
+
+/// Check if two expressions are the same (all ops are commutative)
+static int IsSameExpr(const ImageExpr x, const ImageExpr y) {
+  if (x == y) return 1;
+  if (x->kind != y->kind || x->op != y->op) return 0;
+  switch (x->kind) {
+    case EXPR_IMAGE:
+      return x->img == y->img;
+    case EXPR_CONST:
+      return 1;
+    case EXPR_NEG:
+      return IsSameExpr(x->a, y->a);
+    default:
+      return (IsSameExpr(x->a, y->a) && IsSameExpr(x->b, y->b)) ||
+             (IsSameExpr(x->a, y->b) && IsSameExpr(x->b, y->a));
+  }
+}
+
+ImageExpr ImageExprOf(const Image img) {
+  assert(img != NULL);
+  ImageExpr e = AllocateExpr(EXPR_IMAGE, img->width, img->height);
+  e->img = img;
+  return e;
+}
+
+ImageExpr ImageExprNEG(ImageExpr x) {
+  assert(x != NULL);
+  if (x->kind == EXPR_NEG) {
+    // NEG NEG x = x
+    ImageExpr inner = x->a;
+    free(x);
+    return inner;
+  }
+  ImageExpr e = AllocateExpr(EXPR_NEG, x->width, x->height);
+  e->a = x;
+  return e;
+}
+
+/// Create a node applying op to x and y.
+/// x and y may be the same node.
+static ImageExpr ExprBinary(ImageExpr x, ImageExpr y, int op) {
+  assert(x != NULL && y != NULL);
+  assert(x->width == y->width && x->height == y->height);
+  if (IsSameExpr(x, y)) {
+    if (x != y) ImageExprDestroy(&y);
+    if (op != OP_XOR) {
+      // x AND x = x OR x = x
+      return x;
+    }
+    // x XOR x is WHITE
+    ImageExpr e = AllocateExpr(EXPR_CONST, x->width, x->height);
+    e->op = WHITE;
+    ImageExprDestroy(&x);
+    return e;
+  }
+  ImageExpr e = AllocateExpr(EXPR_BINARY, x->width, x->height);
+  e->op = op;
+  e->a = x;
+  e->b = y;
+  return e;
+}
+
+ImageExpr ImageExprAND(ImageExpr x, ImageExpr y) {
+  return ExprBinary(x, y, OP_AND);
+}
+
+ImageExpr ImageExprOR(ImageExpr x, ImageExpr y) {
+  return ExprBinary(x, y, OP_OR);
+}
+
+ImageExpr ImageExprXOR(ImageExpr x, ImageExpr y) {
+  return ExprBinary(x, y, OP_XOR);
+}
+
+void ImageExprDestroy(ImageExpr* ep) {
+  assert(ep != NULL);
+  ImageExpr e = *ep;
+  if (e == NULL) return;
+  ImageExprDestroy(&e->a);
+  ImageExprDestroy(&e->b);
+  free(e);
+  *ep = NULL;
+}
+
+// Truth tables
+//
+// A truth table over k leaves (k <= MAX_EXPR_LEAVES) has 2^k bits:
+// bit (v0 + 2*v1 + 4*v2 + ...) is the result for leaf pixel values v0,v1,...
+// The table of leaf j has the bits whose index has bit j set.
+static const uint64 LeafTable[MAX_EXPR_LEAVES] = {
+    0xAAAAAAAAAAAAAAAAULL, 0xCCCCCCCCCCCCCCCCULL, 0xF0F0F0F0F0F0F0F0ULL,
+    0xFF00FF00FF00FF00ULL, 0xFFFF0000FFFF0000ULL, 0xFFFFFFFF00000000ULL};
+
+/// Mask of the valid bits of a truth table over k leaves
+static uint64 TableMask(uint32 k) {
+  return k == MAX_EXPR_LEAVES ? ~(uint64)0 : ((uint64)1 << (1u << k)) - 1;
+}
+
+/// Apply a binary op code to truth tables a and b
+static uint64 TableOp(uint64 a, uint64 b, int op) {
+  uint64 t = 0;
+  if (op & 1) t |= ~a & ~b;
+  if (op & 2) t |= ~a & b;
+  if (op & 4) t |= a & ~b;
+  if (op & 8) t |= a & b;
+  return t;
+}
+
+/// Collect the distinct images of e in leaves (up to max)
+/// Returns the number of distinct images, which may exceed max.
+static uint32 CollectLeaves(const ImageExpr e, Image* leaves, uint32 n,
+                            uint32 max) {
+  if (e->kind == EXPR_CONST) return n;
+  if (e->kind == EXPR_IMAGE) {
+    for (uint32 j = 0; j < n && j < max; j++) {
+      if (leaves[j] == e->img) return n;
+    }
+    if (n < max) leaves[n] = e->img;
+    return n + 1;
+  }
+  n = CollectLeaves(e->a, leaves, n, max);
+  if (e->kind == EXPR_BINARY) n = CollectLeaves(e->b, leaves, n, max);
+  return n;
+}
+
+/// Compute the truth table of e over the k leaves
+static uint64 ExprTable(const ImageExpr e, const Image* leaves, uint32 k) {
+  switch (e->kind) {
+    case EXPR_IMAGE: {
+      uint32 j = 0;
+      while (leaves[j] != e->img) j++;
+      return LeafTable[j];
+    }
+    case EXPR_CONST:
+      return e->op == BLACK ? ~(uint64)0 : 0;
+    case EXPR_NEG:
+      return ~ExprTable(e->a, leaves, k);
+    default:
+      return TableOp(ExprTable(e->a, leaves, k), ExprTable(e->b, leaves, k),
+                     e->op);
+  }
+}
+
+/// Remove the leaves that do not affect the truth table (*table).
+/// Returns the new number of leaves.
+static uint32 DropIrrelevantLeaves(uint64* table, Image* leaves, uint32 k) {
+  uint32 j = 0;
+  while (j < k) {
+    // Compare the results with leaf j at 1 and at 0
+    uint32 shift = 1u << j;
+    uint64 t = *table & TableMask(k);
+    if (((t & LeafTable[j]) >> shift) != (t & ~LeafTable[j])) {
+      j++;
+      continue;
+    }
+    // Remove bit j from every index, keeping the entries with leaf j at 0
+    uint64 reduced = 0;
+    for (uint32 idx = 0, out = 0; idx < (1u << k); idx++) {
+      if (idx & shift) continue;
+      reduced |= ((t >> idx) & 1) << out++;
+    }
+    *table = reduced;
+    for (uint32 m = j; m + 1 < k; m++) leaves[m] = leaves[m + 1];
+    k--;
+  }
+  return k;
+}
+
+/// Merge k RLE rows of the same width, applying a truth table.
+/// Walks all run lists in lockstep, so it takes O(k * (runs1 + ... + runsk))
+/// steps.  The result is written to out, in canonical RLE form.
+/// out must have room for (runs1 + ... + runsk + 1) elements.
+/// Returns the number of elements written to out, including EOR.
+static uint32 MergeRLERowsTable(const int** rows, uint32 k, uint64 table,
+                                int* out) {
+  const int* p[MAX_EXPR_LEAVES];
+  int left[MAX_EXPR_LEAVES];  // Pixels left in the current run of each row
+  uint32 idx = 0;             // The current pixel values, one bit per row
+  for (uint32 j = 0; j < k; j++) {
+    p[j] = rows[j] + 1;
+    left[j] = *p[j];
+    idx |= (uint32)rows[j][0] << j;
+  }
+
+  int color = (table >> idx) & 1;
+  out[0] = color;
+  uint32 n = 1;
+  int run = 0;
+  for (;;) {
+    // Next segment where all pixel values are constant
+    int step = left[0];
+    for (uint32 j = 1; j < k; j++) {
+      if (left[j] < step) step = left[j];
+    }
+    int c = (table >> idx) & 1;
+    if (c != color) {
+      out[n++] = run;
+      run = 0;
+      color = c;
+    }
+    run += step;
+    RUNMEM++;
+    // All rows have the same width, so they end together
+    int done = 0;
+    for (uint32 j = 0; j < k; j++) {
+      left[j] -= step;
+      if (left[j] == 0) {
+        if (*++p[j] == EOR) {
+          done = 1;
+          continue;
+        }
+        left[j] = *p[j];
+        idx ^= 1u << j;
+      }
+    }
+    if (done) break;
+  }
+  out[n++] = run;
+  out[n++] = EOR;
+
+  return n;
+}
+
+// A compiled expression
+typedef struct {
+  Image leaves[MAX_EXPR_LEAVES];
+  uint32 k;
+  uint64 table;
+} TableArgs;
+
+/// Estimated size of row i of the result: the largest leaf row
+static size_t TableRowWeight(void* ctx, uint32 i) {
+  TableArgs* args = ctx;
+  size_t size = 3;
+  for (uint32 j = 0; j < args->k; j++) {
+    size_t s = RowWeight(args->leaves[j], i);
+    if (s > size) size = s;
+  }
+  return size;
+}
+
+/// Compute rows [first, last) of a compiled expression
+static void TableRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  TableArgs* args = ctx;
+  int* bufs[MAX_EXPR_LEAVES];
+  const int* rows[MAX_EXPR_LEAVES];
+  for (uint32 j = 0; j < args->k; j++) {
+    bufs[j] = AllocateRowBuffer(args->leaves[j]);
+  }
+  RowBuilderIntern(b);
+
+  uint32 width = args->leaves[0]->width;
+  for (uint32 i = first; i < last; i++) {
+    size_t max_elems = 2;
+    for (uint32 j = 0; j < args->k; j++) {
+      rows[j] = GetRLERow(args->leaves[j], i, bufs[j]);
+      max_elems += GetSizeRLERowArray(rows[j]) - 2;
+    }
+    if (max_elems > width + 2) max_elems = width + 2;
+    int* row = RowBuilderReserve(b, max_elems);
+    RowBuilderCommit(b, MergeRLERowsTable(rows, args->k, args->table, row));
+  }
+
+  for (uint32 j = 0; j < args->k; j++) free(bufs[j]);
+}
+
+Image ImageExprEval(const ImageExpr e) {
+  InstrBegin("ImageExprEval");
+  assert(e != NULL);
+
+  TableArgs args;
+  args.k = CollectLeaves(e, args.leaves, 0, MAX_EXPR_LEAVES);
+  Image result;
+  if (args.k > MAX_EXPR_LEAVES) {
+    // Too many images for a single pass: evaluate the operands first
+    Image img1 = ImageExprEval(e->a);
+    Image img2 = e->kind == EXPR_BINARY ? ImageExprEval(e->b) : NULL;
+    result = img2 == NULL ? ImageNEG(img1) : ImageBooleanOp(img1, img2, e->op);
+    ImageDestroy(&img1);
+    ImageDestroy(&img2);
+    InstrEnd();
+    return result;
+  }
+
+  args.table = ExprTable(e, args.leaves, args.k);
+  args.k = DropIrrelevantLeaves(&args.table, args.leaves, args.k);
+  args.table &= TableMask(args.k);
+
+  switch (args.k) {
+    case 0:
+      result = ImageCreate(e->width, e->height, (uint8)(args.table & 1));
+      break;
+    case 1:
+      // The table is 0b10 (the image) or 0b01 (its negation)
+      result = args.table == 2 ? ImageCopy(args.leaves[0])
+                               : ImageNEG(args.leaves[0]);
+      break;
+    case 2:
+      // Op codes index by 2*a + b: a is leaf 1, b is leaf 0
+      result = ImageBooleanOp(args.leaves[1], args.leaves[0], (int)args.table);
+      break;
+    default:
+      result = BuildImage(e->width, e->height, TableRowWeight, TableRows,
+                          &args);
+      break;
+  }
+  InstrEnd();
+  return result;
+}
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Mirror an image = flip top-bottom.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageHorizontalMirror(const Image img) {
+  InstrBegin("ImageHorizontalMirror");
+  assert(img != NULL);
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  if (!CanShareRows(img, NULL)) {
+    // Copy the bitmap rows in reverse order
+    Image newImage = AllocateBitmapImage(width, height);
+    uint32 num_words = GetNumWordsBitmapRow(width);
+    for (uint32 i = 0; i < height; i++) {
+      memcpy(GetBitmapRow(newImage, i), GetBitmapRow(img, height - i - 1),
+             num_words * sizeof(uint64));
+    }
+    PIXMEM += (uint64)num_words * height;
+    InheritRowHashes(newImage, img, NULL, 1);
+    InstrEnd();
+    return newImage;
+  }
+
+  // The rows are the same, in reverse order: just share them
+  // A primeira linha da nova imagem será a última da original, a segunda
+  // será a penúltima, e assim sucessivamente.
+  Image newImage = AllocateSharingImage(width, height, img, NULL);
+  for (uint32 i = 0; i < height; i++) {
+    ShareRow(newImage, i, img, height - i - 1);
+  }
+  InheritRowHashes(newImage, img, NULL, 1);
+  InstrEnd();
+  return newImage;
+}
+
+// Left-right mirror of rows
+//
+// Mirroring a RLE row just reverses its run list.  The first color becomes
+// the color of the last run, which differs from the first one when the
+// number of runs is even.  Packed and bitmap rows are reversed in place
+// without decoding them.
+
+/// Write the left-right mirror of a RLE row to out, which must have room
+/// for as many elements as RLE_row.  (out may be RLE_row itself.)
+/// Returns the number of elements written, including EOR.
+static uint32 ReverseRLERow(const int* RLE_row, int* out) {
+  uint32 num_runs = GetNumRunsInRLERow(RLE_row);
+  int color = RLE_row[0] ^ ((num_runs & 1) ^ 1);
+  if (out == RLE_row) {
+    for (uint32 i = 1, j = num_runs; i < j; i++, j--) {
+      int run = out[i];
+      out[i] = out[j];
+      out[j] = run;
+    }
+  } else {
+    for (uint32 i = 1; i <= num_runs; i++) {
+      out[i] = RLE_row[num_runs + 1 - i];
+    }
+  }
+  out[0] = color;
+  out[num_runs + 1] = EOR;
+  RUNMEM += num_runs;
+  return num_runs + 2;
+}
+
+/// Reverse n bytes in place
+static void ReverseBytes(uint8* bytes, size_t n) {
+  for (size_t i = 0, j = n; i + 1 < j; i++, j--) {
+    uint8 t = bytes[i];
+    bytes[i] = bytes[j - 1];
+    bytes[j - 1] = t;
+  }
+}
+
+/// Mirror a packed row left-right, in place.
+/// Reversing all the run codes reverses the bytes of each code too;
+/// each code then starts with its last byte (the one without the top bit),
+/// and its bytes are put back in order.
+static void ReversePackedRow(uint8* code) {
+  uint8* runs = code + 1;
+  size_t n = strlen((const char*)runs);
+  ReverseBytes(runs, n);
+
+  uint32 num_runs = 0;
+  for (size_t start = 0; start < n; num_runs++) {
+    size_t end = start + 1;
+    while (end < n && (runs[end] & 0x80)) end++;
+    ReverseBytes(runs + start, end - start);
+    start = end;
+  }
+  code[0] ^= (num_runs & 1) ^ 1;
+  RUNMEM += num_runs;
+}
+
+/// Reverse the order of the bits of a word
+static uint64 ReverseBits(uint64 x) {
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(x);
+}
+
+/// Mirror a bitmap row left-right, in place, in O(words).
+/// After reversing all the words, pixel x is at position
+/// (64 * num_words - 1 - x), so the row is shifted down by the padding.
+static void ReverseBitmapRow(uint32 image_width, uint64* bits) {
+  uint32 num_words = GetNumWordsBitmapRow(image_width);
+  for (uint32 i = 0, j = num_words - 1; i <= j && j < num_words; i++, j--) {
+    uint64 t = ReverseBits(bits[i]);
+    bits[i] = ReverseBits(bits[j]);
+    bits[j] = t;
+  }
+  uint32 pad = 64 * num_words - image_width;
+  if (pad != 0) {
+    for (uint32 i = 0; i + 1 < num_words; i++) {
+      bits[i] = (bits[i] >> pad) | (bits[i + 1] << (64 - pad));
+    }
+    bits[num_words - 1] >>= pad;
+  }
+  PIXMEM += num_words;
+}
+
+/// Build rows [first, last) of the vertical mirror of an image
+static void VerticalMirrorRows(void* ctx, uint32 first, uint32 last,
+                               RowBuilder* b) {
+  const Image img = ctx;
+
+  // Repeated rows are reversed once
+  int memo = img->encoding == IMAGE_RLE && !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = first; i < last; i++) {
+    const int* row = GetRLERow(img, i, buf);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    int* dst = RowBuilderReserve(b, GetSizeRLERowArray(row));
+    RowBuilderCommit(b, ReverseRLERow(row, dst));
+    if (e != NULL) RowMemoSet(e, row, NULL, b->num_rows - 1);
+  }
+  free(buf);
+  free(m.entries);
+}
+
+/// Mirror an image = flip left-right.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageVerticalMirror(const Image img) {
+  InstrBegin("ImageVerticalMirror");
+  assert(img != NULL);
+
+  Image result = BuildImage(img->width, img->height, ImageRowWeight,
+                            VerticalMirrorRows, img);
+  InstrEnd();
+  return result;
+}
+
+/// Mirror rows [first, last) of the image in ctx left-right, in place
+static void VerticalMirrorInPlaceRows(void* ctx, uint32 first, uint32 last) {
+  Image img = ctx;
+  for (uint32 i = first; i < last; i++) {
+    switch (img->encoding) {
+      case IMAGE_RLE:
+        ReverseRLERow(img->row[i], img->row[i]);
+        break;
+      case IMAGE_RLE_PACKED:
+        ReversePackedRow(img->packed[i]);
+        break;
+      case IMAGE_BITMAP:
+        ReverseBitmapRow(img->width, GetBitmapRow(img, i));
+        break;
+    }
+  }
+}
+
+/// Mirror an image = flip left-right, in place.
+/// Rows shared with other images are copied first (copy on write).
+/// The encoding of img is kept.
+void ImageVerticalMirrorInPlace(Image img) {
+  InstrBegin("ImageVerticalMirrorInPlace");
+  assert(img != NULL);
+
+  OwnRows(img);
+  DropRowHashes(img);
+  DropRunIndex(img);
+  // The statistics are kept: only the bounding box moves
+  Stats* stats = img->stats;
+  if (stats != NULL && stats->black > 0) {
+    stats->x = img->width - stats->x - stats->width;
+  }
+  uint64 work = 0;
+  for (uint32 i = 0; i < img->height; i++) work += RowWeight(img, i);
+  ParallelRows(img->height, work, VerticalMirrorInPlaceRows, img);
+  InstrEnd();
+}
+
+// Operands of a replication
+typedef struct {
+  Image img1;
+  Image img2;
+} ReplicateArgs;
+
+/// Estimated size of row i of img1 replicated at the bottom of img2
+static size_t ReplicateAtBottomRowWeight(void* ctx, uint32 i) {
+  ReplicateArgs* args = ctx;
+  if (i < args->img1->height) return RowWeight(args->img1, i);
+  return RowWeight(args->img2, i - args->img1->height);
+}
+
+/// Build rows [first, last) of img2 replicated at the bottom of img1
+static void ReplicateAtBottomRows(void* ctx, uint32 first, uint32 last,
+                                  RowBuilder* b) {
+    ReplicateArgs* args = ctx;
+    const Image img1 = args->img1;
+    const Image img2 = args->img2;
+
+    int* buf1 = AllocateRowBuffer(img1);
+    int* buf2 = AllocateRowBuffer(img2);
+    for (uint32 i = first; i < last; i++) {                                           // Copia as rows da imagem 1 para a nova imagem
+      const int* row;
+
+      if(i < img1->height){                                                           // Copia as rows da imagem 1
+        row = GetRLERow(img1, i, buf1);
+      } else {                                                                        // Quando acaba de copiar as rows da imagem 1, copia as rows da imagem 2
+        row = GetRLERow(img2, i - img1->height, buf2);
+      }
+
+      RowBuilderAppend(b, row, GetSizeRLERowArray(row));                              // As rows já estão comprimidas, basta copiá-las
+    }
+    free(buf1);
+    free(buf2);
+}
+
+/// Replicate img2 at the bottom of imag1, creating a larger image
+/// Requires: the width of the two images must be the same.
+/// Returns the new larger image.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageReplicateAtBottom(const Image img1, const Image img2) {
+    InstrBegin("ImageReplicateAtBottom");
+    assert(img1 != NULL && img2 != NULL);
+    assert(img1->width == img2->width);
+
+    uint32 new_width = img1->width;
+    uint32 new_height = img1->height + img2->height;
+
+    if (img1->encoding == IMAGE_BITMAP && img2->encoding == IMAGE_BITMAP) {
+      // Bitmap rows are contiguous: copy each image in one go
+      Image newImage = AllocateBitmapImage(new_width, new_height);
+      uint32 num_words = GetNumWordsBitmapRow(new_width);
+      size_t num_words1 = (size_t)num_words * img1->height;
+      size_t num_words2 = (size_t)num_words * img2->height;
+      memcpy(newImage->bits, img1->bits, num_words1 * sizeof(uint64));
+      memcpy(newImage->bits + num_words1, img2->bits,
+             num_words2 * sizeof(uint64));
+      PIXMEM += num_words1 + num_words2;
+      InheritRowHashes(newImage, img1, img2, 0);
+      InstrEnd();
+      return newImage;
+    }
+
+    if (!CanShareRows(img1, img2)) {
+      // Different encodings: copy the rows, as RLE
+      ReplicateArgs args = {img1, img2};
+      Image newImage = BuildImage(new_width, new_height,
+                                  ReplicateAtBottomRowWeight,
+                                  ReplicateAtBottomRows, &args);
+      InheritRowHashes(newImage, img1, img2, 0);
+      InstrEnd();
+      return newImage;
+    }
+
+    // The rows of img1 followed by the rows of img2: just share them
+    Image newImage = AllocateSharingImage(new_width, new_height, img1, img2);
+    for (uint32 i = 0; i < img1->height; i++) {
+      ShareRow(newImage, i, img1, i);
+    }
+    for (uint32 i = 0; i < img2->height; i++) {
+      ShareRow(newImage, img1->height + i, img2, i);
+    }
+    InheritRowHashes(newImage, img1, img2, 0);
+    InstrEnd();
+    return newImage;
+}
+
+/// Estimated size of row i of img2 replicated to the right of img1
+static size_t ReplicateAtRightRowWeight(void* ctx, uint32 i) {
+  ReplicateArgs* args = ctx;
+  return RowWeight(args->img1, i) + RowWeight(args->img2, i);
+}
+
+/// Concatenate two RLE rows into out: the runs of RLE_row1, then the runs of
+/// RLE_row2, the last run of one joined with the first run of the other
+/// when they have the same color.
+/// out must have room for the elements of both rows.
+/// Returns the number of elements written, including EOR.
+static uint32 ConcatRLERows(const int* RLE_row1, const int* RLE_row2,
+                            int* out) {
+  assert(RLE_row1 != NULL && RLE_row2 != NULL);
+  assert(out != NULL);
+
+  uint32 n = 0;
+  out[n++] = RLE_row1[0];
+  for (const int* run = RLE_row1 + 1; *run != EOR; run++) {
+    out[n++] = *run;
+  }
+  // Runs alternate colors: the last one has the first color if their
+  // number is odd
+  uint32 num_runs1 = n - 1;
+  int last_color = RLE_row1[0] ^ (int)(num_runs1 % 2 == 0);
+  const int* run = RLE_row2 + 1;
+  if (RLE_row2[0] == last_color) {
+    out[n - 1] += *run++;
+  }
+  for (; *run != EOR; run++) {
+    out[n++] = *run;
+  }
+  out[n++] = EOR;
+  RUNMEM += num_runs1 + (uint32)(run - RLE_row2 - 1);
+  return n;
+}
+
+/// Build rows [first, last) of img2 replicated to the right of img1
+static void ReplicateAtRightRows(void* ctx, uint32 first, uint32 last,
+                                 RowBuilder* b) {
+  ReplicateArgs* args = ctx;
+  const Image img1 = args->img1;
+  const Image img2 = args->img2;
+
+  // Pairs of repeated rows are concatenated once
+  int memo = img1->encoding == IMAGE_RLE && img2->encoding == IMAGE_RLE &&
+             (!img1->distinct_rows || !img2->distinct_rows);
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  int* buf1 = AllocateRowBuffer(img1);
+  int* buf2 = AllocateRowBuffer(img2);
+  for (uint32 i = first; i < last; i++) {
+    const int* row1 = GetRLERow(img1, i, buf1);
+    const int* row2 = GetRLERow(img2, i, buf2);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row1, row2) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    size_t max_elems =
+        GetSizeRLERowArray(row1) + GetSizeRLERowArray(row2) - 1;
+    int* row = RowBuilderReserve(b, max_elems);
+    RowBuilderCommit(b, ConcatRLERows(row1, row2, row));
+    if (e != NULL) RowMemoSet(e, row1, row2, b->num_rows - 1);
+  }
+  free(buf1);
+  free(buf2);
+  free(m.entries);
+}
+
+/// Replicate img2 to the right of imag1, creating a larger image
+/// Requires: the height of the two images must be the same.
+/// Returns the new larger image.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2) {
+  InstrBegin("ImageReplicateAtRight");
   assert(img1 != NULL && img2 != NULL);
   assert(img1->height == img2->height);
 
   uint32 new_width = img1->width + img2->width;
   uint32 new_height = img1->height;
 
-  Image newImage = AllocateImageHeader(new_width, new_height);
-                                                                           
-  for (uint32 i = 0; i < new_height; i++) {                                 // Processa cada linha das imagens para criar as linhas da nova imagem
-
-      uint8* newIamgerow;
-                                                                            // Ponteiros para as linhas descompactadas das imagens originais
-      uint8* row1 = UncompressRow(img1->width, img1->row[i]);
-      uint8* row2 = UncompressRow(img2->width, img2->row[i]);
-                                                                            // Aloca espaço para a nova linha que terá a largura combinada das duas imagens
-      newIamgerow = malloc(new_width * sizeof(uint8));
-      
-      for (uint32 j = 0; j < new_width; j++) {
-        if (j < img1->width) {                                               // Copia as rows da imagem 1
-          newIamgerow[j] = row1[j];
-        } else {                                                             // Quando acaba de copiar as rows da imagem 1, copia as rows da imagem 2
-          newIamgerow[j] = row2[j - img1->width];
+  ReplicateArgs args = {img1, img2};
+  Image result = BuildImage(new_width, new_height, ReplicateAtRightRowWeight,
+                            ReplicateAtRightRows, &args);
+  InstrEnd();
+  return result;
+}
+
+/// Rotations and transposition
+
+/// Build rows [first, last) of the 180 degree rotation of an image:
+/// row i is row (height - 1 - i), reversed
+static void Rotate180Rows(void* ctx, uint32 first, uint32 last,
+                          RowBuilder* b) {
+  const Image img = ctx;
+  uint32 height = img->height;
+
+  // Repeated rows are reversed once
+  int memo = img->encoding == IMAGE_RLE && !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = first; i < last; i++) {
+    const int* row = GetRLERow(img, height - 1 - i, buf);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    int* dst = RowBuilderReserve(b, GetSizeRLERowArray(row));
+    RowBuilderCommit(b, ReverseRLERow(row, dst));
+    if (e != NULL) RowMemoSet(e, row, NULL, b->num_rows - 1);
+  }
+  free(buf);
+  free(m.entries);
+}
+
+static size_t Rotate180RowWeight(void* ctx, uint32 i) {
+  const Image img = ctx;
+  return RowWeight(img, img->height - 1 - i);
+}
+
+// Transposition
+//
+// Row x of the transpose is column x of the image.  The vertical runs of
+// column x end where its pixels change from one row to the next, that is,
+// at the BLACK runs of the XOR of the two rows.  So the transpose is built
+// by sweeping over the pairs of consecutive rows, merging their runs:
+//  1. The runs of each column are counted (adding the changes of all pairs
+//     of rows in a difference array), so that the result rows are
+//     allocated exactly, in a single slab;
+//  2. The run lengths are written straight into the result rows.
+// The second sweep is done over bands of TRANSPOSE_BAND columns, so that
+// the state of the columns of a band (and the ends of their result rows)
+// stays in cache.  Each row keeps a cursor into its runs from one band to
+// the next.
+// Both sweeps take O(runs of img + runs of the result) time, plus
+// O(height) per band, and no pixel is ever expanded.
+
+#define TRANSPOSE_BAND 256
+
+// A position in an RLE row: the run containing a column
+typedef struct {
+  const int* run;  // The run (in the RLE row)
+  uint32 start;    // Its first column
+  int color;       // Its color
+} RunCursor;
+
+static void RunCursorInit(RunCursor* c, const int* RLE_row) {
+  c->run = RLE_row + 1;
+  c->start = 0;
+  c->color = RLE_row[0];
+}
+
+/// Move c to the run containing column x
+static void RunCursorSeek(RunCursor* c, uint32 x) {
+  while (c->start + (uint32)*c->run <= x) {
+    c->start += (uint32)*c->run;
+    c->run++;
+    c->color ^= 1;
+    RUNMEM++;
+  }
+}
+
+// A segment of columns [first, last)
+typedef struct {
+  uint32 first;
+  uint32 last;
+} Segment;
+
+/// Find the segments of columns in [x, end) where the pixels of two rows
+/// differ, starting from cursors c1 and c2 at column x (which are moved).
+/// segs must have room for all of them: at most (end - x + 1) / 2.
+/// Returns the number of segments.
+static uint32 RowChanges(RunCursor* c1, RunCursor* c2, uint32 x, uint32 end,
+                         Segment* segs) {
+  uint32 n = 0;
+  while (x < end) {
+    uint32 end1 = c1->start + (uint32)*c1->run;
+    uint32 end2 = c2->start + (uint32)*c2->run;
+    uint32 e = end1 < end2 ? end1 : end2;
+    if (e > end) e = end;
+    if (c1->color != c2->color) {
+      if (n > 0 && segs[n - 1].last == x) {
+        segs[n - 1].last = e;
+      } else {
+        segs[n].first = x;
+        segs[n].last = e;
+        n++;
+      }
+    }
+    x = e;
+    if (x < end) {
+      RunCursorSeek(c1, x);
+      RunCursorSeek(c2, x);
+    }
+  }
+  return n;
+}
+
+/// Transpose img.
+/// Row r of the result is column (flip ? width - 1 - r : r) of img,
+/// from the bottom up if reverse.
+static Image Transpose(const Image img, int flip, int reverse) {
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  // The runs of each row
+  Image rle = NULL;
+  if (img->encoding != IMAGE_RLE) {
+    rle = ImageCopy(img);
+    ImageSetEncoding(rle, IMAGE_RLE);
+  }
+  int* const* rows = (rle != NULL ? rle : img)->row;
+
+  Segment* segs = malloc(((size_t)width / 2 + 1) * sizeof(Segment));
+  RunCursor* cursors = malloc((size_t)height * sizeof(RunCursor));
+  int** out = malloc((size_t)width * sizeof(int*));  // Result row of column
+  uint32* count = calloc((size_t)width + 1, sizeof(uint32));
+  assert(segs != NULL && cursors != NULL && out != NULL && count != NULL);
+
+  // 1. Count the changes of each column: count[x] += 1 at the start of
+  // each segment, count[x] -= 1 at its end, then add up
+  for (uint32 i = 1; i < height; i++) {
+    if (rows[i] == rows[i - 1]) continue;  // Shared rows: no changes
+    RunCursor c1, c2;
+    RunCursorInit(&c1, rows[i - 1]);
+    RunCursorInit(&c2, rows[i]);
+    uint32 n = RowChanges(&c1, &c2, 0, width, segs);
+    for (uint32 k = 0; k < n; k++) {
+      count[segs[k].first]++;
+      count[segs[k].last]--;
+    }
+  }
+  size_t total = 0;
+  uint32 changes = 0;
+  for (uint32 x = 0; x < width; x++) {
+    changes += count[x];
+    count[x] = changes;
+    total += changes + 3;  // Color, changes + 1 runs, and EOR
+  }
+
+  // The result rows, allocated exactly: the runs are written later
+  RowBuilder b;
+  RowBuilderInit(&b, width, total);
+  for (uint32 r = 0; r < width; r++) {
+    uint32 x = flip ? width - 1 - r : r;
+    size_t n = (size_t)count[x] + 3;
+    out[x] = RowBuilderReserve(&b, n);
+    out[x][n - 1] = EOR;
+    RowBuilderCommit(&b, n);
+  }
+
+  // 2. Write the runs, band by band
+  uint32* start = malloc(TRANSPOSE_BAND * sizeof(uint32));  // Of last run
+  uint32* next = malloc(TRANSPOSE_BAND * sizeof(uint32));   // Next element
+  assert(start != NULL && next != NULL);
+  for (uint32 i = 0; i < height; i++) RunCursorInit(&cursors[i], rows[i]);
+  for (uint32 x0 = 0; x0 < width; x0 += TRANSPOSE_BAND) {
+    uint32 x1 = width - x0 < TRANSPOSE_BAND ? width : x0 + TRANSPOSE_BAND;
+
+    // The colors of row 0
+    RunCursor c = cursors[0];
+    for (uint32 x = x0; x < x1; x++) {
+      RunCursorSeek(&c, x);
+      out[x][0] = c.color;
+      start[x - x0] = 0;
+      next[x - x0] = 1;
+    }
+
+    for (uint32 i = 1; i < height; i++) {
+      if (rows[i] != rows[i - 1]) {
+        RunCursor c1 = cursors[i - 1];
+        RunCursor c2 = cursors[i];
+        uint32 n = RowChanges(&c1, &c2, x0, x1, segs);
+        for (uint32 k = 0; k < n; k++) {
+          for (uint32 x = segs[k].first; x < segs[k].last; x++) {
+            out[x][next[x - x0]++] = (int)(i - start[x - x0]);
+            start[x - x0] = i;
+          }
         }
-      }                                                                      
-      newImage->row[i] = CompressRow(new_width, newIamgerow);                // Comprime as rows da nova imagem
+      }
+      // Row i - 1 is done with this band
+      if (x1 < width) RunCursorSeek(&cursors[i - 1], x1);
     }
-  return newImage;
+    if (x1 < width) RunCursorSeek(&cursors[height - 1], x1);
+
+    // The last runs
+    for (uint32 x = x0; x < x1; x++) {
+      out[x][next[x - x0]] = (int)(height - start[x - x0]);
+    }
+  }
+  if (reverse) {
+    for (uint32 x = 0; x < width; x++) ReverseRLERow(out[x], out[x]);
+  }
+
+  free(start);
+  free(next);
+  free(segs);
+  free(cursors);
+  free(out);
+  free(count);
+  ImageDestroy(&rle);
+  return RowBuilderFinish(&b, height, width);
+}
+
+/// Transpose an image: pixel (x, y) goes to (y, x).
+Image ImageTranspose(const Image img) {
+  InstrBegin("ImageTranspose");
+  assert(img != NULL);
+  Image result = Transpose(img, 0, 0);
+  InstrEnd();
+  return result;
+}
+
+/// Rotate an image 90 degrees clockwise: row r of the result is column r,
+/// from the bottom up.
+Image ImageRotate90(const Image img) {
+  InstrBegin("ImageRotate90");
+  assert(img != NULL);
+  Image result = Transpose(img, 0, 1);
+  InstrEnd();
+  return result;
+}
+
+/// Rotate an image 180 degrees: the rows in reverse order, each reversed.
+Image ImageRotate180(const Image img) {
+  InstrBegin("ImageRotate180");
+  assert(img != NULL);
+  Image result = BuildImage(img->width, img->height, Rotate180RowWeight,
+                            Rotate180Rows, img);
+  InstrEnd();
+  return result;
+}
+
+/// Rotate an image 270 degrees clockwise (90 counterclockwise): row r of
+/// the result is column (width - 1 - r).
+Image ImageRotate270(const Image img) {
+  InstrBegin("ImageRotate270");
+  assert(img != NULL);
+  Image result = Transpose(img, 1, 0);
+  InstrEnd();
+  return result;
+}
+
+/// Cropping
+
+// The window of a crop
+typedef struct {
+  Image img;
+  uint32 x;
+  uint32 y;
+  uint32 width;
+  uint32 height;
+  Image result;  // For bitmaps
+} CropArgs;
+
+/// Crop an RLE row to columns [x, x + width), given the start columns of
+/// its runs, and the runs first and last containing x and x + width - 1.
+/// out must have room for (last - first + 3) elements.
+/// Returns the number of elements written to out, including EOR.
+static uint32 CropIndexedRow(const int* RLE_row, const uint32* start,
+                             uint32 first, uint32 last, uint32 x,
+                             uint32 width, int* out) {
+  out[0] = RLE_row[0] ^ (int)(first & 1);
+  if (first == last) {
+    out[1] = (int)width;
+    out[2] = EOR;
+    return 3;
+  }
+  // The runs inside the window are copied, the ones at its ends trimmed
+  uint32 n = last - first - 1;
+  out[1] = (int)(start[first + 1] - x);
+  memcpy(out + 2, RLE_row + first + 2, n * sizeof(int));
+  out[n + 2] = (int)(x + width - start[last]);
+  out[n + 3] = EOR;
+  RUNMEM += n + 2;
+  return n + 4;
+}
+
+/// Crop an RLE row to columns [x, x + width), walking its runs.
+/// Returns like CropIndexedRow.
+static uint32 CropRLERow(const int* RLE_row, uint32 x, uint32 width,
+                         int* out) {
+  RunCursor c;
+  RunCursorInit(&c, RLE_row);
+  RunCursorSeek(&c, x);
+  out[0] = c.color;
+  uint32 n = 1;
+  uint32 end = x + width;
+  while (x < end) {
+    uint32 run_end = c.start + (uint32)*c.run;
+    if (run_end > end) run_end = end;
+    out[n++] = (int)(run_end - x);
+    x = run_end;
+    if (x < end) RunCursorSeek(&c, x);
+  }
+  out[n++] = EOR;
+  return n;
+}
+
+static size_t CropRowWeight(void* ctx, uint32 i) {
+  CropArgs* args = ctx;
+  const Image img = args->img;
+  uint32** index = GetRunIndex(img);
+  if (index != NULL) {
+    // The runs in the window
+    const uint32* start = index[args->y + i];
+    return FindRun(start, args->x + args->width - 1) -
+           FindRun(start, args->x) + 3;
+  }
+  size_t weight = RowWeight(img, args->y + i);
+  return weight < args->width + 2 ? weight : args->width + 2;
+}
+
+/// Build rows [first, last) of a crop (of an RLE or packed image)
+static void CropRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  CropArgs* args = ctx;
+  const Image img = args->img;
+  uint32** index = GetRunIndex(img);
+
+  // Repeated rows are cropped once
+  int memo = img->encoding == IMAGE_RLE && !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = first; i < last; i++) {
+    uint32 y = args->y + i;
+    const int* row = GetRLERow(img, y, buf);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, row, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    if (index != NULL) {
+      // Binary search for the runs at the ends of the window
+      const uint32* start = index[y];
+      uint32 first = FindRun(start, args->x);
+      uint32 last = FindRun(start, args->x + args->width - 1);
+      int* dst = RowBuilderReserve(b, last - first + 3);
+      RowBuilderCommit(b, CropIndexedRow(row, start, first, last, args->x,
+                                         args->width, dst));
+    } else {
+      int* dst = RowBuilderReserve(b, args->width + 2);
+      RowBuilderCommit(b, CropRLERow(row, args->x, args->width, dst));
+    }
+    if (e != NULL) RowMemoSet(e, row, NULL, b->num_rows - 1);
+  }
+  free(buf);
+  free(m.entries);
+}
+
+/// Crop rows [first, last) of a bitmap image, into the bitmap result
+static void CropBitmapRows(void* ctx, uint32 first, uint32 last) {
+  CropArgs* args = ctx;
+  uint32 num_words = GetNumWordsBitmapRow(args->width);
+  uint32 src_words = GetNumWordsBitmapRow(args->img->width);
+  uint32 skip = args->x / 64;  // Whole words before the window
+  uint32 shift = args->x % 64;
+  uint64 mask = args->width % 64 == 0 ? ~(uint64)0
+                                      : ~(~(uint64)0 << (args->width % 64));
+  for (uint32 i = first; i < last; i++) {
+    const uint64* src = GetBitmapRow(args->img, args->y + i) + skip;
+    uint64* out = GetBitmapRow(args->result, i);
+    // Pixel x is bit x % 64 of word x / 64: shift the window to bit 0
+    for (uint32 k = 0; k < num_words; k++) {
+      uint64 word = src[k] >> shift;
+      if (shift != 0 && skip + k + 1 < src_words) {
+        word |= src[k + 1] << (64 - shift);
+      }
+      out[k] = word;
+    }
+    out[num_words - 1] &= mask;
+    PIXMEM += num_words;
+  }
+}
+
+/// Crop an image: the window of width x height pixels whose top left
+/// pixel is (x, y).
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 width,
+                uint32 height) {
+  InstrBegin("ImageCrop");
+  assert(img != NULL);
+  assert(width > 0 && height > 0);
+  assert(x < img->width && width <= img->width - x);
+  assert(y < img->height && height <= img->height - y);
+
+  CropArgs args = {img, x, y, width, height, NULL};
+  Image result;
+  if (img->encoding == IMAGE_BITMAP) {
+    args.result = AllocateBitmapImage(width, height);
+    ParallelRows(height, (uint64)GetNumWordsBitmapRow(width) * height,
+                 CropBitmapRows, &args);
+    result = args.result;
+  } else {
+    if (img->encoding == IMAGE_RLE) BuildRunIndex(img);
+    result = BuildImage(width, height, CropRowWeight, CropRows, &args);
+  }
+  InstrEnd();
+  return result;
+}
+
+/// Morphology
+
+// Dilation and erosion with a rectangular structuring element are
+// separable: the rows are first grown horizontally, one at a time, and
+// then combined vertically.
+// Horizontally, dilation grows each BLACK run of a row by the width of
+// the element, joining the runs that meet; erosion grows the WHITE runs
+// the same way (it is the dilation of the background).
+// Vertically, each result row is the OR (dilation) or the AND (erosion) of
+// the window of grown rows covered by the element.  With the van Herk /
+// Gil-Werman scheme, the rows are split into blocks as tall as the window:
+// the combinations of the rows of each block from its end (suffixes) and
+// from its start (prefixes) are built once, and a window is the suffix of
+// one block combined with the prefix of the next.  So each row takes 3
+// merges, whatever the height of the element.
+// Outside the image, pixels are WHITE for dilation and BLACK for erosion,
+// so that erosion does not eat the borders.
+
+// Parameters of a morphological pass
+typedef struct {
+  Image img;
+  int color;      // The color of the runs grown (BLACK: dilation)
+  uint32 before;  // Pixels added before each run (left or above)
+  uint32 after;   // and after it (right or below)
+} MorphArgs;
+
+/// Grow the runs of the given color of a RLE row by before and after
+/// pixels, joining the runs that meet.
+/// out must have room for as many elements as RLE_row.
+/// Returns the number of elements written to out, including EOR.
+static uint32 GrowRuns(const int* RLE_row, uint32 width, int color,
+                       uint32 before, uint32 after, int* out) {
+  out[0] = color ^ 1;
+  uint32 n = 1;
+  uint32 end = 0;  // End of the runs written to out
+  uint32 x = 0;    // Start of the current run
+  int c = RLE_row[0];
+  for (uint32 k = 1; RLE_row[k] != EOR; k++, c ^= 1) {
+    uint32 start = x;
+    x += (uint32)RLE_row[k];
+    RUNMEM++;
+    if (c != color) continue;
+    uint32 first = start > before ? start - before : 0;
+    uint32 last = width - x > after ? x + after : width;
+    if (n == 1 && first == 0) {
+      // The row starts with a grown run
+      out[0] = color;
+      out[n++] = (int)last;
+    } else if (n > 1 && first <= end) {
+      // Joined to the previous run
+      out[n - 1] += (int)(last - end);
+    } else {
+      out[n++] = (int)(first - end);
+      out[n++] = (int)(last - first);
+    }
+    end = last;
+  }
+  if (end < width) out[n++] = (int)(width - end);
+  out[n++] = EOR;
+  return n;
+}
+
+/// Estimated size of row i of a morphological pass: the operand row
+static size_t MorphRowWeight(void* ctx, uint32 i) {
+  MorphArgs* args = ctx;
+  return RowWeight(args->img, i);
+}
+
+/// Grow the runs of rows [first, last) of the image in ctx horizontally
+static void GrowRows(void* ctx, uint32 first, uint32 last, RowBuilder* b) {
+  MorphArgs* args = ctx;
+  const Image img = args->img;
+
+  // Repeated rows are grown once
+  int memo = img->encoding == IMAGE_RLE && !img->distinct_rows;
+  RowMemo m = {NULL, 0};
+  if (memo) RowMemoInit(&m, last - first);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 i = first; i < last; i++) {
+    const int* src = GetRLERow(img, i, buf);
+    RowMemoEntry* e = memo ? RowMemoFind(&m, src, NULL) : NULL;
+    if (e != NULL && e->row1 != NULL) {
+      RowBuilderRepeat(b, e->row);
+      continue;
+    }
+    int* row = RowBuilderReserve(b, GetSizeRLERowArray(src));
+    RowBuilderCommit(b, GrowRuns(src, img->width, args->color, args->before,
+                                 args->after, row));
+    if (e != NULL) RowMemoSet(e, src, NULL, b->num_rows - 1);
+  }
+  free(buf);
+  free(m.entries);
+}
+
+/// Append to b the merge (with op) of row and the last row of b, or row
+/// itself if b is empty
+static void AccumulateRow(RowBuilder* b, const int* row, int op,
+                          uint32 width) {
+  size_t n = GetSizeRLERowArray(row);
+  if (b->num_rows == 0) {
+    RowBuilderAppend(b, row, n);
+    return;
+  }
+  // The last row is at the end of b
+  size_t prev_size = b->size - b->offset[b->num_rows - 1];
+  size_t max_elems = prev_size + n - 1;
+  if (max_elems > width + 2) max_elems = width + 2;
+  int* out = RowBuilderReserve(b, max_elems);
+  const int* prev = b->runs + b->offset[b->num_rows - 1];
+  RowBuilderCommit(b, MergeRLERows(prev, row, op, out));
+}
+
+/// Combine the windows of rows [first, last) of the (RLE) image of grown
+/// rows in ctx: row y of the result combines rows [y - after, y + before].
+static void WindowRows(void* ctx, uint32 first, uint32 last,
+                       RowBuilder* b) {
+  MorphArgs* args = ctx;
+  const Image img = args->img;
+  uint32 width = img->width;
+  int op = args->color == BLACK ? OP_OR : OP_AND;
+
+  // Virtual row v is row v - after of img; the rows outside img are
+  // uniform, of the color that does not change the combination.
+  // The window of row y is then virtual rows [y, y + k).
+  uint32 k = args->before + args->after + 1;
+  int outside[3] = {args->color ^ 1, (int)width, EOR};
+#define VIRTUAL_ROW(v)                                       \
+  ((v) >= args->after && (v) - args->after < img->height     \
+       ? (const int*)img->row[(v) - args->after]             \
+       : (const int*)outside)
+
+  // The suffixes of a block (from its last row backwards),
+  // and the prefixes of the next block
+  RowBuilder suffix, prefix;
+  RowBuilderInit(&suffix, k, (size_t)k * 8);
+  RowBuilderInit(&prefix, k, (size_t)k * 8);
+  RowBuilderIntern(b);
+
+  for (uint32 block = first - first % k; block < last; block += k) {
+    uint32 lo = block > first ? block : first;  // Rows of the block
+    uint32 hi = last - block > k ? block + k : last;
+    RowBuilderReset(&suffix);
+    for (uint32 v = block + k; v > lo; v--) {
+      AccumulateRow(&suffix, VIRTUAL_ROW(v - 1), op, width);
+    }
+    RowBuilderReset(&prefix);
+    for (uint32 v = block + k; v + 1 < hi + k; v++) {
+      AccumulateRow(&prefix, VIRTUAL_ROW(v), op, width);
+    }
+
+    for (uint32 y = lo; y < hi; y++) {
+      const int* s = suffix.runs + suffix.offset[block + k - 1 - y];
+      size_t s_size = GetSizeRLERowArray(s);
+      if (y == block) {
+        // The window is the whole block
+        RowBuilderAppend(b, s, s_size);
+        continue;
+      }
+      const int* p = prefix.runs + prefix.offset[y - 1 - block];
+      size_t max_elems = s_size + GetSizeRLERowArray(p) - 1;
+      if (max_elems > width + 2) max_elems = width + 2;
+      int* row = RowBuilderReserve(b, max_elems);
+      RowBuilderCommit(b, MergeRLERows(s, p, op, row));
+    }
+  }
+#undef VIRTUAL_ROW
+
+  ReleaseSlab(suffix.slab);
+  free(suffix.offset);
+  ReleaseSlab(prefix.slab);
+  free(prefix.offset);
+}
+
+/// Dilate (color BLACK) or erode (color WHITE) img with a rectangle of
+/// width x height pixels, whose origin is pixel (width / 2, height / 2)
+static Image Morphology(const Image img, uint32 width, uint32 height,
+                        int color) {
+  assert(img != NULL);
+  assert(width > 0 && height > 0);
+
+  // How much the runs of color grow: dilation reflects the element
+  uint32 left = color == BLACK ? width / 2 : (width - 1) / 2;
+  uint32 up = color == BLACK ? height / 2 : (height - 1) / 2;
+  MorphArgs args = {img, color, left, width - 1 - left};
+  // Growing farther than the image has no effect
+  if (args.before > img->width) args.before = img->width;
+  if (args.after > img->width) args.after = img->width;
+
+  Image grown = BuildImage(img->width, img->height, MorphRowWeight, GrowRows,
+                           &args);
+  if (height == 1) return grown;
+
+  args.img = grown;
+  args.before = up;
+  args.after = height - 1 - up;
+  if (args.before > img->height) args.before = img->height;
+  if (args.after > img->height) args.after = img->height;
+  Image result = BuildImage(img->width, img->height, MorphRowWeight,
+                            WindowRows, &args);
+  ImageDestroy(&grown);
+  return result;
+}
+
+Image ImageDilate(const Image img, uint32 width, uint32 height) {
+  InstrBegin("ImageDilate");
+  Image result = Morphology(img, width, height, BLACK);
+  InstrEnd();
+  return result;
+}
+
+Image ImageErode(const Image img, uint32 width, uint32 height) {
+  InstrBegin("ImageErode");
+  Image result = Morphology(img, width, height, WHITE);
+  InstrEnd();
+  return result;
+}
+
+Image ImageOpen(const Image img, uint32 width, uint32 height) {
+  InstrBegin("ImageOpen");
+  Image eroded = Morphology(img, width, height, WHITE);
+  Image result = Morphology(eroded, width, height, BLACK);
+  ImageDestroy(&eroded);
+  InstrEnd();
+  return result;
+}
+
+Image ImageClose(const Image img, uint32 width, uint32 height) {
+  InstrBegin("ImageClose");
+  Image dilated = Morphology(img, width, height, BLACK);
+  Image result = Morphology(dilated, width, height, WHITE);
+  ImageDestroy(&dilated);
+  InstrEnd();
+  return result;
+}
+
+/// Connected components
+
+// The BLACK runs of the image are the nodes of a union-find forest: the
+// runs of adjacent rows that touch are joined, so that each tree is a
+// component.  Runs are numbered in raster order, and each tree is rooted
+// at its first run (the root with the smaller number wins), so components
+// are numbered in the order of their first pixel, whatever the number of
+// threads.
+// The rows are split into strips, whose runs are joined in parallel:
+// a strip only joins runs of its own rows, so the strips work on disjoint
+// trees.  Then the runs across the strip boundaries are joined.
+
+typedef struct {
+  Image img;
+  uint32 slack;     // 1 if diagonal neighbours touch (8-connectivity)
+  uint32* first;    // First run of each row (and the number of runs)
+  uint32* start;    // Start column of each run
+  uint32* end;      // and its end (exclusive)
+  uint32* parent;   // Parent of each run in the forest
+  uint8* boundary;  // Rows that start a strip
+} ComponentsArgs;
+
+/// Count the BLACK runs of rows [first, last): in first[i + 1], for row i
+static void CountBlackRuns(void* ctx, uint32 first, uint32 last) {
+  ComponentsArgs* args = ctx;
+  int* buf = AllocateRowBuffer(args->img);
+  for (uint32 i = first; i < last; i++) {
+    const int* row = GetRLERow(args->img, i, buf);
+    uint32 num_runs = GetNumRunsInRLERow(row);
+    args->first[i + 1] = (num_runs + (row[0] == BLACK)) / 2;
+    RUNMEM += num_runs;
+  }
+  free(buf);
+}
+
+/// Find the root of the tree of run k, compressing the path to it
+static uint32 FindRoot(uint32* parent, uint32 k) {
+  uint32 root = k;
+  while (parent[root] != root) root = parent[root];
+  while (parent[k] != root) {
+    uint32 next = parent[k];
+    parent[k] = root;
+    k = next;
+  }
+  return root;
+}
+
+/// Join the trees of runs a and b, under the smaller root
+static void JoinRuns(uint32* parent, uint32 a, uint32 b) {
+  a = FindRoot(parent, a);
+  b = FindRoot(parent, b);
+  if (a < b) {
+    parent[b] = a;
+  } else {
+    parent[a] = b;
+  }
+}
+
+/// Join the runs of row i to the runs of row i - 1 that they touch
+static void JoinRows(ComponentsArgs* args, uint32 i) {
+  const uint32* start = args->start;
+  const uint32* end = args->end;
+  uint32 a = args->first[i - 1];
+  uint32 b = args->first[i];
+  uint32 a_last = args->first[i];
+  uint32 b_last = args->first[i + 1];
+  while (a < a_last && b < b_last) {
+    // Runs touch if each one starts before the other ends
+    // (runs with the same parent are already joined)
+    if (start[a] < end[b] + args->slack && start[b] < end[a] + args->slack &&
+        args->parent[a] != args->parent[b]) {
+      JoinRuns(args->parent, a, b);
+    }
+    // The run that ends first touches no more runs
+    if (end[a] < end[b]) {
+      a++;
+    } else {
+      b++;
+    }
+    RUNMEM++;
+  }
+}
+
+/// Store the BLACK runs of rows [first, last), and join them
+static void JoinStrip(void* ctx, uint32 first, uint32 last) {
+  ComponentsArgs* args = ctx;
+  int* buf = AllocateRowBuffer(args->img);
+  for (uint32 i = first; i < last; i++) {
+    const int* row = GetRLERow(args->img, i, buf);
+    uint32 k = args->first[i];
+    uint32 x = 0;
+    int color = row[0];
+    for (uint32 j = 1; row[j] != EOR; j++, color ^= 1) {
+      if (color == BLACK) {
+        args->start[k] = x;
+        args->end[k] = x + (uint32)row[j];
+        args->parent[k] = k;
+        k++;
+      }
+      x += (uint32)row[j];
+      RUNMEM++;
+    }
+    if (i > first) JoinRows(args, i);
+  }
+  args->boundary[first] = 1;
+  free(buf);
+}
+
+/// Label the connected components of the BLACK pixels of img.
+int ImageLabelComponents(const Image img, int connectivity,
+                         ImageComponent** components, uint32** labels) {
+  InstrBegin("ImageLabelComponents");
+  assert(img != NULL);
+  assert(connectivity == 4 || connectivity == 8);
+  assert(components != NULL);
+
+  uint32 height = img->height;
+  ComponentsArgs args = {img, connectivity == 8, NULL, NULL,
+                         NULL, NULL, NULL};
+  uint64 work = 0;
+  for (uint32 i = 0; i < height; i++) work += RowWeight(img, i);
+
+  // Number the runs
+  args.first = malloc(((size_t)height + 1) * sizeof(uint32));
+  assert(args.first != NULL);
+  args.first[0] = 0;
+  ParallelRows(height, work, CountBlackRuns, &args);
+  for (uint32 i = 0; i < height; i++) args.first[i + 1] += args.first[i];
+  uint32 n = args.first[height];
+
+  // Join the runs of each strip, then across the strips
+  args.start = malloc((size_t)n * sizeof(uint32) + 1);
+  args.end = malloc((size_t)n * sizeof(uint32) + 1);
+  args.parent = malloc((size_t)n * sizeof(uint32) + 1);
+  args.boundary = calloc(height, 1);
+  assert(args.start != NULL && args.end != NULL && args.parent != NULL &&
+         args.boundary != NULL);
+  ParallelRows(height, work, JoinStrip, &args);
+  for (uint32 i = 1; i < height; i++) {
+    if (args.boundary[i]) JoinRows(&args, i);
+  }
+
+  // Number the components in the order of their roots, which come before
+  // their other runs, and measure them
+  uint32* label = malloc((size_t)n * sizeof(uint32) + 1);
+  ImageComponent* table = malloc((size_t)n * sizeof(ImageComponent) + 1);
+  assert(label != NULL && table != NULL);
+  uint32 count = 0;
+  for (uint32 i = 0; i < height; i++) {
+    for (uint32 k = args.first[i]; k < args.first[i + 1]; k++) {
+      uint32 root = FindRoot(args.parent, k);
+      uint32 start = args.start[k];
+      uint32 end = args.end[k];
+      if (root == k) {
+        label[k] = count;
+        table[count++] = (ImageComponent){start, i, end - start, 1,
+                                          end - start};
+        continue;
+      }
+      label[k] = label[root];
+      ImageComponent* c = &table[label[k]];
+      if (start < c->x) {
+        c->width += c->x - start;
+        c->x = start;
+      }
+      if (end > c->x + c->width) c->width = end - c->x;
+      c->height = i - c->y + 1;
+      c->area += end - start;
+    }
+  }
+
+  *components = realloc(table, (size_t)count * sizeof(ImageComponent) + 1);
+  assert(*components != NULL);
+  if (labels != NULL) {
+    *labels = label;
+  } else {
+    free(label);
+  }
+  free(args.first);
+  free(args.start);
+  free(args.end);
+  free(args.parent);
+  free(args.boundary);
+  InstrEnd();
+  return (int)count;
+}
+
+/// Downsampling
+
+// The rows of a block of rows are reduced to one row of the result.
+// For IMAGE_REDUCE_OR, the BLACK runs of each row are scaled down to the
+// blocks of fx pixels that they touch, which are set in a bitmap of the
+// result row; the union of all of them is then turned back into runs
+// (see BitmapRowToRLE).  IMAGE_REDUCE_AND is the same on the WHITE runs.
+// For IMAGE_REDUCE_MAJORITY, the BLACK pixels of each block are counted,
+// adding the partial blocks at the ends of each run directly, and the
+// whole blocks in between through a difference array.
+
+typedef struct {
+  Image img;
+  uint32 fx;
+  uint32 fy;
+  int mode;
+  uint32 width;  // Width of the result
+} DownsampleArgs;
+
+/// Divide x by fx, which is 1 << shift if shift < 32
+static inline uint32 DivideBy(uint32 x, uint32 fx, uint32 shift) {
+  return shift < 32 ? x >> shift : x / fx;
+}
+
+/// Get the shift for DivideBy(x, fx, shift)
+static uint32 DivisionShift(uint32 fx) {
+  if ((fx & (fx - 1)) != 0) return 32;  // Not a power of 2
+  return (uint32)__builtin_ctz(fx);
+}
+
+/// Estimated size of row j of the result: its first source row, at most
+static size_t DownsampleRowWeight(void* ctx, uint32 j) {
+  DownsampleArgs* args = ctx;
+  size_t size = RowWeight(args->img, j * args->fy);
+  return size < args->width + 2 ? size : args->width + 2;
+}
+
+/// Reduce rows [first, last) of the result with OR or AND
+static void DownsampleMergeRows(void* ctx, uint32 first, uint32 last,
+                                RowBuilder* b) {
+  DownsampleArgs* args = ctx;
+  const Image img = args->img;
+  uint32 fx = args->fx;
+  uint32 shift = DivisionShift(fx);
+  // The blocks touched by the runs of color (BLACK for OR, WHITE for AND)
+  int color = args->mode == IMAGE_REDUCE_OR ? BLACK : WHITE;
+  uint32 num_words = GetNumWordsBitmapRow(args->width);
+  uint64* bits = calloc(num_words, sizeof(uint64));
+  assert(bits != NULL);
+  RowBuilderIntern(b);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 j = first; j < last; j++) {
+    uint32 y_end = img->height - j * args->fy > args->fy
+                       ? (j + 1) * args->fy
+                       : img->height;
+    const int* prev = NULL;
+    for (uint32 y = j * args->fy; y < y_end; y++) {
+      const int* row = GetRLERow(img, y, buf);
+      // A repeated (stored) row does not change the result
+      if (row == prev && buf == NULL) continue;
+      prev = row;
+      uint32 x = 0;
+      int c = row[0];
+      for (uint32 k = 1; row[k] != EOR; k++, c ^= 1) {
+        uint32 start = x;
+        x += (uint32)row[k];
+        RUNMEM++;
+        if (c != color) continue;
+        SetBitmapRange(bits, DivideBy(start, fx, shift),
+                       DivideBy(x - 1, fx, shift) + 1);
+      }
+    }
+    int* out = RowBuilderReserve(b, (size_t)args->width + 2);
+    uint32 n = BitmapRowToRLE(args->width, bits, out);
+    out[0] ^= color ^ BLACK;  // For AND, the blocks touched are WHITE
+    RowBuilderCommit(b, n);
+    memset(bits, 0, num_words * sizeof(uint64));
+  }
+  free(buf);
+  free(bits);
+}
+
+/// Reduce rows [first, last) of the result with the majority
+static void DownsampleMajorityRows(void* ctx, uint32 first, uint32 last,
+                                   RowBuilder* b) {
+  DownsampleArgs* args = ctx;
+  const Image img = args->img;
+  uint32 fx = args->fx;
+  uint32 shift = DivisionShift(fx);
+  uint32 width = args->width;
+
+  // BLACK pixels of each block: count[X] plus the sum of diff[0..X]
+  uint64* count = calloc((size_t)width + 1, sizeof(uint64));
+  uint64* diff = calloc((size_t)width + 1, sizeof(uint64));
+  assert(count != NULL && diff != NULL);
+  RowBuilderIntern(b);
+
+  int* buf = AllocateRowBuffer(img);
+  for (uint32 j = first; j < last; j++) {
+    uint32 y_end = img->height - j * args->fy > args->fy
+                       ? (j + 1) * args->fy
+                       : img->height;
+    uint32 y = j * args->fy;
+    uint32 rows = y_end - y;
+    while (y < y_end) {
+      const int* row = GetRLERow(img, y, buf);
+      // A (stored) row repeated below counts as many times
+      uint64 times = 1;
+      y++;
+      while (buf == NULL && y < y_end && img->row[y] == row) {
+        times++;
+        y++;
+      }
+      uint32 x = 0;
+      int color = row[0];
+      for (uint32 k = 1; row[k] != EOR; k++, color ^= 1) {
+        uint32 start = x;
+        x += (uint32)row[k];
+        RUNMEM++;
+        if (color != BLACK) continue;
+        uint32 X0 = DivideBy(start, fx, shift);
+        uint32 X1 = DivideBy(x - 1, fx, shift);
+        if (X0 == X1) {
+          count[X0] += times * (x - start);
+          continue;
+        }
+        count[X0] += times * ((uint64)(X0 + 1) * fx - start);
+        count[X1] += times * (x - X1 * fx);
+        diff[X0 + 1] += times * fx;
+        diff[X1] -= times * fx;
+      }
+    }
+
+    // Compare each block with half of its pixels
+    int* out = RowBuilderReserve(b, (size_t)width + 2);
+    uint32 n = 1;
+    uint64 full = 0;
+    int current = -1;
+    for (uint32 X = 0; X < width; X++) {
+      full += diff[X];
+      uint64 pixels = (uint64)rows *
+                      (X + 1 < width ? fx : img->width - X * fx);
+      int c = 2 * (count[X] + full) > pixels ? BLACK : WHITE;
+      if (c != current) {
+        if (current < 0) {
+          out[0] = c;
+        } else {
+          n++;
+        }
+        out[n] = 0;
+        current = c;
+      }
+      out[n]++;
+      count[X] = 0;
+      diff[X] = 0;
+    }
+    out[++n] = EOR;
+    RowBuilderCommit(b, n + 1);
+  }
+  free(buf);
+  free(count);
+  free(diff);
+}
+
+/// Downsample img by fx x fy, with mode
+static Image Downsample(const Image img, uint32 fx, uint32 fy, int mode) {
+  assert(img != NULL);
+  assert(fx > 0 && fy > 0);
+  assert(mode == IMAGE_REDUCE_OR || mode == IMAGE_REDUCE_AND ||
+         mode == IMAGE_REDUCE_MAJORITY);
+
+  uint32 width = img->width / fx + (img->width % fx != 0);
+  uint32 height = img->height / fy + (img->height % fy != 0);
+  DownsampleArgs args = {img, fx, fy, mode, width};
+  return BuildImage(width, height, DownsampleRowWeight,
+                    mode == IMAGE_REDUCE_MAJORITY ? DownsampleMajorityRows
+                                                  : DownsampleMergeRows,
+                    &args);
+}
+
+Image ImageDownsample(const Image img, uint32 fx, uint32 fy, int mode) {
+  InstrBegin("ImageDownsample");
+  Image result = Downsample(img, fx, fy, mode);
+  InstrEnd();
+  return result;
+}
+
+int ImageBuildPyramid(const Image img, int mode, Image* levels,
+                      int max_levels) {
+  InstrBegin("ImageBuildPyramid");
+  assert(img != NULL);
+  assert(levels != NULL && max_levels > 0);
+
+  levels[0] = ImageCopy(img);
+  int n = 1;
+  while (n < max_levels &&
+         (levels[n - 1]->width > 1 || levels[n - 1]->height > 1)) {
+    levels[n] = Downsample(levels[n - 1], 2, 2, mode);
+    n++;
+  }
+  InstrEnd();
+  return n;
+}
+
+/// Streaming PBM files
+
+// A stream produces the rows of an image one at a time, from top to
+// bottom, so that images larger than memory can be processed.
+// Streams read PBM files (or images), or transform the rows of other
+// streams; ImageStreamSave writes the rows to a PBM file as they come.
+// Each stream keeps a single row (and file streams a read buffer), so
+// memory use does not depend on the image height.
+
+#define STREAM_FILE 0     // Rows read from a PBM file
+#define STREAM_IMAGE 1    // Rows of an image
+#define STREAM_NEG 2      // Negation of a
+#define STREAM_BINARY 3   // op applied to a and b
+#define STREAM_VMIRROR 4  // Vertical mirror of a
+
+// Size of the read buffer of file streams
+#define STREAM_BUFFER_SIZE (1 << 16)
+
+struct imageStream {
+  int kind;
+  int op;  // the op code (STREAM_BINARY only)
+  uint32 width;
+  uint32 height;
+  uint32 next_row;  // number of rows produced
+  int* row;         // the last row produced
+  ImageStream a;    // the operand streams
+  ImageStream b;
+  // STREAM_FILE:
+  FILE* f;
+  uint8* bytes;     // read buffer
+  size_t capacity;  // size of the read buffer
+  size_t pos;       // position of the next row in the buffer
+  size_t end;       // end of the data in the buffer
+  // STREAM_IMAGE:
+  Image img;
+  int* buf;  // to decode rows (see GetRLERow)
+};
+
+static ImageStream AllocateStream(int kind, uint32 width, uint32 height) {
+  ImageStream s = malloc(sizeof(struct imageStream));
+  assert(s != NULL);
+  s->kind = kind;
+  s->op = 0;
+  s->width = width;
+  s->height = height;
+  s->next_row = 0;
+  s->row = NULL;
+  if (width > 0) {
+    s->row = malloc((width + 2) * sizeof(int));
+    assert(s->row != NULL);
+  }
+  s->a = NULL;
+  s->b = NULL;
+  s->f = NULL;
+  s->bytes = NULL;
+  s->capacity = 0;
+  s->pos = 0;
+  s->end = 0;
+  s->img = NULL;
+  s->buf = NULL;
+  return s;
+}
+
+// Auxiliary function
+// Ensure that the read buffer of a file stream has n bytes from pos on,
+// reading more from the file if needed.
+// Returns 0 if the file ends before that.
+static int FillStreamBuffer(ImageStream s, size_t n) {
+  if (s->end - s->pos >= n) return 1;
+  memmove(s->bytes, s->bytes + s->pos, s->end - s->pos);
+  s->end -= s->pos;
+  s->pos = 0;
+  s->end += fread(s->bytes + s->end, 1, s->capacity - s->end, s->f);
+  return s->end >= n;
+}
+
+// Auxiliary function
+// Get the byte at pos of a file stream, reading more from the file if
+// needed.
+// Returns -1 if the file ends before that.
+static int PeekStreamByte(ImageStream s) {
+  return FillStreamBuffer(s, 1) ? s->bytes[s->pos] : -1;
+}
+
+// Auxiliary function
+// Check the magic number of a PBM file stream, and advance past it.
+static int ReadStreamMagic(ImageStream s) {
+  if (!FillStreamBuffer(s, 2) || s->bytes[s->pos] != 'P' ||
+      s->bytes[s->pos + 1] != '4') {
+    return 0;
+  }
+  s->pos += 2;
+  return 1;
+}
+
+// Auxiliary function
+// Parse a positive decimal number of the PBM header of a file stream, as
+// ParseHeaderNumber does, skipping whitespace and comments before it.
+// The header is read as needed, so it may be longer than the read buffer.
+// Returns the number, or 0 if there is none (or it is too large).
+static int ParseStreamHeaderNumber(ImageStream s) {
+  int c;
+  while ((c = PeekStreamByte(s)) != -1) {
+    if (c == '#') {
+      while ((c = PeekStreamByte(s)) != -1 && c != '\n') s->pos++;
+    } else if (isspace(c)) {
+      s->pos++;
+    } else {
+      break;
+    }
+  }
+  int value = 0;
+  for (; (c = PeekStreamByte(s)) != -1 && isdigit(c); s->pos++) {
+    if (value > (INT_MAX - 2) / 10) return 0;  // Runs must fit an int
+    value = 10 * value + (c - '0');
+  }
+  return value;
+}
+
+ImageStream ImageStreamOpen(const char* filename) {
+  assert(filename != NULL);
+  int w = 0, h = 0;
+  ImageStream s = AllocateStream(STREAM_FILE, 0, 0);
+  s->capacity = STREAM_BUFFER_SIZE;
+  s->bytes = malloc(s->capacity);
+  assert(s->bytes != NULL);
+
+  int success =
+      check((s->f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check(ReadStreamMagic(s), "Invalid file format") &&
+      check((w = ParseStreamHeaderNumber(s)) > 0, "Invalid width") &&
+      check((h = ParseStreamHeaderNumber(s)) > 0, "Invalid height") &&
+      check(PeekStreamByte(s) != -1 && isspace(s->bytes[s->pos++]),
+            "Whitespace expected");
+
+  if (!success) {
+    errsave = errno;
+    ImageStreamClose(&s);
+    errno = errsave;
+    return NULL;
+  }
+
+  s->width = w;
+  s->height = h;
+  s->row = malloc((s->width + 2) * sizeof(int));
+  assert(s->row != NULL);
+  size_t nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
+  if (s->capacity < nbytes) {
+    s->capacity = nbytes;
+    s->bytes = realloc(s->bytes, s->capacity);
+    assert(s->bytes != NULL);
+  }
+  return s;
+}
+
+ImageStream ImageStreamOf(const Image img) {
+  assert(img != NULL);
+  ImageStream s = AllocateStream(STREAM_IMAGE, img->width, img->height);
+  s->img = img;
+  s->buf = AllocateRowBuffer(img);
+  return s;
+}
+
+ImageStream ImageStreamNEG(ImageStream s) {
+  assert(s != NULL);
+  ImageStream t = AllocateStream(STREAM_NEG, s->width, s->height);
+  t->a = s;
+  return t;
+}
+
+/// Create a stream applying op to the rows of s1 and s2
+static ImageStream StreamBinary(ImageStream s1, ImageStream s2, int op) {
+  assert(s1 != NULL && s2 != NULL);
+  assert(s1->width == s2->width && s1->height == s2->height);
+  ImageStream t = AllocateStream(STREAM_BINARY, s1->width, s1->height);
+  t->op = op;
+  t->a = s1;
+  t->b = s2;
+  return t;
+}
+
+ImageStream ImageStreamAND(ImageStream s1, ImageStream s2) {
+  return StreamBinary(s1, s2, OP_AND);
+}
+
+ImageStream ImageStreamOR(ImageStream s1, ImageStream s2) {
+  return StreamBinary(s1, s2, OP_OR);
+}
+
+ImageStream ImageStreamXOR(ImageStream s1, ImageStream s2) {
+  return StreamBinary(s1, s2, OP_XOR);
+}
+
+ImageStream ImageStreamVerticalMirror(ImageStream s) {
+  assert(s != NULL);
+  ImageStream t = AllocateStream(STREAM_VMIRROR, s->width, s->height);
+  t->a = s;
+  return t;
+}
+
+int ImageStreamWidth(const ImageStream s) {
+  assert(s != NULL);
+  return s->width;
+}
+
+int ImageStreamHeight(const ImageStream s) {
+  assert(s != NULL);
+  return s->height;
+}
+
+const int* ImageStreamNextRow(ImageStream s) {
+  assert(s != NULL);
+  if (!check(s->next_row < s->height, "No more rows")) return NULL;
+
+  const int* row1 = NULL;
+  const int* row2 = NULL;
+  switch (s->kind) {
+    case STREAM_FILE: {
+      size_t nbytes = (s->width + 8 - 1) / 8;
+      if (!check(FillStreamBuffer(s, nbytes), "Reading pixels")) return NULL;
+      BytesRowToRLE(s->width, s->bytes + s->pos, s->row);
+      s->pos += nbytes;
+      break;
+    }
+    case STREAM_IMAGE: {
+      const int* src = GetRLERow(s->img, s->next_row, s->buf);
+      memcpy(s->row, src, GetSizeRLERowArray(src) * sizeof(int));
+      break;
+    }
+    case STREAM_NEG:
+      if ((row1 = ImageStreamNextRow(s->a)) == NULL) return NULL;
+      memcpy(s->row, row1, GetSizeRLERowArray(row1) * sizeof(int));
+      s->row[0] ^= 1;
+      break;
+    case STREAM_BINARY:
+      if ((row1 = ImageStreamNextRow(s->a)) == NULL ||
+          (row2 = ImageStreamNextRow(s->b)) == NULL) {
+        return NULL;
+      }
+      MergeRLERows(row1, row2, s->op, s->row);
+      break;
+    case STREAM_VMIRROR:
+      if ((row1 = ImageStreamNextRow(s->a)) == NULL) return NULL;
+      ReverseRLERow(row1, s->row);
+      break;
+  }
+  s->next_row++;
+  return s->row;
+}
+
+int ImageStreamSave(ImageStream s, const char* filename) {
+  InstrBegin("ImageStreamSave");
+  assert(s != NULL);
+  int w = s->width;
+  int h = s->height - s->next_row;  // The remaining rows
+  FILE* f = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+
+  if (success) {
+    // Write pixels, as many whole rows at a time as fit in the buffer
+    size_t nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
+    size_t capacity = SAVE_BUFFER_SIZE / nbytes * nbytes;
+    if (capacity == 0) capacity = nbytes;
+    uint8* bytes = malloc(capacity);
+    assert(bytes != NULL);
+
+    size_t used = 0;
+    for (int i = 0; success && i < h; i++) {
+      if (used == capacity) {
+        success = check(fwrite(bytes, 1, used, f) == used,
+                        "Writing pixels failed");
+        used = 0;
+      }
+      const int* row = NULL;
+      success = success && (row = ImageStreamNextRow(s)) != NULL;
+      if (success) {
+        RLERowToBytes(w, row, bytes + used);
+        used += nbytes;
+      }
+    }
+    success = success &&
+              check(fwrite(bytes, 1, used, f) == used, "Writing pixels failed");
+
+    free(bytes);
+  }
+
+  // Cleanup
+  if (f != NULL) {
+    errsave = errno;
+    if (fclose(f) != 0 && success) {
+      success = check(0, "Closing failed");  // Buffered data not written
+    } else {
+      errno = errsave;
+    }
+  }
+  InstrEnd();
+  return success;
+}
+
+void ImageStreamClose(ImageStream* sp) {
+  assert(sp != NULL);
+  ImageStream s = *sp;
+  if (s == NULL) return;
+
+  ImageStreamClose(&s->a);
+  ImageStreamClose(&s->b);
+  if (s->f != NULL) fclose(s->f);
+  free(s->bytes);
+  free(s->buf);
+  free(s->row);
+  free(s);
+
+  *sp = NULL;
 }
@@ -19,6 +19,7 @@
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 
 // Type Image is a pointer to image objects
 typedef struct image* Image;
@@ -28,7 +29,14 @@ typedef struct image* Image;
 #define WHITE 0  // White pixel value
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of instrumentation counters, and select the bitmap kernels
+/// for the running CPU.  Instrumentation is calibrated only when needed
+/// (see InstrGetCTU), so this is fast.
+///
+/// Operations are counted in the instrumentation counters of the calling
+/// thread (see InstrRead).  The main image operations run in
+/// instrumentation regions named after the function ("ImageAND", ...),
+/// which are reported through InstrSetCallback.
 void ImageInit(void);
 
 /// Image management functions
@@ -59,6 +67,14 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val);
 Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
                             uint8 first_value);
 
+/// Create a copy of img.
+/// The copy shares the rows of img, which are never modified while shared,
+/// so copying an IMAGE_RLE or IMAGE_RLE_PACKED image takes O(height) time.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCopy(const Image img);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -88,6 +104,13 @@ Image ImageLoad(const char* filename);
 /// a partial and invalid file may be left in the system.
 int ImageSave(const Image img, const char* filename);
 
+/// Error cause.
+/// After a file or memory allocation operation fails (and returns an error
+/// code), returns a message describing the failure cause.  Together with
+/// errno, this may be used to produce informative error messages (using
+/// error(), for instance).  Not meaningful after a successful operation.
+char* ImageErrMsg(void);
+
 /// Information queries
 
 /// Get image width
@@ -96,12 +119,126 @@ int ImageWidth(const Image img);
 /// Get image height
 int ImageHeight(const Image img);
 
+/// Get the color of pixel (x, y) (BLACK or WHITE).
+/// Requires: the pixel must be inside img.
+/// For IMAGE_RLE, the first call builds an index of the runs of each row
+/// (see ImageCrop), and then takes O(log runs).  Packed rows are walked.
+/// Several threads may read pixels of the same image at once, even on the
+/// first call.
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y);
+
+/// A pixel position
+typedef struct {
+  uint32 x;
+  uint32 y;
+} ImagePoint;
+
+/// Get the colors of n pixels: out[k] is the color of points[k].
+/// Requires: the pixels must be inside img.
+/// The points are sorted by row and column first, so that the index (or
+/// the packed code) of each row is read once, in order.
+/// Thread-safe, as ImageGetPixel.
+void ImageGetPixels(const Image img, const ImagePoint* points, int n,
+                    uint8* out);
+
+/// Statistics of the BLACK pixels.
+/// Each is computed in a single pass over the runs (bitmaps count the set
+/// bits of whole words), and cached in img until its pixels change, so
+/// asking again costs O(1) (or a copy, for the arrays).
+/// Several threads may ask for the statistics of the same image at once,
+/// even on the first call.
+
+/// Get the number of BLACK pixels.
+uint64 ImageCountBlack(const Image img);
+
+/// Get the bounding box of the BLACK pixels: its top left pixel (*x, *y),
+/// and its size, *width x *height.
+/// Returns 0 if img has no BLACK pixels (all are then set to 0), and
+/// nonzero otherwise.
+int ImageBoundingBox(const Image img, uint32* x, uint32* y, uint32* width,
+                     uint32* height);
+
+/// Get the number of BLACK pixels of each row.
+/// counts must have room for the height of img.
+void ImageRowCounts(const Image img, uint32* counts);
+
+/// Get the histogram of the lengths of the runs of color (BLACK or WHITE):
+/// histogram[n] is the number of runs of n pixels, for n in [0, width].
+/// histogram must have room for width + 1 elements.
+void ImageRunLengthHistogram(const Image img, int color, uint64* histogram);
+
+/// Memory representation
+
+// Row encodings
+#define IMAGE_RLE 0         // Runs stored as int (default, fastest access)
+#define IMAGE_RLE_PACKED 1  // Runs stored as variable-length byte codes
+#define IMAGE_BITMAP 2      // One bit per pixel (for noisy images)
+
+/// Get the encoding of the image rows.
+int ImageEncoding(const Image img);
+
+/// Store the rows of img in the given encoding.
+/// IMAGE_RLE_PACKED takes 1 byte for runs shorter than 128 pixels
+/// and 2 bytes for runs shorter than 16384, instead of sizeof(int);
+/// rows stored once in IMAGE_RLE are still stored once.
+/// IMAGE_BITMAP takes width/8 bytes per row, whatever the number of runs.
+/// The pixels are not changed.
+/// All operations accept images in any encoding, and decode rows on the
+/// fly as needed.  New images are created in IMAGE_RLE, except that
+/// ImageNEG, ImageAND, ImageOR and ImageXOR, and the n-ary operations
+/// (ImageANDn, ImageORn, ImageXORn and ImageAtLeast, for any n), return
+/// IMAGE_BITMAP images when an operand is in IMAGE_BITMAP (and then work
+/// on whole words where they can), and ImageCopy, ImageHorizontalMirror and ImageReplicateAtBottom keep the
+/// encoding of their operands (when they have the same).
+void ImageSetEncoding(Image img, int encoding);
+
+/// In IMAGE_RLE, equal rows are often stored once: all the rows of
+/// ImageCreate, the rows of each band of ImageCreateChessboard, and equal
+/// rows loaded by ImageLoad or computed by ImageAND, ImageOR and ImageXOR.
+/// Operations on such images process each distinct row (or pair of rows)
+/// once.
+
+/// Store the rows of img in IMAGE_RLE or IMAGE_BITMAP, whichever takes
+/// less memory.  Bitmaps win with more than about width/32 runs per row.
+/// Returns the chosen encoding.
+int ImageChooseEncoding(Image img);
+
+/// Parallel execution
+
+/// Set the number of threads used by image operations
+/// (including the calling thread).
+/// Rows are split in chunks with about the same number of runs, which are
+/// processed in parallel.  Results are the same whatever the number of
+/// threads.  Operations counted by the worker threads are added to the
+/// counters of the calling thread when each operation ends (repeated rows
+/// are detected per chunk, so counts may vary).
+/// num_threads <= 0 selects the number of online processors.
+/// The default is 1 (no worker threads).
+/// Must not be called while other threads are running image operations.
+void ImageSetThreads(int num_threads);
+
+/// Get the number of threads used by image operations.
+int ImageGetThreads(void);
+
 /// Image comparison
 
+/// Check if two images have the same size and pixels.
+/// Takes O(runs) time at most, with early exit on the first different row.
+/// After ImageDigest has been called on both images, images with different
+/// digests are rejected in O(1), and different rows without reading them.
 int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
 
+/// Get a 64-bit digest of the image dimensions and pixels.
+/// Equal images have equal digests, whatever their encoding; different
+/// images almost surely have different digests (ImageIsEqual tells for sure).
+/// The first call hashes every row, in O(runs) time, and caches the hashes
+/// in img (later calls take O(1) time), for use by ImageIsEqual.
+/// Several threads may ask for the digest of the same image at once, even on
+/// the first call.
+uint64 ImageDigest(const Image img);
+
 /// Boolean Operations on image pixels
 
 /// These functions apply boolean operations to images,
@@ -120,6 +257,71 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+/// N-ary boolean operations
+
+/// These functions combine n images (n >= 1) of the same size in a single
+/// pass over their runs, merging the rows of all of them at once, in
+/// O(total runs * log n) time.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// BLACK where all the images are BLACK
+Image ImageANDn(const Image* imgs, int n);
+
+/// BLACK where any of the images is BLACK
+Image ImageORn(const Image* imgs, int n);
+
+/// BLACK where an odd number of the images are BLACK
+Image ImageXORn(const Image* imgs, int n);
+
+/// BLACK where at least k of the n images are BLACK (a threshold, or vote).
+/// k <= 0 gives a BLACK image, k > n a WHITE image.
+Image ImageAtLeast(const Image* imgs, int n, int k);
+
+/// Deferred evaluation of boolean expressions
+
+/// An expression combines images with boolean operations, to be computed
+/// later, in a single pass, by ImageExprEval:
+///   ImageExpr e = ImageExprAND(ImageExprOR(ImageExprOf(a), ImageExprOf(b)),
+///                              ImageExprNEG(ImageExprOf(c)));
+///   Image result = ImageExprEval(e);
+///   ImageExprDestroy(&e);
+/// Each output row is computed in one pass over the runs of the rows of all
+/// the images, with no intermediate images or rows.
+/// The expression is simplified: NEG NEG x is x, x AND x and x OR x are x,
+/// and images that do not affect the result (as in x XOR x) are ignored.
+typedef struct imageExpr* ImageExpr;
+
+/// Create an expression for img.
+/// img is referenced, not copied: it must not be modified or destroyed
+/// while the expression is in use.
+ImageExpr ImageExprOf(const Image img);
+
+/// Create expressions combining expressions.
+/// The operand expressions become part of the new expression (they must not
+/// be used or destroyed afterwards).  Both operands may be the same
+/// expression (as in ImageExprXOR(e, e)), but an expression must not become
+/// part of two different expressions.
+/// Requires: the operands must have the same size.
+ImageExpr ImageExprNEG(ImageExpr x);
+ImageExpr ImageExprAND(ImageExpr x, ImageExpr y);
+ImageExpr ImageExprOR(ImageExpr x, ImageExpr y);
+ImageExpr ImageExprXOR(ImageExpr x, ImageExpr y);
+
+/// Compute the image of an expression.
+/// Up to 6 distinct images are combined in a single pass; with more,
+/// the operands of the top operation are computed first.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageExprEval(const ImageExpr e);
+
+/// Destroy the expression pointed to by (*ep) (but not its images).
+/// If (*ep)==NULL, no operation is performed.
+/// Ensures: (*ep)==NULL.
+void ImageExprDestroy(ImageExpr* ep);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -131,6 +333,7 @@ Image ImageXOR(const Image img1, const Image img2);
 /// Mirror an image = flip top-bottom.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
+/// The rows are shared with img (see ImageCopy).
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -139,15 +342,23 @@ Image ImageHorizontalMirror(const Image img);
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
+/// Takes O(runs) time: the run list of each row is reversed.
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageVerticalMirror(const Image img);
 
+/// Mirror an image = flip left-right, in place.
+/// Takes O(runs) time, and allocates no memory, unless the rows of img are
+/// shared with other images (see ImageCopy): then they are copied first.
+/// The encoding of img is kept.
+void ImageVerticalMirrorInPlace(Image img);
+
 /// Replicate img2 at the bottom of imag1, creating a larger image
 /// Requires: the width of the two images must be the same.
 /// Returns the new larger image.
 /// Ensures: The original images are not modified.
+/// The rows are shared with img1 and img2 (see ImageCopy).
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -162,4 +373,178 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2);
 
+/// Rotations and transposition.
+/// These work on the runs: they take time proportional to the number of
+/// runs of img and of the result, not to the number of pixels.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Transpose an image: pixel (x, y) goes to (y, x), so the result is
+/// height x width.
+Image ImageTranspose(const Image img);
+
+/// Rotate an image clockwise by 90, 180 or 270 degrees.
+Image ImageRotate90(const Image img);
+Image ImageRotate180(const Image img);
+Image ImageRotate270(const Image img);
+
+/// Crop an image: extract the window of width x height pixels whose top
+/// left pixel is (x, y).
+/// Requires: the window must be inside img.
+/// Ensures: The original img is not modified.
+/// For IMAGE_RLE, the first crop builds an index of the runs of each row,
+/// which is kept with the image until its rows change, so that each row
+/// takes O(log runs + runs in the window).  Packed rows are walked, and
+/// bitmaps give a bitmap.
+/// Several threads may crop the same image at once, even on the first crop.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 width,
+                uint32 height);
+
+/// Morphology.
+/// These apply binary morphology with a rectangular structuring element
+/// of width x height pixels, whose origin is its pixel
+/// (width / 2, height / 2).  Pixels outside the image are WHITE for
+/// dilation and BLACK for erosion.
+/// Requires: width and height must be positive.
+/// Ensures: The original img is not modified.
+/// They work on the runs of the rows, and the cost of each row does not
+/// depend on the height of the element.  The result is in IMAGE_RLE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Dilation: a pixel is BLACK if the element placed at it (reflected)
+/// covers a BLACK pixel of img.
+Image ImageDilate(const Image img, uint32 width, uint32 height);
+
+/// Erosion: a pixel is BLACK if the element placed at it covers only
+/// BLACK pixels of img.
+Image ImageErode(const Image img, uint32 width, uint32 height);
+
+/// Opening (erosion then dilation) and closing (dilation then erosion).
+Image ImageOpen(const Image img, uint32 width, uint32 height);
+Image ImageClose(const Image img, uint32 width, uint32 height);
+
+/// Connected components
+
+/// A connected component of BLACK pixels
+typedef struct {
+  uint32 x;       // Bounding box: top left pixel,
+  uint32 y;
+  uint32 width;   // and size
+  uint32 height;
+  uint64 area;    // Number of pixels
+} ImageComponent;
+
+/// Label the connected components of the BLACK pixels of img, with
+/// 4- or 8-connectivity (connectivity is 4 or 8).
+/// Components are numbered from 0, in the order of their first pixel (row
+/// by row, from left to right), and *components receives a new array with
+/// each one.  If labels is not NULL, *labels receives a new array with the
+/// component of each BLACK run of img, in the same order.
+/// Returns the number of components.
+/// (The caller is responsible for freeing the arrays!)
+///
+/// Runs of adjacent rows that touch are joined with a union-find, so the
+/// cost depends on the number of runs, not of pixels.
+int ImageLabelComponents(const Image img, int connectivity,
+                         ImageComponent** components, uint32** labels);
+
+/// Downsampling
+
+/// How the pixels of a block are reduced to one pixel
+#define IMAGE_REDUCE_OR 0        // BLACK if any pixel is BLACK
+#define IMAGE_REDUCE_AND 1       // BLACK if all pixels are BLACK
+#define IMAGE_REDUCE_MAJORITY 2  // BLACK if more than half are BLACK
+
+/// Downsample img by integer factors: each block of fx x fy pixels
+/// becomes one pixel, reduced with mode.  The result has
+/// ceil(width / fx) x ceil(height / fy) pixels (blocks at the right and
+/// bottom edges may be smaller).
+/// Requires: fx and fy must be positive.
+/// Ensures: The original img is not modified.
+/// The run boundaries of each row are scaled down, and the scaled runs of
+/// the rows of a block are combined in a single result row, so the cost
+/// depends on the number of runs (plus a step per 64 pixels of the result
+/// for OR and AND, and per pixel for IMAGE_REDUCE_MAJORITY).
+/// The result is in IMAGE_RLE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageDownsample(const Image img, uint32 fx, uint32 fy, int mode);
+
+/// Build the power-of-two levels of img, with the reduction mode:
+/// levels[0] is a copy of img, and each next level is the previous one
+/// downsampled by 2 x 2, down to a single pixel, or max_levels levels.
+/// Returns the number of levels built.
+/// Each level is computed from the previous one, so all of them cost about
+/// twice as much as the first.  For IMAGE_REDUCE_OR and IMAGE_REDUCE_AND,
+/// level k is the same as downsampling img by 2^k; with
+/// IMAGE_REDUCE_MAJORITY, it is the majority of majorities.
+/// (The caller is responsible for destroying the images!)
+int ImageBuildPyramid(const Image img, int mode, Image* levels,
+                      int max_levels);
+
+/// Streaming PBM files
+
+/// A stream produces the rows of an image one at a time, from top to
+/// bottom, so that images larger than memory can be processed:
+///   ImageStream s = ImageStreamOpen("in.pbm");
+///   ImageStream t = ImageStreamVerticalMirror(ImageStreamNEG(s));
+///   ImageStreamSave(t, "out.pbm");
+///   ImageStreamClose(&t);
+/// Each stream keeps a single row (and file streams a 64 KiB read buffer),
+/// so memory use does not depend on the image height.
+/// Rows are produced in RLE format: the color of the first pixel (BLACK or
+/// WHITE), the length of each run, and -1.
+typedef struct imageStream* ImageStream;
+
+/// Open a raw PBM file for reading its rows.
+/// Only binary PBM files are accepted.
+/// On success, a new stream is returned.
+/// On failure, returns NULL (see ImageErrMsg).
+/// (The caller is responsible for closing the returned stream!)
+ImageStream ImageStreamOpen(const char* filename);
+
+/// Create a stream of the rows of img.
+/// img is referenced, not copied: it must not be modified or destroyed
+/// while the stream is in use.
+ImageStream ImageStreamOf(const Image img);
+
+/// Create streams transforming the rows of other streams.
+/// The operand streams become part of the new stream (they must not be
+/// used or closed afterwards).
+/// Requires: the operands must have the same size.
+ImageStream ImageStreamNEG(ImageStream s);
+ImageStream ImageStreamAND(ImageStream s1, ImageStream s2);
+ImageStream ImageStreamOR(ImageStream s1, ImageStream s2);
+ImageStream ImageStreamXOR(ImageStream s1, ImageStream s2);
+ImageStream ImageStreamVerticalMirror(ImageStream s);
+
+/// Get the size of the images of a stream
+int ImageStreamWidth(const ImageStream s);
+int ImageStreamHeight(const ImageStream s);
+
+/// Get the next row of a stream.
+/// The row is valid until the next call.
+/// On failure (a file ends too soon, or there are no more rows),
+/// returns NULL (see ImageErrMsg).
+const int* ImageStreamNextRow(ImageStream s);
+
+/// Save the remaining rows of a stream to a PBM file, as they are produced.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamSave(ImageStream s, const char* filename);
+
+/// Close the stream pointed to by (*sp), and its operand streams.
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+void ImageStreamClose(ImageStream* sp);
+
 #endif
@@ -0,0 +1,484 @@
+// imageBWBench - Benchmarks of the imageBW operations.
+//
+// Generates families of images with controlled run statistics, times
+// every public operation over warmed-up repetitions, and writes the
+// results as CSV to stdout:
+//
+//   imageBWBench [size [threads [min_ms]]]
+//
+//   size: width and height of the images (rounded to a multiple of 64,
+//         default 1024)
+//   threads: number of threads (see ImageSetThreads, default 1)
+//   min_ms: minimum time of the repetitions of each operation, in
+//           milliseconds (default 200)
+//
+// Columns: workload, encoding, size, threads, operation, repetitions,
+// median ns per operation, per pixel and per input run, bytes allocated
+// by the result, runs of the result, and the operation counters.
+// The bytes are measured with glibc's mallinfo2, which only sees the heap
+// of the main thread (and large blocks, mapped apart), so they are -1 with
+// more than one thread, or on other systems.
+//
+// Run with: make bench
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "imageBW.h"
+#include "instrumentation.h"
+
+#define MAX_REPS 1000  // Repetitions of each operation, at most
+#define MIN_REPS 3     // and at least
+
+// Pseudo-random numbers (xorshift), for reproducible workloads
+static uint64 rng_state = 88172645463325252ull;
+
+static uint64 Random(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+// A uniform random number in [0, 1)
+static double RandomUnit(void) {
+  return (double)(Random() >> 11) / (double)(1ull << 53);
+}
+
+// A random run length with geometric distribution, of the given mean
+static int GeometricRun(double mean) {
+  int n = 1;
+  while (RandomUnit() > 1.0 / mean) n++;
+  return n;
+}
+
+/// Workloads
+
+// Pixels of a raw PBM image: rows of (width + 7) / 8 bytes, BLACK is 1,
+// most significant bit first
+typedef struct {
+  int width;
+  int height;
+  unsigned char* bytes;
+} Pixels;
+
+static void SetPixel(Pixels* p, int x, int y) {
+  p->bytes[(size_t)y * ((p->width + 7) / 8) + x / 8] |= 0x80 >> (x % 8);
+}
+
+// Random noise: each pixel is BLACK with probability 1/2 (runs of 2)
+static void FillNoise(Pixels* p) {
+  for (int y = 0; y < p->height; y++)
+    for (int x = 0; x < p->width; x++)
+      if (Random() & 1) SetPixel(p, x, y);
+}
+
+// Text-like: lines of characters, with geometric runs (long WHITE runs,
+// short BLACK strokes), separated by blank rows
+static void FillText(Pixels* p) {
+  const int line_height = 16;
+  for (int y = 0; y < p->height; y++) {
+    if (y % line_height >= 12) continue;  // Space between lines
+    int x = 0;
+    while (x < p->width) {
+      x += GeometricRun(12.0);  // WHITE
+      int end = x + GeometricRun(3.0);  // BLACK
+      for (; x < end && x < p->width; x++) SetPixel(p, x, y);
+    }
+  }
+}
+
+// Create an image from pixels, through a temporary PBM file
+static Image LoadPixels(const Pixels* p) {
+  char name[] = "/tmp/imageBWBenchXXXXXX";
+  int fd = mkstemp(name);
+  assert(fd >= 0);
+  FILE* f = fdopen(fd, "wb");
+  assert(f != NULL);
+  fprintf(f, "P4\n%d %d\n", p->width, p->height);
+  fwrite(p->bytes, (size_t)(p->width + 7) / 8, (size_t)p->height, f);
+  fclose(f);
+  Image img = ImageLoad(name);
+  assert(img != NULL);
+  unlink(name);
+  return img;
+}
+
+static Image RandomImage(int size, void (*fill)(Pixels*)) {
+  Pixels p = {size, size, calloc((size_t)(size + 7) / 8 * size, 1)};
+  assert(p.bytes != NULL);
+  fill(&p);
+  Image img = LoadPixels(&p);
+  free(p.bytes);
+  return img;
+}
+
+// A family of images: make(size, k) creates the k-th image of the family
+typedef struct {
+  const char* name;
+  Image (*make)(int size, int k);
+} Workload;
+
+static Image MakeUniform(int size, int k) {
+  return ImageCreate(size, size, k % 2 == 0 ? WHITE : BLACK);
+}
+
+static Image MakeChess(int size, int edge, int k) {
+  return ImageCreateChessboard(size, size, edge, k % 2 == 0 ? WHITE : BLACK);
+}
+
+static Image MakeChess1(int size, int k) { return MakeChess(size, 1, k); }
+static Image MakeChess8(int size, int k) { return MakeChess(size, 8, k); }
+static Image MakeChess64(int size, int k) { return MakeChess(size, 64, k); }
+
+static Image MakeNoise(int size, int k) {
+  (void)k;
+  return RandomImage(size, FillNoise);
+}
+
+static Image MakeText(int size, int k) {
+  (void)k;
+  return RandomImage(size, FillText);
+}
+
+static const Workload workloads[] = {
+    {"uniform", MakeUniform}, {"chess1", MakeChess1},
+    {"chess8", MakeChess8},   {"chess64", MakeChess64},
+    {"noise", MakeNoise},     {"text", MakeText},
+};
+
+/// Operations
+
+#define NUM_OPERANDS 4
+
+// The operands of the operations (all of the same workload)
+static Image operands[NUM_OPERANDS];
+static char saved_file[] = "/tmp/imageBWBenchXXXXXX";
+
+// Each operation returns its result (NULL if it has none)
+typedef struct {
+  const char* name;
+  int arity;  // Number of operands used
+  Image (*run)(void);
+} Operation;
+
+static Image OpCopy(void) { return ImageCopy(operands[0]); }
+static Image OpNEG(void) { return ImageNEG(operands[0]); }
+static Image OpAND(void) { return ImageAND(operands[0], operands[1]); }
+static Image OpOR(void) { return ImageOR(operands[0], operands[1]); }
+static Image OpXOR(void) { return ImageXOR(operands[0], operands[1]); }
+static Image OpANDn(void) { return ImageANDn(operands, NUM_OPERANDS); }
+static Image OpORn(void) { return ImageORn(operands, NUM_OPERANDS); }
+static Image OpXORn(void) { return ImageXORn(operands, NUM_OPERANDS); }
+
+static Image OpAtLeast(void) {
+  return ImageAtLeast(operands, NUM_OPERANDS, NUM_OPERANDS / 2);
+}
+
+// (a AND NOT b) OR c, in a single pass
+static Image OpExprEval(void) {
+  ImageExpr e = ImageExprOR(
+      ImageExprAND(ImageExprOf(operands[0]),
+                   ImageExprNEG(ImageExprOf(operands[1]))),
+      ImageExprOf(operands[2]));
+  Image result = ImageExprEval(e);
+  ImageExprDestroy(&e);
+  return result;
+}
+
+static Image OpHorizontalMirror(void) {
+  return ImageHorizontalMirror(operands[0]);
+}
+
+static Image OpVerticalMirror(void) {
+  return ImageVerticalMirror(operands[0]);
+}
+
+// Includes the copy on write of the rows of the copy
+static Image OpVerticalMirrorInPlace(void) {
+  Image img = ImageCopy(operands[0]);
+  ImageVerticalMirrorInPlace(img);
+  return img;
+}
+
+static Image OpReplicateAtBottom(void) {
+  return ImageReplicateAtBottom(operands[0], operands[1]);
+}
+
+static Image OpReplicateAtRight(void) {
+  return ImageReplicateAtRight(operands[0], operands[1]);
+}
+
+static Image OpTranspose(void) { return ImageTranspose(operands[0]); }
+static Image OpRotate90(void) { return ImageRotate90(operands[0]); }
+static Image OpRotate180(void) { return ImageRotate180(operands[0]); }
+static Image OpRotate270(void) { return ImageRotate270(operands[0]); }
+
+// The middle of the image, half its size
+static Image OpCrop(void) {
+  int size = ImageWidth(operands[0]);
+  return ImageCrop(operands[0], size / 4, size / 4, size / 2, size / 2);
+}
+
+// Morphology with a 5 x 5 square, and with a tall element
+static Image OpDilate(void) { return ImageDilate(operands[0], 5, 5); }
+static Image OpErode(void) { return ImageErode(operands[0], 5, 5); }
+static Image OpOpen(void) { return ImageOpen(operands[0], 5, 5); }
+static Image OpClose(void) { return ImageClose(operands[0], 5, 5); }
+static Image OpDilateTall(void) { return ImageDilate(operands[0], 1, 63); }
+
+static Image OpLabelComponents(void) {
+  ImageComponent* components;
+  uint32* labels;
+  ImageLabelComponents(operands[0], 8, &components, &labels);
+  free(components);
+  free(labels);
+  return NULL;
+}
+
+// Statistics are cached in the image: computed on a fresh copy (which
+// shares the rows), and then cached
+static Image OpCountBlack(void) {
+  Image img = ImageCopy(operands[0]);
+  ImageCountBlack(img);
+  return img;
+}
+
+static Image OpCountBlackCached(void) {
+  ImageCountBlack(operands[0]);
+  return NULL;
+}
+
+static Image OpRunLengthHistogram(void) {
+  Image img = ImageCopy(operands[0]);
+  uint64* histogram = malloc(((size_t)ImageWidth(img) + 1) * sizeof(uint64));
+  assert(histogram != NULL);
+  ImageRunLengthHistogram(img, BLACK, histogram);
+  free(histogram);
+  return img;
+}
+
+static Image OpDownsampleOR(void) {
+  return ImageDownsample(operands[0], 4, 4, IMAGE_REDUCE_OR);
+}
+
+static Image OpDownsampleMajority(void) {
+  return ImageDownsample(operands[0], 4, 4, IMAGE_REDUCE_MAJORITY);
+}
+
+// All the levels, down to a single pixel
+static Image OpBuildPyramid(void) {
+  Image levels[40];
+  int n = ImageBuildPyramid(operands[0], IMAGE_REDUCE_OR, levels, 40);
+  for (int k = 1; k < n; k++) ImageDestroy(&levels[k]);
+  return levels[0];
+}
+
+// Random pixels of the image, one per row on average
+#define NUM_POINTS 4096
+static ImagePoint points[NUM_POINTS];
+static uint8 colors[NUM_POINTS];
+
+static Image OpGetPixel(void) {
+  for (int k = 0; k < NUM_POINTS; k++) {
+    colors[k] = ImageGetPixel(operands[0], points[k].x, points[k].y);
+  }
+  return NULL;
+}
+
+static Image OpGetPixels(void) {
+  ImageGetPixels(operands[0], points, NUM_POINTS, colors);
+  return NULL;
+}
+
+static Image OpIsEqual(void) {
+  ImageIsEqual(operands[0], operands[1]);
+  return NULL;
+}
+
+static Image OpSave(void) {
+  ImageSave(operands[0], saved_file);
+  return NULL;
+}
+
+static Image OpLoad(void) { return ImageLoad(saved_file); }
+
+static Image OpStream(void) {
+  ImageStream s = ImageStreamNEG(ImageStreamOf(operands[0]));
+  while (ImageStreamNextRow(s) != NULL) {
+  }
+  ImageStreamClose(&s);
+  return NULL;
+}
+
+static const Operation operations[] = {
+    {"Copy", 1, OpCopy},
+    {"NEG", 1, OpNEG},
+    {"AND", 2, OpAND},
+    {"OR", 2, OpOR},
+    {"XOR", 2, OpXOR},
+    {"ANDn", NUM_OPERANDS, OpANDn},
+    {"ORn", NUM_OPERANDS, OpORn},
+    {"XORn", NUM_OPERANDS, OpXORn},
+    {"AtLeast", NUM_OPERANDS, OpAtLeast},
+    {"ExprEval", 3, OpExprEval},
+    {"HorizontalMirror", 1, OpHorizontalMirror},
+    {"VerticalMirror", 1, OpVerticalMirror},
+    {"VerticalMirrorInPlace", 1, OpVerticalMirrorInPlace},
+    {"ReplicateAtBottom", 2, OpReplicateAtBottom},
+    {"ReplicateAtRight", 2, OpReplicateAtRight},
+    {"Transpose", 1, OpTranspose},
+    {"Rotate90", 1, OpRotate90},
+    {"Rotate180", 1, OpRotate180},
+    {"Rotate270", 1, OpRotate270},
+    {"Crop", 1, OpCrop},
+    {"Dilate", 1, OpDilate},
+    {"Erode", 1, OpErode},
+    {"Open", 1, OpOpen},
+    {"Close", 1, OpClose},
+    {"DilateTall", 1, OpDilateTall},
+    {"LabelComponents", 1, OpLabelComponents},
+    {"CountBlack", 1, OpCountBlack},
+    {"CountBlackCached", 1, OpCountBlackCached},
+    {"RunLengthHistogram", 1, OpRunLengthHistogram},
+    {"DownsampleOR", 1, OpDownsampleOR},
+    {"DownsampleMajority", 1, OpDownsampleMajority},
+    {"BuildPyramid", 1, OpBuildPyramid},
+    {"GetPixel", 1, OpGetPixel},
+    {"GetPixels", 1, OpGetPixels},
+    {"IsEqual", 2, OpIsEqual},
+    {"Save", 1, OpSave},
+    {"Load", 1, OpLoad},
+    {"StreamNEG", 1, OpStream},
+};
+
+/// Measurements
+
+// Number of runs of img
+static unsigned long long CountRuns(const Image img) {
+  unsigned long long runs = 0;
+  ImageStream s = ImageStreamOf(img);
+  const int* row;
+  while ((row = ImageStreamNextRow(s)) != NULL) {
+    int n = 1;
+    while (row[n] != -1) n++;
+    runs += (unsigned long long)(n - 1);
+  }
+  ImageStreamClose(&s);
+  return runs;
+}
+
+// Bytes in use in the heap (-1 if unknown).
+// Pool workers allocate in heaps of their own, which mallinfo2 does not
+// count, so the bytes are only known with a single thread.
+static long long HeapInUse(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  if (ImageGetThreads() > 1) return -1;
+  struct mallinfo2 info = mallinfo2();
+  return (long long)(info.uordblks + info.hblkhd);
+#else
+  return -1;
+#endif
+}
+
+static int CompareTimes(const void* a, const void* b) {
+  unsigned long long x = *(const unsigned long long*)a;
+  unsigned long long y = *(const unsigned long long*)b;
+  return (x > y) - (x < y);
+}
+
+static const char* const encoding_names[] = {"rle", "packed", "bitmap"};
+
+// Time op on the current operands and print a CSV line
+static void Measure(const char* workload, int encoding, int size,
+                    const Operation* op, unsigned long long min_ns) {
+  static unsigned long long times[MAX_REPS];
+
+  // Warm up (caches, lazily computed row hashes, the file to load)
+  Image result = op->run();
+  ImageDestroy(&result);
+
+  int reps = 0;
+  unsigned long long total = 0;
+  while (reps < MAX_REPS && (reps < MIN_REPS || total < min_ns)) {
+    unsigned long long start = InstrWallNs();
+    result = op->run();
+    times[reps] = InstrWallNs() - start;
+    total += times[reps++];
+    ImageDestroy(&result);
+  }
+  qsort(times, (size_t)reps, sizeof(times[0]), CompareTimes);
+  double ns = (double)times[reps / 2];
+
+  // Memory, runs and counters of one more repetition
+  unsigned long before[NUMCOUNTERS], after[NUMCOUNTERS];
+  long long heap = HeapInUse();
+  InstrRead(before);
+  result = op->run();
+  InstrRead(after);
+  long long bytes = heap < 0 ? -1 : HeapInUse() - heap;
+  unsigned long long output_runs = result == NULL ? 0 : CountRuns(result);
+  ImageDestroy(&result);
+
+  unsigned long long input_runs = 0;
+  for (int k = 0; k < op->arity; k++) input_runs += CountRuns(operands[k]);
+  double pixels = (double)size * size * op->arity;
+
+  printf("%s,%s,%d,%d,%s,%d,%.0f,%.4f,%.4f,%lld,%llu,%lu,%lu\n", workload,
+         encoding_names[encoding], size, ImageGetThreads(), op->name, reps,
+         ns, ns / pixels, ns / (double)input_runs, bytes, output_runs,
+         after[0] - before[0], after[1] - before[1]);
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  int size = argc > 1 ? atoi(argv[1]) : 1024;
+  int threads = argc > 2 ? atoi(argv[2]) : 1;
+  int min_ms = argc > 3 ? atoi(argv[3]) : 200;
+  if (size < 64 || min_ms < 0) {
+    fprintf(stderr, "Usage: %s [size [threads [min_ms]]]\n", argv[0]);
+    return 1;
+  }
+  size -= size % 64;  // For the chessboards
+  for (int k = 0; k < NUM_POINTS; k++) {
+    points[k].x = (uint32)(Random() % (uint64)size);
+    points[k].y = (uint32)(Random() % (uint64)size);
+  }
+
+  ImageInit();
+  ImageSetThreads(threads);
+  int fd = mkstemp(saved_file);
+  assert(fd >= 0);
+  close(fd);
+
+  printf("workload,encoding,size,threads,operation,reps,ns_per_op,"
+         "ns_per_pixel,ns_per_run,bytes,output_runs,pixmem,runmem\n");
+  int num_workloads = (int)(sizeof(workloads) / sizeof(workloads[0]));
+  int num_operations = (int)(sizeof(operations) / sizeof(operations[0]));
+  for (int w = 0; w < num_workloads; w++) {
+    for (int k = 0; k < NUM_OPERANDS; k++) {
+      operands[k] = workloads[w].make(size, k);
+    }
+    for (int encoding = IMAGE_RLE; encoding <= IMAGE_BITMAP; encoding++) {
+      for (int k = 0; k < NUM_OPERANDS; k++) {
+        ImageSetEncoding(operands[k], encoding);
+      }
+      for (int i = 0; i < num_operations; i++) {
+        Measure(workloads[w].name, encoding, size, &operations[i],
+                (unsigned long long)min_ms * 1000000ull);
+      }
+    }
+    for (int k = 0; k < NUM_OPERANDS; k++) {
+      ImageDestroy(&operands[k]);
+    }
+  }
+
+  unlink(saved_file);
+  return 0;
+}
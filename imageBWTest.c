@@ -11,13 +11,1603 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "imageBW.h"
 #include "instrumentation.h"
 
+/// Self-checking tests
+//
+// Images are built from arrays of pixels, and the results of the
+// operations are checked against simple loops over the pixels, or against
+// other operations that must give the same image.  A failed check aborts.
+
+// Pseudo-random numbers (xorshift), for reproducible images
+static uint64 rng_state = 88172645463325252ull;
+
+// A pseudo-random number in [0, n)
+static uint32 Random(uint32 n) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32)(rng_state % n);
+}
+
+// The pixels of an image, one byte each (BLACK or WHITE), row by row
+typedef struct {
+  uint32 width;
+  uint32 height;
+  uint8* pixel;
+} Pixels;
+
+#define PIXEL(p, x, y) ((p).pixel[(size_t)(y) * (p).width + (x)])
+
+static Pixels NewPixels(uint32 width, uint32 height) {
+  Pixels p = {width, height, calloc((size_t)width * height + 1, 1)};
+  assert(p.pixel != NULL);
+  return p;
+}
+
+static void FreePixels(Pixels* p) {
+  free(p->pixel);
+  p->pixel = NULL;
+}
+
+// Random pixels, in runs of 1 to 2 * mean - 1 pixels.
+// About one row in four repeats the row above.
+static Pixels RandomPixels(uint32 width, uint32 height, uint32 mean) {
+  Pixels p = NewPixels(width, height);
+  for (uint32 y = 0; y < height; y++) {
+    if (y > 0 && Random(4) == 0) {
+      memcpy(&PIXEL(p, 0, y), &PIXEL(p, 0, y - 1), width);
+      continue;
+    }
+    uint8 color = (uint8)Random(2);
+    for (uint32 x = 0; x < width;) {
+      uint32 end = x + 1 + Random(2 * mean - 1);
+      for (; x < end && x < width; x++) PIXEL(p, x, y) = color;
+      color ^= 1;
+    }
+  }
+  return p;
+}
+
+// Create an image from pixels, through a temporary PBM file
+static Image ImageOfPixels(const Pixels* p) {
+  char name[] = "/tmp/imageBWTestXXXXXX";
+  int fd = mkstemp(name);
+  assert(fd >= 0);
+  FILE* f = fdopen(fd, "wb");
+  assert(f != NULL);
+  fprintf(f, "P4\n%u %u\n", p->width, p->height);
+  for (uint32 y = 0; y < p->height; y++) {
+    for (uint32 x = 0; x < p->width; x += 8) {
+      int byte = 0;
+      for (uint32 k = 0; k < 8; k++) {
+        if (x + k < p->width && PIXEL(*p, x + k, y) == BLACK) {
+          byte |= 0x80 >> k;
+        }
+      }
+      fputc(byte, f);
+    }
+  }
+  fclose(f);
+  Image img = ImageLoad(name);
+  assert(img != NULL);
+  unlink(name);
+  return img;
+}
+
+// Get the pixels of an image
+static Pixels PixelsOfImage(const Image img) {
+  Pixels p = NewPixels((uint32)ImageWidth(img), (uint32)ImageHeight(img));
+  for (uint32 y = 0; y < p.height; y++) {
+    for (uint32 x = 0; x < p.width; x++) {
+      PIXEL(p, x, y) = ImageGetPixel(img, x, y);
+    }
+  }
+  return p;
+}
+
+// Check that img has the given pixels
+static void CheckPixels(const Image img, const Pixels* p) {
+  assert((uint32)ImageWidth(img) == p->width);
+  assert((uint32)ImageHeight(img) == p->height);
+  Pixels q = PixelsOfImage(img);
+  assert(memcmp(q.pixel, p->pixel, (size_t)p->width * p->height) == 0);
+  FreePixels(&q);
+}
+
+// Check the statistics of img against its pixels, counted one by one.
+// Asked twice, to check the cached values too.
+static void CheckStatistics(const Image img, const Pixels* p) {
+  uint32 w = p->width;
+  uint32 h = p->height;
+  uint64 black = 0;
+  uint32 x0 = w, y0 = h, x1 = 0, y1 = 0;  // Box corners, [x0, x1] x [y0, y1]
+  uint32* counts = calloc(h, sizeof(uint32));
+  uint64* histograms[2];
+  histograms[WHITE] = calloc(w + 1, sizeof(uint64));
+  histograms[BLACK] = calloc(w + 1, sizeof(uint64));
+  uint32* got_counts = malloc(h * sizeof(uint32));
+  uint64* got_histogram = malloc((w + 1) * sizeof(uint64));
+  assert(counts && histograms[WHITE] && histograms[BLACK]);
+  assert(got_counts && got_histogram);
+  for (uint32 y = 0; y < h; y++) {
+    uint32 start = 0;
+    for (uint32 x = 0; x < w; x++) {
+      uint8 color = PIXEL(*p, x, y);
+      if (color == BLACK) {
+        counts[y]++;
+        if (x < x0) x0 = x;
+        if (x > x1) x1 = x;
+        if (y < y0) y0 = y;
+        y1 = y;
+      }
+      if (x + 1 == w || PIXEL(*p, x + 1, y) != color) {
+        histograms[color][x + 1 - start]++;
+        start = x + 1;
+      }
+    }
+    black += counts[y];
+  }
+
+  for (int round = 0; round < 2; round++) {
+    assert(ImageCountBlack(img) == black);
+    uint32 bx = 1, by = 1, bw = 1, bh = 1;
+    int found = ImageBoundingBox(img, &bx, &by, &bw, &bh);
+    if (black == 0) {
+      assert(!found && bx == 0 && by == 0 && bw == 0 && bh == 0);
+    } else {
+      assert(found && bx == x0 && by == y0);
+      assert(bw == x1 - x0 + 1 && bh == y1 - y0 + 1);
+    }
+    ImageRowCounts(img, got_counts);
+    assert(memcmp(got_counts, counts, h * sizeof(uint32)) == 0);
+    for (int color = WHITE; color <= BLACK; color++) {
+      ImageRunLengthHistogram(img, color, got_histogram);
+      assert(memcmp(got_histogram, histograms[color],
+                    (w + 1) * sizeof(uint64)) == 0);
+    }
+  }
+  free(counts);
+  free(histograms[WHITE]);
+  free(histograms[BLACK]);
+  free(got_counts);
+  free(got_histogram);
+}
+
+// A copy of img, stored in the given encoding
+static Image CopyInEncoding(const Image img, int encoding) {
+  Image copy = ImageCopy(img);
+  ImageSetEncoding(copy, encoding);
+  assert(ImageEncoding(copy) == encoding);
+  return copy;
+}
+
+static const int encodings[] = {IMAGE_RLE, IMAGE_RLE_PACKED, IMAGE_BITMAP};
+#define NUM_ENCODINGS 3
+
+// Operations of one and two operands, to compare across encodings
+typedef struct {
+  const char* name;
+  Image (*op)(const Image img);
+} UnaryOp;
+
+typedef struct {
+  const char* name;
+  Image (*op)(const Image img1, const Image img2);
+} BinaryOp;
+
+static Image OpCopy(const Image img) { return ImageCopy(img); }
+
+static Image OpVerticalMirrorInPlace(const Image img) {
+  Image copy = ImageCopy(img);
+  ImageVerticalMirrorInPlace(copy);
+  return copy;
+}
+
+static Image OpCrop(const Image img) {
+  uint32 x = (uint32)ImageWidth(img) / 3;
+  uint32 y = (uint32)ImageHeight(img) / 3;
+  return ImageCrop(img, x, y, (uint32)ImageWidth(img) - x,
+                   (uint32)ImageHeight(img) - y);
+}
+
+static Image OpDilate(const Image img) { return ImageDilate(img, 3, 2); }
+static Image OpErode(const Image img) { return ImageErode(img, 2, 3); }
+
+static Image OpDownsample(const Image img) {
+  return ImageDownsample(img, 3, 2, IMAGE_REDUCE_MAJORITY);
+}
+
+static const UnaryOp unary_ops[] = {
+    {"Copy", OpCopy},
+    {"NEG", ImageNEG},
+    {"HorizontalMirror", ImageHorizontalMirror},
+    {"VerticalMirror", ImageVerticalMirror},
+    {"VerticalMirrorInPlace", OpVerticalMirrorInPlace},
+    {"Transpose", ImageTranspose},
+    {"Rotate90", ImageRotate90},
+    {"Rotate180", ImageRotate180},
+    {"Crop", OpCrop},
+    {"Dilate", OpDilate},
+    {"Erode", OpErode},
+    {"Downsample", OpDownsample},
+};
+
+static Image OpANDn(const Image img1, const Image img2) {
+  const Image imgs[] = {img1, img2, img1};
+  return ImageANDn(imgs, 3);
+}
+
+static Image OpORn1(const Image img1, const Image img2) {
+  (void)img2;
+  return ImageORn(&img1, 1);
+}
+
+static Image OpORn2(const Image img1, const Image img2) {
+  const Image imgs[] = {img2, img1};
+  return ImageORn(imgs, 2);
+}
+
+static Image OpORn5(const Image img1, const Image img2) {
+  Image neg = ImageNEG(img2);
+  const Image imgs[] = {img1, neg, img1, img2, neg};
+  Image result = ImageORn(imgs, 5);
+  ImageDestroy(&neg);
+  return result;
+}
+
+static Image OpXORn(const Image img1, const Image img2) {
+  const Image imgs[] = {img1, img2, img2, img1, img2};
+  return ImageXORn(imgs, 5);
+}
+
+static Image OpAtLeast(const Image img1, const Image img2) {
+  Image neg = ImageNEG(img1);
+  const Image imgs[] = {img1, img2, neg, img2};
+  Image result = ImageAtLeast(imgs, 4, 2);
+  ImageDestroy(&neg);
+  return result;
+}
+
+static const BinaryOp binary_ops[] = {
+    {"AND", ImageAND},
+    {"OR", ImageOR},
+    {"XOR", ImageXOR},
+    {"ANDn", OpANDn},
+    {"XORn", OpXORn},
+    {"AtLeast", OpAtLeast},
+    {"ReplicateAtBottom", ImageReplicateAtBottom},
+    {"ReplicateAtRight", ImageReplicateAtRight},
+    {"ORn1", OpORn1},
+    {"ORn2", OpORn2},
+    {"ORn5", OpORn5},
+};
+
+#define NUM_UNARY_OPS (sizeof(unary_ops) / sizeof(unary_ops[0]))
+#define NUM_BINARY_OPS (sizeof(binary_ops) / sizeof(binary_ops[0]))
+
+// Check that an operation result, computed from operands in some
+// encodings, is the same as the expected one
+static void CheckSame(const Image result, const Image expected,
+                      const char* name, int enc1, int enc2) {
+  if (!ImageIsEqual(result, expected)) {
+    fprintf(stderr, "%s differs with encodings %d and %d\n", name, enc1,
+            enc2);
+    abort();
+  }
+  assert(ImageDigest(result) == ImageDigest(expected));
+  assert(ImageCountBlack(result) == ImageCountBlack(expected));
+}
+
+// Every operation gives the same image whatever the encoding of its
+// operands, and the boolean operations match the pixels
+static void TestEncodings(const Pixels* p1, const Pixels* p2) {
+  Image a = ImageOfPixels(p1);
+  Image b = ImageOfPixels(p2);
+
+  // The reference results, from IMAGE_RLE operands
+  Image expected_unary[NUM_UNARY_OPS];
+  for (size_t k = 0; k < NUM_UNARY_OPS; k++) {
+    expected_unary[k] = unary_ops[k].op(a);
+  }
+  Image expected_binary[NUM_BINARY_OPS];
+  for (size_t k = 0; k < NUM_BINARY_OPS; k++) {
+    expected_binary[k] = binary_ops[k].op(a, b);
+  }
+
+  // Checked against the pixels
+  Pixels neg = NewPixels(p1->width, p1->height);
+  Pixels and = NewPixels(p1->width, p1->height);
+  Pixels or = NewPixels(p1->width, p1->height);
+  Pixels xor = NewPixels(p1->width, p1->height);
+  for (size_t i = 0; i < (size_t)p1->width * p1->height; i++) {
+    neg.pixel[i] = p1->pixel[i] ^ 1;
+    and.pixel[i] = p1->pixel[i] & p2->pixel[i];
+    or.pixel[i] = p1->pixel[i] | p2->pixel[i];
+    xor.pixel[i] = p1->pixel[i] ^ p2->pixel[i];
+  }
+  CheckPixels(a, p1);
+  CheckPixels(expected_unary[1], &neg);
+  CheckPixels(expected_binary[0], &and);
+  CheckPixels(expected_binary[1], &or);
+  CheckPixels(expected_binary[2], &xor);
+  CheckPixels(expected_binary[8], p1);
+  CheckPixels(expected_binary[9], &or);
+  assert(ImageCountBlack(expected_binary[10]) ==
+         (uint64)p1->width * p1->height);
+  FreePixels(&neg);
+  FreePixels(&and);
+  FreePixels(&or);
+  FreePixels(&xor);
+  Pixels right = NewPixels(2 * p1->width, p1->height);
+  for (uint32 y = 0; y < p1->height; y++) {
+    memcpy(&PIXEL(right, 0, y), &PIXEL(*p1, 0, y), p1->width);
+    memcpy(&PIXEL(right, p1->width, y), &PIXEL(*p2, 0, y), p1->width);
+  }
+  CheckPixels(expected_binary[7], &right);
+  FreePixels(&right);
+
+  for (int e1 = 0; e1 < NUM_ENCODINGS; e1++) {
+    Image a1 = CopyInEncoding(a, encodings[e1]);
+    CheckPixels(a1, p1);
+    CheckStatistics(a1, p1);
+    for (size_t k = 0; k < NUM_UNARY_OPS; k++) {
+      Image result = unary_ops[k].op(a1);
+      CheckSame(result, expected_unary[k], unary_ops[k].name, encodings[e1],
+                encodings[e1]);
+      ImageDestroy(&result);
+    }
+    for (int e2 = 0; e2 < NUM_ENCODINGS; e2++) {
+      Image b2 = CopyInEncoding(b, encodings[e2]);
+      for (size_t k = 0; k < NUM_BINARY_OPS; k++) {
+        Image result = binary_ops[k].op(a1, b2);
+        CheckSame(result, expected_binary[k], binary_ops[k].name,
+                  encodings[e1], encodings[e2]);
+        ImageDestroy(&result);
+      }
+      ImageDestroy(&b2);
+    }
+
+    // Saved and loaded back
+    char name[] = "/tmp/imageBWTestXXXXXX";
+    int fd = mkstemp(name);
+    assert(fd >= 0);
+    close(fd);
+    assert(ImageSave(a1, name));
+    Image loaded = ImageLoad(name);
+    assert(loaded != NULL);
+    unlink(name);
+    CheckSame(loaded, a, "Save", encodings[e1], encodings[e1]);
+    ImageDestroy(&loaded);
+    ImageDestroy(&a1);
+  }
+
+  for (size_t k = 0; k < NUM_UNARY_OPS; k++) ImageDestroy(&expected_unary[k]);
+  for (size_t k = 0; k < NUM_BINARY_OPS; k++) {
+    ImageDestroy(&expected_binary[k]);
+  }
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// ImageChooseEncoding picks bitmaps for noisy images only, and keeps the
+// pixels
+static void TestChooseEncoding(void) {
+  Image chess1 = ImageCreateChessboard(256, 64, 1, BLACK);
+  Image uniform = ImageCreate(256, 64, WHITE);
+  Image chess1_rle = ImageCopy(chess1);
+  Image uniform_rle = ImageCopy(uniform);
+  assert(ImageChooseEncoding(chess1) == IMAGE_BITMAP);
+  assert(ImageEncoding(chess1) == IMAGE_BITMAP);
+  assert(ImageIsEqual(chess1, chess1_rle));
+  assert(ImageChooseEncoding(uniform) == IMAGE_RLE);
+  assert(ImageEncoding(uniform) == IMAGE_RLE);
+  assert(ImageIsEqual(uniform, uniform_rle));
+
+  // From any encoding
+  ImageSetEncoding(uniform, IMAGE_RLE_PACKED);
+  assert(ImageChooseEncoding(uniform) == IMAGE_RLE);
+  assert(ImageIsEqual(uniform, uniform_rle));
+  ImageSetEncoding(chess1, IMAGE_RLE_PACKED);
+  assert(ImageChooseEncoding(chess1) == IMAGE_BITMAP);
+  assert(ImageIsEqual(chess1, chess1_rle));
+
+  ImageDestroy(&chess1);
+  ImageDestroy(&uniform);
+  ImageDestroy(&chess1_rle);
+  ImageDestroy(&uniform_rle);
+  printf("TestChooseEncoding OK\n");
+}
+
+// Images with rows stored once keep their pixels when packed, and when
+// their shared packed rows are then changed in place
+static void TestPackedSharedRows(void) {
+  Image images[] = {ImageCreate(300, 40, BLACK),
+                    ImageCreateChessboard(300, 40, 10, WHITE),
+                    ImageCreateChessboard(130, 65, 13, BLACK)};
+  for (size_t k = 0; k < sizeof(images) / sizeof(images[0]); k++) {
+    Image packed = CopyInEncoding(images[k], IMAGE_RLE_PACKED);
+    assert(ImageIsEqual(packed, images[k]));
+    Image mirror = ImageVerticalMirror(images[k]);
+    ImageVerticalMirrorInPlace(packed);
+    assert(ImageEncoding(packed) == IMAGE_RLE_PACKED);
+    assert(ImageIsEqual(packed, mirror));
+    ImageDestroy(&packed);
+    ImageDestroy(&mirror);
+    ImageDestroy(&images[k]);
+  }
+  printf("TestPackedSharedRows OK\n");
+}
+
+// Run lengths around the limits of the packed codes (1, 2 and 3 bytes)
+static Pixels LongRunPixels(void) {
+  static const uint32 runs[] = {127, 128, 129, 16383, 16384, 16385, 1, 70000};
+  uint32 width = 0;
+  for (size_t k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) width += runs[k];
+  Pixels p = NewPixels(width, 3);
+  for (uint32 y = 0; y < p.height; y++) {
+    uint32 x = 0;
+    for (size_t k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) {
+      // The rows start with alternating colors
+      uint8 color = (uint8)((k + y) % 2);
+      for (uint32 end = x + runs[k]; x < end; x++) PIXEL(p, x, y) = color;
+    }
+  }
+  return p;
+}
+
+// Check rotations and transposition against the pixels, and against each
+// other
+static void TestRotations(uint32 width, uint32 height, uint32 mean) {
+  Pixels p = RandomPixels(width, height, mean);
+  Pixels t = NewPixels(height, width);
+  Pixels r90 = NewPixels(height, width);
+  for (uint32 y = 0; y < height; y++) {
+    for (uint32 x = 0; x < width; x++) {
+      PIXEL(t, y, x) = PIXEL(p, x, y);
+      PIXEL(r90, height - 1 - y, x) = PIXEL(p, x, y);
+    }
+  }
+  Image rle = ImageOfPixels(&p);
+
+  for (int e = 0; e < NUM_ENCODINGS; e++) {
+    Image img = CopyInEncoding(rle, encodings[e]);
+
+    Image tr = ImageTranspose(img);
+    CheckPixels(tr, &t);
+    Image tr2 = ImageTranspose(tr);
+    assert(ImageIsEqual(tr2, img));
+
+    Image rot = ImageRotate90(img);
+    CheckPixels(rot, &r90);
+    for (int k = 1; k < 4; k++) {
+      Image next = ImageRotate90(rot);
+      ImageDestroy(&rot);
+      rot = next;
+    }
+    assert(ImageIsEqual(rot, img));
+
+    Image r180 = ImageRotate180(img);
+    Image hm = ImageHorizontalMirror(img);
+    Image vhm = ImageVerticalMirror(hm);
+    assert(ImageIsEqual(r180, vhm));
+
+    Image r270 = ImageRotate270(img);
+    Image r90_180 = ImageRotate90(r180);
+    assert(ImageIsEqual(r270, r90_180));
+
+    ImageDestroy(&tr);
+    ImageDestroy(&tr2);
+    ImageDestroy(&rot);
+    ImageDestroy(&r180);
+    ImageDestroy(&hm);
+    ImageDestroy(&vhm);
+    ImageDestroy(&r270);
+    ImageDestroy(&r90_180);
+    ImageDestroy(&img);
+  }
+
+  ImageDestroy(&rle);
+  FreePixels(&p);
+  FreePixels(&t);
+  FreePixels(&r90);
+}
+
+static void TestAllRotations(void) {
+  static const uint32 sizes[] = {1, 2, 7, 64, 65, 255, 257, 601};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+      TestRotations(sizes[i], sizes[j], 1 + (uint32)(i + j) % 5 * 7);
+    }
+  }
+  printf("TestAllRotations OK\n");
+}
+
+// Dilation (color BLACK) or erosion (color WHITE) of pixels with an
+// element of width x height, by brute force: a pixel gets the color if the
+// element placed at it (reflected, for dilation) covers a pixel of that
+// color.  Pixels outside are of the other color.
+static Pixels MorphPixels(const Pixels* p, uint32 width, uint32 height,
+                          uint8 color) {
+  Pixels q = NewPixels(p->width, p->height);
+  int64_t cx = width / 2;
+  int64_t cy = height / 2;
+  for (int64_t y = 0; y < p->height; y++) {
+    for (int64_t x = 0; x < p->width; x++) {
+      uint8 v = color ^ 1;
+      for (int64_t j = 0; j < height && v != color; j++) {
+        for (int64_t i = 0; i < width && v != color; i++) {
+          int64_t px = color == BLACK ? x - i + cx : x + i - cx;
+          int64_t py = color == BLACK ? y - j + cy : y + j - cy;
+          if (px >= 0 && px < p->width && py >= 0 && py < p->height &&
+              PIXEL(*p, px, py) == color) {
+            v = color;
+          }
+        }
+      }
+      PIXEL(q, x, y) = v;
+    }
+  }
+  return q;
+}
+
+static void TestMorphology(uint32 img_width, uint32 img_height,
+                           uint32 mean, uint32 width, uint32 height) {
+  Pixels p = RandomPixels(img_width, img_height, mean);
+  Pixels dilated = MorphPixels(&p, width, height, BLACK);
+  Pixels eroded = MorphPixels(&p, width, height, WHITE);
+  Pixels opened = MorphPixels(&eroded, width, height, BLACK);
+  Pixels closed = MorphPixels(&dilated, width, height, WHITE);
+  Image rle = ImageOfPixels(&p);
+
+  for (int e = 0; e < NUM_ENCODINGS; e++) {
+    Image img = CopyInEncoding(rle, encodings[e]);
+    Image result = ImageDilate(img, width, height);
+    CheckPixels(result, &dilated);
+    ImageDestroy(&result);
+    result = ImageErode(img, width, height);
+    CheckPixels(result, &eroded);
+    ImageDestroy(&result);
+    result = ImageOpen(img, width, height);
+    CheckPixels(result, &opened);
+    ImageDestroy(&result);
+    result = ImageClose(img, width, height);
+    CheckPixels(result, &closed);
+    ImageDestroy(&result);
+    ImageDestroy(&img);
+  }
+
+  ImageDestroy(&rle);
+  FreePixels(&p);
+  FreePixels(&dilated);
+  FreePixels(&eroded);
+  FreePixels(&opened);
+  FreePixels(&closed);
+}
+
+static void TestAllMorphology(void) {
+  // Odd and even elements, 1 x N and N x 1, and larger than the image
+  static const uint32 elements[][2] = {{1, 1}, {2, 2}, {3, 3}, {1, 5},
+                                       {5, 1}, {4, 7}, {6, 3}, {1, 12},
+                                       {12, 1}, {40, 2}, {3, 40}, {99, 99}};
+  static const uint32 sizes[][2] = {{1, 1}, {9, 1}, {1, 9}, {37, 29},
+                                    {70, 33}};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (size_t k = 0; k < sizeof(elements) / sizeof(elements[0]); k++) {
+      TestMorphology(sizes[i][0], sizes[i][1], 1 + (uint32)(i + k) % 6,
+                     elements[k][0], elements[k][1]);
+    }
+  }
+  printf("TestAllMorphology OK\n");
+}
+
+// Label the components of the BLACK pixels by flood fill, numbering them in
+// the order of their first pixel.  Returns the number of components.
+static uint32 LabelPixels(const Pixels* p, int connectivity, int32_t* label) {
+  size_t size = (size_t)p->width * p->height;
+  size_t* stack = malloc(size * sizeof(size_t) + 1);
+  assert(stack != NULL);
+  for (size_t k = 0; k < size; k++) label[k] = -1;
+  uint32 count = 0;
+  for (size_t k = 0; k < size; k++) {
+    if (p->pixel[k] != BLACK || label[k] >= 0) continue;
+    size_t top = 0;
+    stack[top++] = k;
+    label[k] = (int32_t)count;
+    while (top > 0) {
+      size_t q = stack[--top];
+      int64_t x = (int64_t)(q % p->width);
+      int64_t y = (int64_t)(q / p->width);
+      for (int64_t dy = -1; dy <= 1; dy++) {
+        for (int64_t dx = -1; dx <= 1; dx++) {
+          if (connectivity == 4 && dx != 0 && dy != 0) continue;
+          int64_t nx = x + dx;
+          int64_t ny = y + dy;
+          if (nx < 0 || nx >= p->width || ny < 0 || ny >= p->height) continue;
+          size_t r = (size_t)ny * p->width + (size_t)nx;
+          if (p->pixel[r] == BLACK && label[r] < 0) {
+            label[r] = (int32_t)count;
+            stack[top++] = r;
+          }
+        }
+      }
+    }
+    count++;
+  }
+  free(stack);
+  return count;
+}
+
+// Check the components of img, with both connectivities, against the
+// flood fill of its pixels
+static void CheckComponents(const Image img, const Pixels* p) {
+  size_t size = (size_t)p->width * p->height;
+  int32_t* label = malloc(size * sizeof(int32_t) + 1);
+  assert(label != NULL);
+  for (int connectivity = 4; connectivity <= 8; connectivity += 4) {
+    uint32 count = LabelPixels(p, connectivity, label);
+    ImageComponent* components;
+    uint32* run_labels;
+    int n = ImageLabelComponents(img, connectivity, &components, &run_labels);
+    assert((uint32)n == count);
+
+    // The label of each BLACK run is the label of its pixels
+    uint32 run = 0;
+    for (uint32 y = 0; y < p->height; y++) {
+      for (uint32 x = 0; x < p->width; x++) {
+        int32_t l = label[(size_t)y * p->width + x];
+        if (l < 0) continue;
+        if (x > 0 && PIXEL(*p, x - 1, y) == BLACK) {
+          assert(run_labels[run - 1] == (uint32)l);
+        } else {
+          assert(run_labels[run++] == (uint32)l);
+        }
+      }
+    }
+
+    // Bounding boxes and areas
+    ImageComponent* expected = calloc(count + 1, sizeof(ImageComponent));
+    assert(expected != NULL);
+    for (size_t k = 0; k < size; k++) {
+      if (label[k] < 0) continue;
+      ImageComponent* c = &expected[label[k]];
+      uint32 x = (uint32)(k % p->width);
+      uint32 y = (uint32)(k / p->width);
+      if (c->area == 0) {
+        *c = (ImageComponent){x, y, 1, 1, 0};
+      }
+      if (x < c->x) {
+        c->width += c->x - x;
+        c->x = x;
+      }
+      if (x >= c->x + c->width) c->width = x - c->x + 1;
+      c->height = y - c->y + 1;
+      c->area++;
+    }
+    for (int c = 0; c < n; c++) {
+      assert(components[c].x == expected[c].x);
+      assert(components[c].y == expected[c].y);
+      assert(components[c].width == expected[c].width);
+      assert(components[c].height == expected[c].height);
+      assert(components[c].area == expected[c].area);
+    }
+    free(expected);
+    free(components);
+    free(run_labels);
+  }
+  free(label);
+}
+
+static void TestComponents(void) {
+  // Diagonal contacts only: 5 components with 4-connectivity, 1 with 8
+  Pixels p = NewPixels(5, 4);
+  PIXEL(p, 0, 0) = PIXEL(p, 1, 1) = PIXEL(p, 2, 2) = BLACK;
+  PIXEL(p, 3, 1) = PIXEL(p, 4, 0) = BLACK;
+  Image img = ImageOfPixels(&p);
+  ImageComponent* components;
+  assert(ImageLabelComponents(img, 4, &components, NULL) == 5);
+  free(components);
+  assert(ImageLabelComponents(img, 8, &components, NULL) == 1);
+  assert(components[0].x == 0 && components[0].y == 0);
+  assert(components[0].width == 5 && components[0].height == 3);
+  assert(components[0].area == 5);
+  free(components);
+  CheckComponents(img, &p);
+  ImageDestroy(&img);
+  FreePixels(&p);
+
+  static const uint32 sizes[][3] = {{1, 1, 1}, {1, 17, 2}, {17, 1, 2},
+                                    {33, 21, 1}, {64, 40, 2}, {65, 30, 6}};
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    p = RandomPixels(sizes[k][0], sizes[k][1], sizes[k][2]);
+    Image rle = ImageOfPixels(&p);
+    for (int e = 0; e < NUM_ENCODINGS; e++) {
+      img = CopyInEncoding(rle, encodings[e]);
+      CheckComponents(img, &p);
+      ImageDestroy(&img);
+    }
+    ImageDestroy(&rle);
+    FreePixels(&p);
+  }
+
+  // Tall enough to be split in strips, joined in parallel
+  int threads = ImageGetThreads();
+  ImageSetThreads(4);
+  p = RandomPixels(300, 700, 2);
+  img = ImageOfPixels(&p);
+  CheckComponents(img, &p);
+  ImageDestroy(&img);
+  FreePixels(&p);
+  ImageSetThreads(threads);
+  printf("TestComponents OK\n");
+}
+
+// Downsample pixels by fx x fy, by brute force: each block (smaller at the
+// right and bottom edges) is reduced over its own pixels
+static Pixels DownsamplePixels(const Pixels* p, uint32 fx, uint32 fy,
+                               int mode) {
+  Pixels q = NewPixels((p->width + fx - 1) / fx, (p->height + fy - 1) / fy);
+  for (uint32 by = 0; by < q.height; by++) {
+    for (uint32 bx = 0; bx < q.width; bx++) {
+      uint64 black = 0;
+      uint64 total = 0;
+      for (uint32 y = by * fy; y < (by + 1) * fy && y < p->height; y++) {
+        for (uint32 x = bx * fx; x < (bx + 1) * fx && x < p->width; x++) {
+          black += PIXEL(*p, x, y);
+          total++;
+        }
+      }
+      uint8 v = mode == IMAGE_REDUCE_OR    ? black > 0
+                : mode == IMAGE_REDUCE_AND ? black == total
+                                           : 2 * black > total;
+      PIXEL(q, bx, by) = v;
+    }
+  }
+  return q;
+}
+
+static void TestDownsample(uint32 width, uint32 height, uint32 mean) {
+  static const uint32 factors[][2] = {{1, 1}, {2, 2}, {3, 1}, {1, 3},
+                                      {2, 5}, {4, 4}, {7, 3}, {64, 2},
+                                      {65, 1}, {500, 500}};
+  Pixels p = RandomPixels(width, height, mean);
+  Image rle = ImageOfPixels(&p);
+  for (int e = 0; e < NUM_ENCODINGS; e++) {
+    Image img = CopyInEncoding(rle, encodings[e]);
+    for (size_t k = 0; k < sizeof(factors) / sizeof(factors[0]); k++) {
+      for (int mode = IMAGE_REDUCE_OR; mode <= IMAGE_REDUCE_MAJORITY;
+           mode++) {
+        Pixels q = DownsamplePixels(&p, factors[k][0], factors[k][1], mode);
+        Image result = ImageDownsample(img, factors[k][0], factors[k][1],
+                                       mode);
+        CheckPixels(result, &q);
+        ImageDestroy(&result);
+        FreePixels(&q);
+      }
+    }
+
+    // Level k of the pyramid is downsampled by 2^k (OR and AND), or by 2
+    // from level k - 1 (majority), down to a single pixel
+    int num_levels = 1;
+    while ((1u << (num_levels - 1)) < width ||
+           (1u << (num_levels - 1)) < height) {
+      num_levels++;
+    }
+    Image levels[40];
+    for (int mode = IMAGE_REDUCE_OR; mode <= IMAGE_REDUCE_MAJORITY; mode++) {
+      int n = ImageBuildPyramid(img, mode, levels, 40);
+      assert(n == num_levels);
+      assert(ImageWidth(levels[n - 1]) == 1);
+      assert(ImageHeight(levels[n - 1]) == 1);
+      assert(ImageIsEqual(levels[0], img));
+      for (int j = 1; j < n; j++) {
+        Image expected =
+            mode == IMAGE_REDUCE_MAJORITY
+                ? ImageDownsample(levels[j - 1], 2, 2, mode)
+                : ImageDownsample(img, 1u << j, 1u << j, mode);
+        assert(ImageIsEqual(levels[j], expected));
+        ImageDestroy(&expected);
+      }
+      for (int j = 0; j < n; j++) ImageDestroy(&levels[j]);
+
+      // Truncated
+      int max_levels = num_levels > 2 ? num_levels - 2 : 1;
+      n = ImageBuildPyramid(img, mode, levels, max_levels);
+      assert(n == max_levels);
+      for (int j = 0; j < n; j++) ImageDestroy(&levels[j]);
+    }
+    ImageDestroy(&img);
+  }
+  ImageDestroy(&rle);
+  FreePixels(&p);
+}
+
+static void TestAllDownsample(void) {
+  // Majority ties (half BLACK) are WHITE, in whole and partial blocks:
+  // rows B W B B B W and W B W W B B, in blocks of 4 x 1 and 4 x 2
+  static const uint8 tie_rows[2][6] = {{1, 0, 1, 1, 1, 0},
+                                       {0, 1, 0, 0, 1, 1}};
+  Pixels p = NewPixels(6, 2);
+  memcpy(p.pixel, tie_rows, sizeof(tie_rows));
+  Image img = ImageOfPixels(&p);
+  Image result = ImageDownsample(img, 4, 1, IMAGE_REDUCE_MAJORITY);
+  Pixels q = NewPixels(2, 2);
+  PIXEL(q, 0, 0) = BLACK;  // 3 of 4
+  PIXEL(q, 1, 0) = WHITE;  // 1 of 2, at the edge
+  PIXEL(q, 0, 1) = WHITE;  // 1 of 4
+  PIXEL(q, 1, 1) = BLACK;  // 2 of 2, at the edge
+  CheckPixels(result, &q);
+  ImageDestroy(&result);
+  FreePixels(&q);
+  result = ImageDownsample(img, 4, 2, IMAGE_REDUCE_MAJORITY);
+  q = NewPixels(2, 1);
+  PIXEL(q, 0, 0) = WHITE;  // 4 of 8
+  PIXEL(q, 1, 0) = BLACK;  // 3 of 4, at the edge
+  CheckPixels(result, &q);
+  ImageDestroy(&result);
+  FreePixels(&q);
+  result = ImageDownsample(img, 5, 1, IMAGE_REDUCE_MAJORITY);
+  q = NewPixels(2, 2);
+  PIXEL(q, 0, 0) = BLACK;  // 4 of 5
+  PIXEL(q, 1, 0) = WHITE;  // 0 of 1, at the edge
+  PIXEL(q, 0, 1) = WHITE;  // 2 of 5
+  PIXEL(q, 1, 1) = BLACK;  // 1 of 1, at the edge
+  CheckPixels(result, &q);
+  ImageDestroy(&result);
+  FreePixels(&q);
+  ImageDestroy(&img);
+  FreePixels(&p);
+
+  static const uint32 sizes[][3] = {{1, 1, 1},   {1, 9, 2},  {9, 1, 2},
+                                    {33, 17, 1}, {64, 64, 3}, {130, 67, 9},
+                                    {601, 5, 40}};
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    TestDownsample(sizes[k][0], sizes[k][1], sizes[k][2]);
+  }
+  printf("TestAllDownsample OK\n");
+}
+
+// Check that two streams produce the same rows, up to the last one
+static void CheckSameStreams(ImageStream s, ImageStream t) {
+  assert(ImageStreamWidth(s) == ImageStreamWidth(t));
+  assert(ImageStreamHeight(s) == ImageStreamHeight(t));
+  for (int i = 0; i < ImageStreamHeight(s); i++) {
+    const int* row1 = ImageStreamNextRow(s);
+    const int* row2 = ImageStreamNextRow(t);
+    assert(row1 != NULL && row2 != NULL);
+    int k = 0;
+    for (; row1[k] != -1; k++) assert(row1[k] == row2[k]);
+    assert(row2[k] == -1);
+  }
+  assert(ImageStreamNextRow(s) == NULL);
+  assert(ImageStreamNextRow(t) == NULL);
+}
+
+// PBM headers longer than the read buffer of a stream (with a long comment)
+static void TestStreamLongHeader(void) {
+  char name[] = "/tmp/imageBWTestXXXXXX";
+  int fd = mkstemp(name);
+  assert(fd >= 0);
+  FILE* f = fdopen(fd, "wb");
+  assert(f != NULL);
+  fprintf(f, "P4\n# ");
+  for (int k = 0; k < 70000; k++) fputc('x', f);
+  fprintf(f, "\n# another comment\n  13\n#\n3\n");
+  for (int k = 0; k < 3 * 2; k++) fputc(0x5A + 7 * k, f);
+  fclose(f);
+
+  Image img = ImageLoad(name);
+  assert(img != NULL);
+  ImageStream s = ImageStreamOpen(name);
+  assert(s != NULL);
+  ImageStream t = ImageStreamOf(img);
+  CheckSameStreams(s, t);
+  ImageStreamClose(&s);
+  ImageStreamClose(&t);
+  ImageDestroy(&img);
+  unlink(name);
+  printf("TestStreamLongHeader OK\n");
+}
+
+// A temporary file name, for files written by the tests
+static void TempName(char* name) {
+  strcpy(name, "/tmp/imageBWTestXXXXXX");
+  int fd = mkstemp(name);
+  assert(fd >= 0);
+  close(fd);
+}
+
+#define NUM_STREAM_OPS 6
+
+// The k-th stream operation on the streams s1 and s2 (both consumed)
+static ImageStream StreamOp(int k, ImageStream s1, ImageStream s2) {
+  switch (k) {
+    case 0:
+      ImageStreamClose(&s2);
+      return ImageStreamNEG(s1);
+    case 1:
+      return ImageStreamAND(s1, s2);
+    case 2:
+      return ImageStreamOR(s1, s2);
+    case 3:
+      return ImageStreamXOR(s1, s2);
+    case 4:
+      ImageStreamClose(&s2);
+      return ImageStreamVerticalMirror(s1);
+    default:
+      return ImageStreamVerticalMirror(
+          ImageStreamXOR(ImageStreamNEG(s1), s2));
+  }
+}
+
+// The k-th stream operation, computed in memory
+static Image ImageOp(int k, const Image img1, const Image img2) {
+  switch (k) {
+    case 0:
+      return ImageNEG(img1);
+    case 1:
+      return ImageAND(img1, img2);
+    case 2:
+      return ImageOR(img1, img2);
+    case 3:
+      return ImageXOR(img1, img2);
+    case 4:
+      return ImageVerticalMirror(img1);
+    default: {
+      Image neg = ImageNEG(img1);
+      Image xor = ImageXOR(neg, img2);
+      Image result = ImageVerticalMirror(xor);
+      ImageDestroy(&neg);
+      ImageDestroy(&xor);
+      return result;
+    }
+  }
+}
+
+// Stream operations, from images and from files, saved and loaded back,
+// give the same images as the operations in memory.
+// When skip > 0, the first skip rows are read before saving the rest.
+static void TestStreamOps(const Pixels* p1, const Pixels* p2, uint32 skip) {
+  Image a = ImageOfPixels(p1);
+  Image b = ImageOfPixels(p2);
+  char name1[32], name2[32], out[32];
+  TempName(name1);
+  TempName(name2);
+  TempName(out);
+  assert(ImageSave(a, name1) && ImageSave(b, name2));
+
+  for (int e = 0; e < NUM_ENCODINGS; e++) {
+    Image a1 = CopyInEncoding(a, encodings[e]);
+    Image b1 = CopyInEncoding(b, encodings[(e + 1) % NUM_ENCODINGS]);
+    for (int k = 0; k < NUM_STREAM_OPS; k++) {
+      Image expected = ImageOp(k, a1, b1);
+      Image rest = ImageCrop(expected, 0, skip, p1->width, p1->height - skip);
+      for (int from_file = 0; from_file <= 1; from_file++) {
+        ImageStream s1 = from_file ? ImageStreamOpen(name1) : ImageStreamOf(a1);
+        ImageStream s2 = from_file ? ImageStreamOpen(name2) : ImageStreamOf(b1);
+        assert(s1 != NULL && s2 != NULL);
+        ImageStream t = StreamOp(k, s1, s2);
+        assert((uint32)ImageStreamWidth(t) == p1->width);
+        assert((uint32)ImageStreamHeight(t) == p1->height);
+        for (uint32 i = 0; i < skip; i++) assert(ImageStreamNextRow(t));
+        assert(ImageStreamSave(t, out));
+        assert(ImageStreamNextRow(t) == NULL);
+        ImageStreamClose(&t);
+        assert(t == NULL);
+
+        Image result = ImageLoad(out);
+        assert(result != NULL);
+        CheckSame(result, rest, "Stream", encodings[e], from_file);
+        ImageDestroy(&result);
+      }
+      ImageDestroy(&rest);
+      ImageDestroy(&expected);
+    }
+    ImageDestroy(&a1);
+    ImageDestroy(&b1);
+  }
+  unlink(name1);
+  unlink(name2);
+  unlink(out);
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// Streams of files that end too soon fail, and so do the streams using
+// them, and the streams of operands of different sizes are rejected
+static void TestStreamErrors(void) {
+  Pixels p = RandomPixels(70, 5, 4);
+  Image img = ImageOfPixels(&p);
+  char name[32], out[32];
+  TempName(name);
+  TempName(out);
+  assert(ImageSave(img, name));
+
+  // Drop the last bytes of the last row
+  FILE* f = fopen(name, "rb");
+  assert(f != NULL);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  assert(truncate(name, size - 3) == 0);
+
+  ImageStream s = ImageStreamOpen(name);
+  assert(s != NULL);
+  for (int i = 0; i < 4; i++) assert(ImageStreamNextRow(s) != NULL);
+  assert(ImageStreamNextRow(s) == NULL);
+  assert(ImageErrMsg() != NULL);
+  ImageStreamClose(&s);
+
+  s = ImageStreamAND(ImageStreamNEG(ImageStreamOpen(name)),
+                     ImageStreamOf(img));
+  assert(!ImageStreamSave(s, out));
+  ImageStreamClose(&s);
+
+  // An empty file, and a missing one
+  assert(truncate(name, 0) == 0);
+  assert(ImageStreamOpen(name) == NULL);
+  unlink(name);
+  assert(ImageStreamOpen(name) == NULL);
+  assert(errno == ENOENT);
+  unlink(out);
+
+  // Operands of different sizes break a requirement: the process aborts
+  Image wider = ImageCreate(71, 5, WHITE);
+  Image taller = ImageCreate(70, 6, WHITE);
+  Image* others[] = {&wider, &taller};
+  for (int k = 0; k < 2; k++) {
+    fflush(NULL);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      freopen("/dev/null", "w", stderr);
+      ImageStream t = ImageStreamOR(ImageStreamOf(img),
+                                    ImageStreamOf(*others[k]));
+      ImageStreamClose(&t);
+      _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  }
+  ImageDestroy(&wider);
+  ImageDestroy(&taller);
+  ImageDestroy(&img);
+  FreePixels(&p);
+  printf("TestStreamErrors OK\n");
+}
+
+static void TestStreams(void) {
+  static const uint32 widths[] = {1, 7, 64, 65, 130};
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+    Pixels p1 = RandomPixels(widths[i], 9, 3);
+    Pixels p2 = RandomPixels(widths[i], 9, 5);
+    TestStreamOps(&p1, &p2, 0);
+    TestStreamOps(&p1, &p2, 4);
+    FreePixels(&p1);
+    FreePixels(&p2);
+  }
+  // Rows longer than the read buffer of file streams
+  Pixels p1 = RandomPixels(600000, 2, 5000);
+  Pixels p2 = RandomPixels(600000, 2, 5000);
+  TestStreamOps(&p1, &p2, 1);
+  FreePixels(&p1);
+  FreePixels(&p2);
+  printf("TestStreams OK\n");
+}
+
+// The regions passed to the instrumentation callback, in order
+typedef struct {
+  int num;
+  InstrRegion regions[16];
+} RegionLog;
+
+static void LogRegion(const InstrRegion* region, void* ctx) {
+  RegionLog* log = ctx;
+  assert(log->num < 16);
+  log->regions[log->num++] = *region;
+}
+
+// The region named name in log (the last one, if there are several)
+static const InstrRegion* FindRegion(const RegionLog* log, const char* name) {
+  for (int k = log->num - 1; k >= 0; k--) {
+    if (strcmp(log->regions[k].name, name) == 0) return &log->regions[k];
+  }
+  return NULL;
+}
+
+// Regions: nesting, counts of the pool workers, and their export
+static void TestInstrumentation(void) {
+  RegionLog log = {0};
+  InstrSetCallback(LogRegion, &log);
+
+  // Inner regions end, and are reported, before the outer ones
+  InstrBegin("outer");
+  InstrBegin("inner");
+  InstrBegin("innermost");
+  InstrEnd();
+  InstrEnd();
+  InstrBegin("sibling");
+  InstrEnd();
+  InstrEnd();
+  static const char* names[] = {"innermost", "inner", "sibling", "outer"};
+  static const int depths[] = {2, 1, 1, 0};
+  assert(log.num == 4);
+  for (int k = 0; k < 4; k++) {
+    assert(strcmp(log.regions[k].name, names[k]) == 0);
+    assert(log.regions[k].depth == depths[k]);
+  }
+  assert(log.regions[3].wall_ns >= log.regions[1].wall_ns);
+
+  // The operations counted by the pool workers are moved to the caller,
+  // so that its regions count the same as with a single thread
+  Image a = ImageCreateChessboard(4096, 1024, 4, BLACK);
+  Image b = ImageCreateChessboard(4096, 1024, 8, WHITE);
+  ImageSetEncoding(a, IMAGE_BITMAP);
+  ImageSetEncoding(b, IMAGE_BITMAP);
+  unsigned long counts[2][NUMCOUNTERS];
+  for (int t = 0; t < 2; t++) {
+    ImageSetThreads(t == 0 ? 1 : 4);
+    unsigned long before[NUMCOUNTERS], after[NUMCOUNTERS];
+    log.num = 0;
+    InstrRead(before);
+    InstrBegin("outer");
+    Image result = ImageAND(a, b);
+    InstrEnd();
+    InstrRead(after);
+    ImageDestroy(&result);
+
+    const InstrRegion* op = FindRegion(&log, "ImageAND");
+    const InstrRegion* outer = FindRegion(&log, "outer");
+    assert(op != NULL && outer != NULL && op < outer);
+    assert(op->depth == 1 && outer->depth == 0);
+    assert(op->counts[0] >= 4096 / 64 * 1024);
+    for (int k = 0; k < NUMCOUNTERS; k++) {
+      assert(op->counts[k] <= outer->counts[k]);
+      assert(after[k] - before[k] == outer->counts[k]);
+      counts[t][k] = op->counts[k];
+    }
+  }
+  assert(memcmp(counts[0], counts[1], sizeof(counts[0])) == 0);
+  ImageSetThreads(1);
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+  InstrSetCallback(NULL, NULL);
+
+  // Export, with names to escape
+  InstrName[2] = "x,\"y";
+  InstrRegion r = {"a\"b,c", 1, 2, 3, {4, 5, 6}, 0, {0}};
+  char buf[256];
+  const char* json =
+      "{\"region\":\"a\\\"b,c\",\"depth\":1,\"wall_ns\":2,\"cpu_ns\":3,"
+      "\"counters\":{\"pixmem\":4,\"runmem\":5,\"x,\\\"y\":6}}";
+  assert(InstrRegionJSON(&r, buf, sizeof(buf)) == (int)strlen(json));
+  assert(strcmp(buf, json) == 0);
+  const char* csv = "\"a\"\"b,c\",1,2,3,4,5,6,,,,,";
+  assert(InstrRegionCSV(&r, buf, sizeof(buf)) == (int)strlen(csv));
+  assert(strcmp(buf, csv) == 0);
+  const char* header =
+      "region,depth,wall_ns,cpu_ns,pixmem,runmem,\"x,\"\"y\",cycles,"
+      "instructions,L1d-misses,LLC-misses,branch-misses";
+  assert(InstrRegionCSVHeader(buf, sizeof(buf)) == (int)strlen(header));
+  assert(strcmp(buf, header) == 0);
+  r.perf_mask = 1u << 1;
+  r.perf[1] = 7;
+  assert(InstrRegionCSV(&r, buf, sizeof(buf)) == (int)strlen(csv) + 1);
+  assert(strcmp(buf, "\"a\"\"b,c\",1,2,3,4,5,6,,7,,,") == 0);
+  const char* perf = ",\"perf\":{\"instructions\":7}}";
+  int len = InstrRegionJSON(&r, buf, sizeof(buf));
+  assert(len == (int)(strlen(json) + strlen(perf)) - 1);
+  assert(strcmp(buf + len - strlen(perf), perf) == 0);
+
+  // Too small buffers get what fits, and the whole length is returned
+  r.perf_mask = 0;
+  memset(buf, '*', sizeof(buf));
+  assert(InstrRegionJSON(&r, buf, 10) == (int)strlen(json));
+  assert(strncmp(buf, json, 9) == 0 && buf[9] == '\0' && buf[10] == '*');
+  assert(InstrRegionCSV(&r, buf, 1) == (int)strlen(csv) && buf[0] == '\0');
+  assert(InstrRegionCSV(&r, NULL, 0) == (int)strlen(csv));
+  InstrName[2] = NULL;
+  printf("TestInstrumentation OK\n");
+}
+
+// Read the lines of a file (at most 8) into lines, and count them
+static int ReadLines(const char* name, char lines[8][512]) {
+  FILE* f = fopen(name, "r");
+  if (f == NULL) return 0;
+  int n = 0;
+  while (n < 8 && fgets(lines[n], sizeof(lines[n]), f) != NULL) n++;
+  fclose(f);
+  return n;
+}
+
+// The CTU cache file: lines of other CPU models are kept, the line of the
+// running one is read, added or replaced, and the default directory is
+// created
+static void TestCTUCache(void) {
+  char* saved_cache = getenv("INSTR_CTU_CACHE");
+  char* saved_home = getenv("HOME");
+  saved_cache = saved_cache != NULL ? strdup(saved_cache) : NULL;
+  saved_home = saved_home != NULL ? strdup(saved_home) : NULL;
+  char name[32], lines[8][512];
+  TempName(name);
+  setenv("INSTR_CTU_CACHE", name, 1);
+
+  // Added after the lines of other models
+  FILE* f = fopen(name, "w");
+  assert(f != NULL);
+  fputs("0.5 Other CPU\n", f);
+  fclose(f);
+  InstrCTU = 0.0;
+  double ctu = InstrGetCTU();
+  assert(ctu > 0.0);
+  assert(ReadLines(name, lines) == 2);
+  assert(strcmp(lines[0], "0.5 Other CPU\n") == 0);
+  char line[512];
+  int len = snprintf(line, sizeof(line), "%.9g ", ctu);
+  assert(strncmp(lines[1], line, len) == 0);
+  snprintf(line, sizeof(line), "%s", lines[1] + len);
+  line[strcspn(line, "\n")] = '\0';  // The model of the running CPU
+
+  // Read, and only for the same model (not one that begins with it)
+  f = fopen(name, "w");
+  assert(f != NULL);
+  fprintf(f, "0.5 Other CPU\n3 %sx\n1.5 %s\n", line, line);
+  fclose(f);
+  InstrCTU = 0.0;
+  assert(InstrGetCTU() == 1.5);
+  assert(InstrGetCTU() == 1.5);  // Not read again
+
+  // Replaced
+  InstrCalibrateQuick();
+  assert(InstrCTU > 0.0);
+  assert(ReadLines(name, lines) == 3);
+  assert(strcmp(lines[0], "0.5 Other CPU\n") == 0);
+  assert(strtod(lines[1], NULL) == 3.0);
+  assert(strtod(lines[2], NULL) != 1.5);
+  assert(strncmp(strchr(lines[2], ' ') + 1, line, strlen(line)) == 0);
+  unlink(name);
+
+  // Disabled
+  setenv("INSTR_CTU_CACHE", "", 1);
+  InstrCalibrateQuick();
+  assert(access(name, F_OK) != 0);
+
+  // In $HOME/.cache, created if missing
+  char home[] = "/tmp/imageBWTestXXXXXX";
+  assert(mkdtemp(home) != NULL);
+  unsetenv("INSTR_CTU_CACHE");
+  setenv("HOME", home, 1);
+  InstrCalibrateQuick();
+  char path[64];
+  snprintf(path, sizeof(path), "%s/.cache/instr_ctu", home);
+  assert(ReadLines(path, lines) == 1);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/.cache", home);
+  assert(rmdir(path) == 0);
+  assert(rmdir(home) == 0);
+
+  if (saved_cache != NULL) {
+    setenv("INSTR_CTU_CACHE", saved_cache, 1);
+  } else {
+    unsetenv("INSTR_CTU_CACHE");
+  }
+  if (saved_home != NULL) {
+    setenv("HOME", saved_home, 1);
+  } else {
+    unsetenv("HOME");
+  }
+  free(saved_cache);
+  free(saved_home);
+  printf("TestCTUCache OK\n");
+}
+
+// Pixels, statistics and digests read by several threads at once, from a
+// fresh image
+typedef struct {
+  Image img;
+  Image equal;  // An image with the same pixels
+  const Pixels* pixels;
+  uint32 seed;
+} ReaderArgs;
+
+static void* ReadPixels(void* arg) {
+  ReaderArgs* args = arg;
+  const Pixels* p = args->pixels;
+  int n = 2000;
+  ImagePoint* points = malloc(n * sizeof(ImagePoint));
+  uint8* colors = malloc(n);
+  assert(points != NULL && colors != NULL);
+  for (int k = 0; k < n; k++) {
+    uint32 h = (args->seed + (uint32)k) * 2654435761u;
+    points[k].x = h % p->width;
+    points[k].y = (h / p->width) % p->height;
+  }
+  uint64 black = 0;
+  uint32 row0 = 0;
+  for (size_t k = 0; k < (size_t)p->width * p->height; k++) {
+    black += p->pixel[k];
+    if (k < p->width) row0 += p->pixel[k];
+  }
+  assert(ImageCountBlack(args->img) == black);
+  uint32* counts = malloc(p->height * sizeof(uint32));
+  assert(counts != NULL);
+  ImageRowCounts(args->img, counts);
+  assert(counts[0] == row0);
+  free(counts);
+  uint64* histogram = malloc((p->width + 1) * sizeof(uint64));
+  assert(histogram != NULL);
+  ImageRunLengthHistogram(args->img, BLACK, histogram);
+  uint64 total = 0;
+  for (uint32 len = 1; len <= p->width; len++) total += histogram[len] * len;
+  assert(total == black);
+  free(histogram);
+
+  // Comparisons while the digest is computed, and after
+  assert(ImageIsEqual(args->img, args->equal));
+  assert(ImageDigest(args->img) == ImageDigest(args->equal));
+  assert(ImageIsEqual(args->img, args->equal));
+
+  ImageGetPixels(args->img, points, n, colors);
+  for (int k = 0; k < n; k++) {
+    assert(colors[k] == PIXEL(*p, points[k].x, points[k].y));
+    assert(ImageGetPixel(args->img, points[k].x, points[k].y) == colors[k]);
+  }
+  free(points);
+  free(colors);
+  return NULL;
+}
+
+static void TestConcurrentReads(void) {
+  Pixels p = RandomPixels(301, 97, 5);
+  for (int e = 0; e < NUM_ENCODINGS; e++) {
+    for (int round = 0; round < 10; round++) {
+      Image rle = ImageOfPixels(&p);
+      ImageDigest(rle);
+      Image img = CopyInEncoding(rle, encodings[e]);
+      // Mirroring in place drops the cached row hashes
+      ImageVerticalMirrorInPlace(img);
+      ImageVerticalMirrorInPlace(img);
+      pthread_t threads[4];
+      ReaderArgs args[4];
+      for (int t = 0; t < 4; t++) {
+        args[t] = (ReaderArgs){img, rle, &p, (uint32)(round * 4 + t)};
+        int err = pthread_create(&threads[t], NULL, ReadPixels, &args[t]);
+        assert(err == 0);
+        (void)err;
+      }
+      for (int t = 0; t < 4; t++) pthread_join(threads[t], NULL);
+      ImageDestroy(&img);
+      ImageDestroy(&rle);
+    }
+  }
+  FreePixels(&p);
+  printf("TestConcurrentReads OK\n");
+}
+
+// An expression may be given as both operands of an operation
+static void TestExprSameOperands(void) {
+  Pixels p1 = RandomPixels(70, 9, 4);
+  Pixels p2 = RandomPixels(70, 9, 4);
+  Image a = ImageOfPixels(&p1);
+  Image b = ImageOfPixels(&p2);
+  Image white = ImageCreate(70, 9, WHITE);
+  Image black = ImageCreate(70, 9, BLACK);
+
+  ImageExpr e = ImageExprOf(a);
+  e = ImageExprAND(e, e);
+  e = ImageExprOR(e, e);
+  Image result = ImageExprEval(e);
+  assert(ImageIsEqual(result, a));
+  ImageDestroy(&result);
+
+  e = ImageExprXOR(e, e);
+  result = ImageExprEval(e);
+  assert(ImageIsEqual(result, white));
+  ImageDestroy(&result);
+
+  // (NEG (a XOR a)) AND b = b
+  e = ImageExprAND(ImageExprNEG(e), ImageExprOf(b));
+  result = ImageExprEval(e);
+  assert(ImageIsEqual(result, b));
+  ImageDestroy(&result);
+
+  // b XOR b, from distinct nodes, OR NEG (a XOR a)
+  ImageExprDestroy(&e);
+  ImageExpr x = ImageExprXOR(ImageExprOf(b), ImageExprOf(b));
+  ImageExpr y = ImageExprOf(a);
+  e = ImageExprOR(x, ImageExprNEG(ImageExprXOR(y, y)));
+  result = ImageExprEval(e);
+  assert(ImageIsEqual(result, black));
+  ImageDestroy(&result);
+  ImageExprDestroy(&e);
+  assert(e == NULL);
+
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+  ImageDestroy(&white);
+  ImageDestroy(&black);
+  FreePixels(&p1);
+  FreePixels(&p2);
+  printf("TestExprSameOperands OK\n");
+}
+
+// Statistics of images with no BLACK pixels, or a single one, at a corner
+static void TestStatistics(void) {
+  static const uint32 sizes[][2] = {{1, 1}, {64, 3}, {65, 7}, {200, 2}};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint32 w = sizes[i][0];
+    uint32 h = sizes[i][1];
+    Pixels p = NewPixels(w, h);
+    uint32 corners[][2] = {{0, 0}, {w - 1, 0}, {0, h - 1}, {w - 1, h - 1}};
+    for (int c = -1; c < 4; c++) {
+      if (c >= 0) PIXEL(p, corners[c][0], corners[c][1]) = BLACK;
+      Image img = ImageOfPixels(&p);
+      for (int e = 0; e < NUM_ENCODINGS; e++) {
+        Image copy = CopyInEncoding(img, encodings[e]);
+        CheckStatistics(copy, &p);
+        ImageDestroy(&copy);
+      }
+      ImageDestroy(&img);
+      if (c >= 0) PIXEL(p, corners[c][0], corners[c][1]) = WHITE;
+    }
+    FreePixels(&p);
+  }
+  printf("TestStatistics OK\n");
+}
+
+// Check the crop of the window (x, y, w, h) of img, whose pixels are p
+static void CheckCrop(const Image img, const Pixels* p, uint32 x, uint32 y,
+                      uint32 w, uint32 h) {
+  Pixels q = NewPixels(w, h);
+  for (uint32 j = 0; j < h; j++) {
+    memcpy(&PIXEL(q, 0, j), &PIXEL(*p, x, y + j), w);
+  }
+  Image crop = ImageCrop(img, x, y, w, h);
+  CheckPixels(crop, &q);
+  assert(ImageEncoding(crop) ==
+         (ImageEncoding(img) == IMAGE_BITMAP ? IMAGE_BITMAP : IMAGE_RLE));
+  ImageDestroy(&crop);
+  FreePixels(&q);
+}
+
+// Crops of windows at the edges of the image, of words and of runs
+static void TestCrop(const Pixels* p) {
+  uint32 w = p->width;
+  uint32 h = p->height;
+  // Windows (x, y, width, height), where they fit
+  uint32 windows[][4] = {
+      {0, 0, 1, 1},          {w - 1, h - 1, 1, 1}, {w / 2, h / 2, 1, 1},
+      {0, 0, w, h},          {w / 3, h / 3, w - w / 3, h - h / 3},
+      {w - 1, 0, 1, h},      {0, h - 1, w, 1},     {63, 0, 1, h},
+      {64, 0, 1, h},         {63, 0, 2, 1},        {63, 0, w - 63, h},
+      {64, 0, w - 64, h},    {63, h / 2, 64, 1},   {64, 0, 64, h},
+      {1, 0, 63, h},         {1, 0, 127, h},       {0, 0, 64, h},
+  };
+  for (int e = 0; e < NUM_ENCODINGS; e++) {
+    Image img = ImageOfPixels(p);
+    ImageSetEncoding(img, encodings[e]);
+    for (size_t k = 0; k < sizeof(windows) / sizeof(windows[0]); k++) {
+      uint32* win = windows[k];
+      if (win[0] < w && win[2] > 0 && win[2] <= w - win[0] &&
+          win[1] < h && win[3] > 0 && win[3] <= h - win[1]) {
+        CheckCrop(img, p, win[0], win[1], win[2], win[3]);
+      }
+    }
+    // Strictly inside runs: from the second pixel of a run to the one
+    // before the last, and a single pixel inside a run
+    for (uint32 y = 0; y < h; y++) {
+      uint32 start = 0;
+      for (uint32 x = 1; x <= w; x++) {
+        if (x < w && PIXEL(*p, x, y) == PIXEL(*p, start, y)) continue;
+        if (x - start >= 3) {
+          CheckCrop(img, p, start + 1, y, x - start - 2, 1);
+          CheckCrop(img, p, start + 1, y, 1, h - y);
+        }
+        start = x;
+      }
+    }
+    ImageDestroy(&img);
+  }
+}
+
+static void TestAllCrops(void) {
+  static const uint32 widths[] = {1, 2, 63, 64, 65, 127, 128, 130, 200};
+  static const uint32 means[] = {1, 3, 40};
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+    for (size_t k = 0; k < sizeof(means) / sizeof(means[0]); k++) {
+      Pixels p = RandomPixels(widths[i], 5, means[k]);
+      TestCrop(&p);
+      FreePixels(&p);
+    }
+  }
+  printf("TestAllCrops OK\n");
+}
+
+// The n-ary operations, with operands in every mix of encodings, give the
+// same pixels, in IMAGE_BITMAP when an operand is, and in IMAGE_RLE
+// otherwise
+static void TestNaryEncodings(void) {
+  static const int sizes[] = {1, 2, 5};
+  Image imgs[5];
+  for (int j = 0; j < 5; j++) {
+    Pixels p = RandomPixels(70, 6, 2 + j);
+    imgs[j] = ImageOfPixels(&p);
+    FreePixels(&p);
+  }
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    int n = sizes[i];
+    Image expected[4] = {ImageANDn(imgs, n), ImageORn(imgs, n),
+                         ImageXORn(imgs, n), ImageAtLeast(imgs, n, 2)};
+    int num_mixes = 1;
+    for (int j = 0; j < n; j++) num_mixes *= NUM_ENCODINGS;
+    for (int mix = 0; mix < num_mixes; mix++) {
+      Image copies[5];
+      int any_bitmap = 0;
+      for (int j = 0, m = mix; j < n; j++, m /= NUM_ENCODINGS) {
+        copies[j] = CopyInEncoding(imgs[j], encodings[m % NUM_ENCODINGS]);
+        any_bitmap |= encodings[m % NUM_ENCODINGS] == IMAGE_BITMAP;
+      }
+      Image results[4] = {ImageANDn(copies, n), ImageORn(copies, n),
+                          ImageXORn(copies, n), ImageAtLeast(copies, n, 2)};
+      for (int k = 0; k < 4; k++) {
+        CheckSame(results[k], expected[k], "Nary", n, mix);
+        assert(ImageEncoding(results[k]) ==
+               (any_bitmap ? IMAGE_BITMAP : IMAGE_RLE));
+        ImageDestroy(&results[k]);
+      }
+      for (int j = 0; j < n; j++) ImageDestroy(&copies[j]);
+    }
+    for (int k = 0; k < 4; k++) ImageDestroy(&expected[k]);
+  }
+  for (int j = 0; j < 5; j++) ImageDestroy(&imgs[j]);
+  printf("TestNaryEncodings OK\n");
+}
+
+static void TestAllEncodings(void) {
+  static const uint32 widths[] = {1, 7, 63, 64, 65, 130};
+  static const uint32 heights[] = {1, 6, 33};
+  static const uint32 means[] = {1, 3, 40};
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+    for (size_t j = 0; j < sizeof(heights) / sizeof(heights[0]); j++) {
+      for (size_t k = 0; k < sizeof(means) / sizeof(means[0]); k++) {
+        Pixels p1 = RandomPixels(widths[i], heights[j], means[k]);
+        Pixels p2 = RandomPixels(widths[i], heights[j], means[k]);
+        TestEncodings(&p1, &p2);
+        FreePixels(&p1);
+        FreePixels(&p2);
+      }
+    }
+  }
+
+  // Long runs: 2-byte and 3-byte packed codes
+  Pixels p1 = RandomPixels(1000, 9, 300);
+  Pixels p2 = RandomPixels(1000, 9, 300);
+  TestEncodings(&p1, &p2);
+  FreePixels(&p1);
+  FreePixels(&p2);
+  p1 = RandomPixels(50001, 4, 20000);
+  p2 = RandomPixels(50001, 4, 20000);
+  TestEncodings(&p1, &p2);
+  FreePixels(&p1);
+  FreePixels(&p2);
+  p1 = LongRunPixels();
+  p2 = RandomPixels(p1.width, p1.height, 10000);
+  TestEncodings(&p1, &p2);
+  FreePixels(&p1);
+  FreePixels(&p2);
+  printf("TestAllEncodings OK\n");
+}
+
 int main(int argc, char* argv[]) {
   // To initalize operation counters
   ImageInit();
@@ -59,6 +1649,9 @@ int main(int argc, char* argv[]) {
     Image image_and_2 = ImageCreate(i, i, BLACK);
     printf("Size: %dx%d\n", i,i);
     Image AND = ImageAND(image_and_1,image_and_2);
+    ImageDestroy(&image_and_1);
+    ImageDestroy(&image_and_2);
+    ImageDestroy(&AND);
   }
 
   printf("image_1 AND image_1\n");
@@ -132,8 +1725,33 @@ int main(int argc, char* argv[]) {
   // ImageDestroy(&image_9);
   ImageDestroy(&image_10);
   ImageDestroy(&image_11);
+  ImageDestroy(&image_12);
+  ImageDestroy(&image_cb);
+  ImageDestroy(&image_cb_1);
+  ImageDestroy(&image_cb_2);
 
-
+  // Self-checking tests, with one thread and with several
+  for (int threads = 1; threads <= 4; threads += 3) {
+    ImageSetThreads(threads);
+    TestAllEncodings();
+    TestStatistics();
+    TestNaryEncodings();
+    TestAllCrops();
+    TestPackedSharedRows();
+    TestChooseEncoding();
+    TestExprSameOperands();
+    TestAllRotations();
+    TestAllMorphology();
+    TestComponents();
+    TestAllDownsample();
+  }
+  TestConcurrentReads();
+  TestStreamLongHeader();
+  TestStreams();
+  TestStreamErrors();
+  TestInstrumentation();
+  TestCTUCache();
+  ImageSetThreads(1);
 
   return 0;
 }
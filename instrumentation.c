@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: to measure CTU now (else see InstrGetCTU)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -20,8 +20,13 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +47,23 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+static unsigned long long clock_ns(clockid_t clock) {
+  struct timespec current_time;
+
+  if (clock_gettime(clock, &current_time) != 0)
+    return 0; // clock_gettime() failed!!!
+  return (unsigned long long)current_time.tv_sec * 1000000000ull +
+         (unsigned long long)current_time.tv_nsec;
+}
+
+unsigned long long InstrWallNs(void) {
+  return clock_ns(CLOCK_MONOTONIC);
+}
+
+unsigned long long InstrCpuNs(void) {
+  return clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
 #endif
 
 
@@ -66,6 +88,14 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+unsigned long long InstrWallNs(void) {
+  return (unsigned long long)(cpu_time() * 1.0e9);
+}
+
+unsigned long long InstrCpuNs(void) {
+  return (unsigned long long)(cpu_time() * 1.0e9);
+}
+
 #endif
 
 /// Array of operation counters:
@@ -79,32 +109,351 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
-double InstrCTU = 1.0;  ///extern
+/// Calibrated Time Unit (in seconds, 0 until calibrated)
+double InstrCTU = 0.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+// Protects the calibration and the cache file
+static pthread_mutex_t ctu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of iterations of the calibration loop that make up a CTU
+#define CTU_ITERATIONS 40000000
+
+// Run and time n iterations of the calibration loop.
+static double CalibrationLoop(int n) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
-  int array[size];  // alloc array in stack, not initialized on purpose
+  unsigned int array[size];  // alloc array in stack
+  memset(array, 0, sizeof(array));
   double time = cpu_time();
   srand((unsigned int)(time*1e9));
-  for (int n = 0; n < 40000000; n++) {
+  for (int m = 0; m < n; m++) {
     int i = rand() & mask;
     int j = rand() & mask;
     int k = rand() & mask;
-    array[k] ^= array[i] + array[j] + i*j;
+    array[k] ^= array[i] + array[j] + (unsigned int)(i*j);
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
+  time = cpu_time() - time;
+  // Use the array, so that the loop is not optimized away
+  volatile unsigned int sink = array[rand() & mask];
+  (void)sink;
+  return time;
+}
+
+// Name of the CPU model, to key the cache ("unknown" if not found)
+static void CPUModel(char* model, size_t size) {
+  snprintf(model, size, "unknown");
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* value = strchr(line, ':');
+    if (strncmp(line, "model name", 10) != 0 || value == NULL) continue;
+    value += strspn(value, ": \t");
+    value[strcspn(value, "\n")] = '\0';
+    snprintf(model, size, "%s", value);
+    break;
+  }
+  fclose(f);
+}
+
+// Name of the cache file, or NULL if disabled
+static const char* CacheFile(char* path, size_t size) {
+  const char* name = getenv("INSTR_CTU_CACHE");
+  if (name != NULL) return name[0] != '\0' ? name : NULL;
+  const char* home = getenv("HOME");
+  if (home == NULL || home[0] == '\0') return NULL;
+  snprintf(path, size, "%s/.cache/instr_ctu", home);
+  return path;
+}
+
+// Create the directory of file, if missing (only the last level)
+static void MakeFileDir(const char* file) {
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", file);
+  char* slash = strrchr(dir, '/');
+  if (slash == NULL || slash == dir) return;
+  *slash = '\0';
+  mkdir(dir, 0700);  // Fails if it exists
+}
+
+// The cache file has a line "ctu model" for each CPU model.
+// Returns the CTU of the running CPU in the cache, or 0.
+static double ReadCachedCTU(void) {
+  char path[1024], model[256], line[512];
+  const char* file = CacheFile(path, sizeof(path));
+  if (file == NULL) return 0.0;
+  FILE* f = fopen(file, "r");
+  if (f == NULL) return 0.0;
+  CPUModel(model, sizeof(model));
+  double ctu = 0.0;
+  while (ctu == 0.0 && fgets(line, sizeof(line), f) != NULL) {
+    char* end;
+    double value = strtod(line, &end);
+    end[strcspn(end, "\n")] = '\0';
+    if (value > 0.0 && *end == ' ' && strcmp(end + 1, model) == 0)
+      ctu = value;
+  }
+  fclose(f);
+  return ctu;
+}
+
+// Save the CTU of the running CPU in the cache file (if possible).
+// The file is rewritten through a temporary file and renamed, so that
+// concurrent processes never read half a file.
+static void WriteCachedCTU(double ctu) {
+  char path[1024], tmp[1100], model[256], line[512];
+  const char* file = CacheFile(path, sizeof(path));
+  if (file == NULL) return;
+  CPUModel(model, sizeof(model));
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", file, (long)getpid());
+  MakeFileDir(file);
+  FILE* out = fopen(tmp, "w");
+  if (out == NULL) return;
+  // Keep the lines of other CPU models
+  FILE* in = fopen(file, "r");
+  if (in != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      const char* name = strchr(line, ' ');
+      if (name != NULL && strncmp(name + 1, model, strlen(model)) == 0 &&
+          (name[1 + strlen(model)] == '\n' || name[1 + strlen(model)] == '\0'))
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%.9g %s\n", ctu, model);
+  if (fclose(out) != 0 || rename(tmp, file) != 0) remove(tmp);
+}
+
+/// Find the Calibrated Time Unit (CTU).
+/// Run and time a loop of basic memory and arithmetic operations to set
+/// a reasonably cpu-independent time unit.
+void InstrCalibrate(void) { ///
+  pthread_mutex_lock(&ctu_mutex);
+  InstrCTU = CalibrationLoop(CTU_ITERATIONS);
+  WriteCachedCTU(InstrCTU);
+  pthread_mutex_unlock(&ctu_mutex);
+}
+
+// Quick calibration: the fastest of a few runs of 1/100 of the loop
+#define QUICK_RUNS 5
+#define QUICK_SCALE 100
+
+static double QuickCTU(void) {
+  double best = 0.0;
+  for (int r = 0; r < QUICK_RUNS; r++) {
+    double time = CalibrationLoop(CTU_ITERATIONS / QUICK_SCALE);
+    if (r == 0 || time < best) best = time;
+  }
+  return best * QUICK_SCALE;
+}
+
+void InstrCalibrateQuick(void) { ///
+  pthread_mutex_lock(&ctu_mutex);
+  InstrCTU = QuickCTU();
+  WriteCachedCTU(InstrCTU);
+  pthread_mutex_unlock(&ctu_mutex);
+}
+
+double InstrGetCTU(void) { ///
+  pthread_mutex_lock(&ctu_mutex);
+  if (InstrCTU <= 0.0) {
+    InstrCTU = ReadCachedCTU();
+    if (InstrCTU <= 0.0) {
+      InstrCTU = QuickCTU();
+      WriteCachedCTU(InstrCTU);
+    }
+  }
+  double ctu = InstrCTU;
+  pthread_mutex_unlock(&ctu_mutex);
+  return ctu;
+}
+
+// Counters of one thread.
+// Blocks are never freed: when a thread ends, its counts remain (they are
+// still added up on read) and the block is reused by a new thread.
+typedef struct ThreadCounters {
+  unsigned long count[NUMCOUNTERS];
+  int in_use;  // The block belongs to a running thread
+  struct ThreadCounters* next;
+} ThreadCounters;
+
+// All the blocks, protected by threads_mutex
+static ThreadCounters* threads = NULL;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+// To release the block of a thread when it ends
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local ThreadCounters* thread_counters = NULL;
+
+static void ReleaseThreadCounters(void* block) {
+  pthread_mutex_lock(&threads_mutex);
+  ((ThreadCounters*)block)->in_use = 0;
+  pthread_mutex_unlock(&threads_mutex);
+}
+
+static void CreateThreadKey(void) {
+  int ok = pthread_key_create(&thread_key, ReleaseThreadCounters) == 0;
+  assert(ok);
+  (void)ok;
+}
+
+unsigned long* InstrThreadCounters(void) { ///
+  if (thread_counters == NULL) {
+    pthread_once(&thread_key_once, CreateThreadKey);
+    pthread_mutex_lock(&threads_mutex);
+    ThreadCounters* block = threads;
+    while (block != NULL && block->in_use) block = block->next;
+    if (block == NULL) {
+      block = calloc(1, sizeof(ThreadCounters));
+      assert(block != NULL);
+      block->next = threads;
+      threads = block;
+    }
+    block->in_use = 1;
+    pthread_mutex_unlock(&threads_mutex);
+    pthread_setspecific(thread_key, block);
+    thread_counters = block;
+  }
+  return thread_counters->count;
+}
+
+/// Read the counters: InstrCount plus the counters of all threads.
+void InstrRead(unsigned long counts[NUMCOUNTERS]) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    counts[i] = InstrCount[i];
+  pthread_mutex_lock(&threads_mutex);
+  for (ThreadCounters* block = threads; block != NULL; block = block->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      counts[i] += block->count[i];
+  pthread_mutex_unlock(&threads_mutex);
+}
+
+// Hardware performance counters
+
+const char* const InstrPerfName[INSTR_PERF_EVENTS] = {  ///extern
+    "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses"};
+
+// The counters of a thread: one file descriptor per event (-1 if not
+// available), all in the group of the first one available
+static _Thread_local int perf_fd[INSTR_PERF_EVENTS];
+static _Thread_local int perf_open = 0;
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static int OpenEvent(int e, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  switch (e) {
+    case 0: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+    case 1: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+    case 2:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D |
+                     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case 3: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+    case 4: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+  }
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = 1;  // Allowed with perf_event_paranoid <= 2
+  attr.exclude_hv = 1;
+  attr.disabled = group_fd == -1;  // The group starts when complete
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+int InstrPerfOpen(void) { ///
+  if (perf_open) return __builtin_popcount(InstrPerfMask());
+  int leader = -1;
+  int n = 0;
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++) {
+    perf_fd[e] = OpenEvent(e, leader);
+    if (perf_fd[e] < 0) {
+      perf_fd[e] = -1;
+      continue;
+    }
+    if (leader == -1) leader = perf_fd[e];
+    n++;
+  }
+  if (leader != -1)
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  perf_open = 1;
+  return n;
+}
+
+void InstrPerfClose(void) { ///
+  if (!perf_open) return;
+  // Members first, the leader last
+  for (int e = INSTR_PERF_EVENTS - 1; e >= 0; e--)
+    if (perf_fd[e] >= 0) close(perf_fd[e]);
+  perf_open = 0;
+}
+
+unsigned InstrPerfRead(unsigned long long values[INSTR_PERF_EVENTS]) { ///
+  unsigned mask = 0;
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++) {
+    values[e] = 0;
+    unsigned long long data[3];  // value, time enabled, time running
+    if (!perf_open || perf_fd[e] < 0 ||
+        read(perf_fd[e], data, sizeof(data)) != (ssize_t)sizeof(data))
+      continue;
+    // Scale, if the events were multiplexed
+    values[e] = data[2] == 0 || data[2] == data[1]
+                    ? data[0]
+                    : (unsigned long long)((double)data[0] * data[1] / data[2]);
+    mask |= 1u << e;
+  }
+  return mask;
+}
+
+#else
+
+int InstrPerfOpen(void) { ///
+  perf_open = 0;
+  return 0;
+}
+
+void InstrPerfClose(void) { ///
 }
 
+unsigned InstrPerfRead(unsigned long long values[INSTR_PERF_EVENTS]) { ///
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++)
+    values[e] = 0;
+  return 0;
+}
+
+#endif
+
+unsigned InstrPerfMask(void) { ///
+  unsigned mask = 0;
+  for (int e = 0; perf_open && e < INSTR_PERF_EVENTS; e++)
+    if (perf_fd[e] >= 0) mask |= 1u << e;
+  return mask;
+}
+
+// Hardware counters read on previous reset (of the thread)
+static _Thread_local unsigned long long perf_reset[INSTR_PERF_EVENTS];
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  pthread_mutex_lock(&threads_mutex);
+  for (ThreadCounters* block = threads; block != NULL; block = block->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      block->count[i] = 0ul;
+  pthread_mutex_unlock(&threads_mutex);
+  InstrPerfRead(perf_reset);
   InstrTime = cpu_time();
 }
 
@@ -112,18 +461,231 @@ void InstrReset(void) { ///
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
-  // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  unsigned long count[NUMCOUNTERS];
+  InstrRead(count);
+  unsigned long long perf[INSTR_PERF_EVENTS];
+  unsigned mask = InstrPerfRead(perf);
+  // compute time in calibrated time units (may calibrate now):
+  double caltime = time / InstrGetCTU();
+  int ipc = (mask & 3) == 3;  // Both cycles and instructions
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++)
+    if (mask & (1u << e))
+      printf("\t%15.15s", InstrPerfName[e]);
+  if (ipc)
+    printf("\t%15.15s", "IPC");
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", count[i]);  
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++)
+    if (mask & (1u << e))
+      printf("\t%15llu", perf[e] - perf_reset[e]);
+  if (ipc) {
+    unsigned long long cycles = perf[0] - perf_reset[0];
+    printf("\t%15.3f", cycles == 0 ? 0.0 :
+           (double)(perf[1] - perf_reset[1]) / (double)cycles);
+  }
   puts("");
 }
 
+// Regions
+
+static InstrCallback region_callback = NULL;
+static void* region_ctx = NULL;
+
+// The open regions of a thread: start times and counts
+typedef struct {
+  const char* name;  // NULL if not measured
+  unsigned long long wall_ns;
+  unsigned long long cpu_ns;
+  unsigned long count[NUMCOUNTERS];
+  unsigned long long perf[INSTR_PERF_EVENTS];
+} OpenRegion;
+
+static _Thread_local OpenRegion open_regions[INSTR_MAX_DEPTH];
+static _Thread_local int region_depth = 0;
+
+// Counts of the calling thread, including the shared InstrCount
+static void ReadThreadCounts(unsigned long count[NUMCOUNTERS]) {
+  const unsigned long* mine = InstrThreadCounters();
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    count[i] = InstrCount[i] + mine[i];
+}
+
+void InstrSetCallback(InstrCallback callback, void* ctx) { ///
+  region_callback = callback;
+  region_ctx = ctx;
+}
+
+void InstrBegin(const char* name) { ///
+  int depth = region_depth++;
+  if (depth >= INSTR_MAX_DEPTH) return;
+  OpenRegion* r = &open_regions[depth];
+  r->name = NULL;
+  if (region_callback == NULL) return;
+  r->name = name;
+  ReadThreadCounts(r->count);
+  InstrPerfRead(r->perf);
+  r->cpu_ns = InstrCpuNs();
+  r->wall_ns = InstrWallNs();
+}
+
+void InstrEnd(void) { ///
+  assert(region_depth > 0);
+  if (region_depth == 0) return;  // Unbalanced, and assert disabled
+  int depth = --region_depth;
+  if (depth >= INSTR_MAX_DEPTH) return;
+  const OpenRegion* r = &open_regions[depth];
+  if (r->name == NULL || region_callback == NULL) return;
+
+  InstrRegion region;
+  region.wall_ns = InstrWallNs() - r->wall_ns;
+  region.cpu_ns = InstrCpuNs() - r->cpu_ns;
+  region.perf_mask = InstrPerfRead(region.perf);
+  region.name = r->name;
+  region.depth = depth;
+  ReadThreadCounts(region.counts);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    region.counts[i] -= r->count[i];
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++)
+    region.perf[e] -= r->perf[e];
+  region_callback(&region, region_ctx);
+}
+
+// Export
+
+// Appends formatted text to a buffer, keeping count of the whole length
+typedef struct {
+  char* buf;
+  size_t size;
+  int len;
+} Output;
+
+static void Put(Output* out, const char* text) {
+  for (; *text != '\0'; text++) {
+    if ((size_t)out->len + 1 < out->size) out->buf[out->len] = *text;
+    out->len++;
+  }
+  if (out->size > 0)
+    out->buf[(size_t)out->len < out->size ? (size_t)out->len : out->size - 1] = '\0';
+}
+
+static void PutNumber(Output* out, unsigned long long n) {
+  char digits[32];
+  snprintf(digits, sizeof(digits), "%llu", n);
+  Put(out, digits);
+}
+
+// Put a JSON string, escaping quotes, backslashes and control chars
+static void PutJSONString(Output* out, const char* s) {
+  Put(out, "\"");
+  for (; *s != '\0'; s++) {
+    char c[8] = {*s, '\0'};
+    if (*s == '"' || *s == '\\') {
+      c[0] = '\\';
+      c[1] = *s;
+      c[2] = '\0';
+    } else if ((unsigned char)*s < 0x20) {
+      snprintf(c, sizeof(c), "\\u%04x", (unsigned)(unsigned char)*s);
+    }
+    Put(out, c);
+  }
+  Put(out, "\"");
+}
+
+// Put a CSV field, quoted if needed
+static void PutCSVField(Output* out, const char* s) {
+  const char* p = s;
+  while (*p != '\0' && *p != ',' && *p != '"' && *p != '\n') p++;
+  if (*p == '\0') {
+    Put(out, s);
+    return;
+  }
+  Put(out, "\"");
+  for (; *s != '\0'; s++) {
+    char c[2] = {*s, '\0'};
+    if (*s == '"') Put(out, "\"");
+    Put(out, c);
+  }
+  Put(out, "\"");
+}
+
+int InstrRegionJSON(const InstrRegion* region, char* buf, size_t size) { ///
+  Output out = {buf, size, 0};
+  Put(&out, "{\"region\":");
+  PutJSONString(&out, region->name);
+  Put(&out, ",\"depth\":");
+  PutNumber(&out, (unsigned long long)region->depth);
+  Put(&out, ",\"wall_ns\":");
+  PutNumber(&out, region->wall_ns);
+  Put(&out, ",\"cpu_ns\":");
+  PutNumber(&out, region->cpu_ns);
+  Put(&out, ",\"counters\":{");
+  const char* sep = "";
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] == NULL) continue;
+    Put(&out, sep);
+    PutJSONString(&out, InstrName[i]);
+    Put(&out, ":");
+    PutNumber(&out, region->counts[i]);
+    sep = ",";
+  }
+  Put(&out, "}");
+  if (region->perf_mask != 0) {
+    Put(&out, ",\"perf\":{");
+    sep = "";
+    for (int e = 0; e < INSTR_PERF_EVENTS; e++) {
+      if (!(region->perf_mask & (1u << e))) continue;
+      Put(&out, sep);
+      PutJSONString(&out, InstrPerfName[e]);
+      Put(&out, ":");
+      PutNumber(&out, region->perf[e]);
+      sep = ",";
+    }
+    Put(&out, "}");
+  }
+  Put(&out, "}");
+  return out.len;
+}
+
+int InstrRegionCSVHeader(char* buf, size_t size) { ///
+  Output out = {buf, size, 0};
+  Put(&out, "region,depth,wall_ns,cpu_ns");
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] == NULL) continue;
+    Put(&out, ",");
+    PutCSVField(&out, InstrName[i]);
+  }
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++) {
+    Put(&out, ",");
+    Put(&out, InstrPerfName[e]);
+  }
+  return out.len;
+}
+
+int InstrRegionCSV(const InstrRegion* region, char* buf, size_t size) { ///
+  Output out = {buf, size, 0};
+  PutCSVField(&out, region->name);
+  Put(&out, ",");
+  PutNumber(&out, (unsigned long long)region->depth);
+  Put(&out, ",");
+  PutNumber(&out, region->wall_ns);
+  Put(&out, ",");
+  PutNumber(&out, region->cpu_ns);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] == NULL) continue;
+    Put(&out, ",");
+    PutNumber(&out, region->counts[i]);
+  }
+  for (int e = 0; e < INSTR_PERF_EVENTS; e++) {
+    Put(&out, ",");
+    if (region->perf_mask & (1u << e)) PutNumber(&out, region->perf[e]);
+  }
+  return out.len;
+}
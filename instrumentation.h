@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: to measure CTU now (else see InstrGetCTU)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,10 +18,33 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Code running in several threads should count in the counters of its
+/// own thread, which are added up when read:
+///
+/// unsigned long* count = InstrThreadCounters();
+/// count[0] += 3;
+/// ...
+/// unsigned long total[NUMCOUNTERS];
+/// InstrRead(total);  // InstrCount plus the counters of all threads
+///
+/// Named regions measure the time and the operations between
+/// InstrBegin(name) and InstrEnd(), and pass them to a callback:
+///
+/// InstrSetCallback(MyCallback, ctx);
+/// InstrBegin("phase1");
+///   InstrBegin("step");  // Regions nest
+///   ...
+///   InstrEnd();  // MyCallback(region "step", ctx)
+/// InstrEnd();  // MyCallback(region "phase1", ctx)
+///
+/// InstrRegionJSON and InstrRegionCSV format a region for export.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stddef.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
@@ -37,18 +60,129 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, 0 until calibrated)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// Takes about as long as the CTU itself.  The result is also saved in the
+/// cache file (see InstrGetCTU).
 void InstrCalibrate(void) ;
 
+/// Find the CTU quickly: time a few short runs of the same loop, and scale
+/// the fastest one.  Takes a few percent of InstrCalibrate's time, and
+/// varies less between runs.
+void InstrCalibrateQuick(void) ;
+
+/// Get the CTU, calibrating only when needed.
+/// If InstrCTU is not set yet, it is read from a cache file, keyed by the
+/// CPU model, or else measured with InstrCalibrateQuick and saved there.
+/// The cache file is named by the INSTR_CTU_CACHE environment variable
+/// (empty disables the cache), by default $HOME/.cache/instr_ctu.
+/// The directory of the file is created when missing.
+double InstrGetCTU(void) ;
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print time and all named counter values (added up for all threads).
 void InstrPrint(void) ;
 
+/// Counters of the calling thread
+/// (NUMCOUNTERS of them, registered on first use).
+/// Only the calling thread should update them.
+unsigned long* InstrThreadCounters(void) ;
+
+/// Read the counters: InstrCount plus the counters of all threads.
+/// Exact when no other thread is counting.
+void InstrRead(unsigned long counts[NUMCOUNTERS]) ;
+
+/// Wall-clock time in nanoseconds (since an arbitrary origin)
+unsigned long long InstrWallNs(void) ;
+
+/// Cpu time of the process in nanoseconds
+unsigned long long InstrCpuNs(void) ;
+
+/// Hardware performance counters (Linux perf_event_open).
+/// Each thread opens its own counters, which count in user space only.
+/// Where they are not available (other systems, no PMU, or not allowed by
+/// /proc/sys/kernel/perf_event_paranoid) nothing is counted, and the
+/// rest of the module works as usual.
+///
+/// InstrPerfOpen();  // Per thread
+/// InstrReset();
+/// ...
+/// InstrPrint();  // Adds the available events, and the IPC
+
+/// Number of hardware events
+#define INSTR_PERF_EVENTS 5
+
+/// Names of the hardware events:
+/// cycles, instructions, L1d-misses, LLC-misses, branch-misses
+extern const char* const InstrPerfName[INSTR_PERF_EVENTS];  ///extern
+
+/// Open the hardware counters of the calling thread (if not open yet).
+/// Returns the number of events available.
+int InstrPerfOpen(void) ;
+
+/// Close the hardware counters of the calling thread.
+void InstrPerfClose(void) ;
+
+/// Bit e is set if event e is counting in the calling thread.
+unsigned InstrPerfMask(void) ;
+
+/// Read the hardware counters of the calling thread, since they were
+/// opened (scaled, if the kernel had to multiplex them).
+/// Unavailable events read as 0.  Returns InstrPerfMask().
+unsigned InstrPerfRead(unsigned long long values[INSTR_PERF_EVENTS]) ;
+
+/// Maximum nesting depth of regions (deeper regions are not measured)
+#define INSTR_MAX_DEPTH 32
+
+/// The measurements of a region, from InstrBegin to InstrEnd
+typedef struct {
+  const char* name;
+  int depth;                  // Number of enclosing regions
+  unsigned long long wall_ns;  // Wall-clock time
+  unsigned long long cpu_ns;   // Cpu time of the process (all threads)
+  unsigned long counts[NUMCOUNTERS];  // Operations counted by the thread
+  unsigned perf_mask;  // The hardware events counted (see InstrPerfMask)
+  unsigned long long perf[INSTR_PERF_EVENTS];  // By the thread
+} InstrRegion;
+
+/// Function called at the end of each region, in the thread that ran it.
+typedef void (*InstrCallback)(const InstrRegion* region, void* ctx);
+
+/// Set the function called at the end of each region (NULL for none).
+/// Regions are only measured while a callback is set.
+/// Must not be called while other threads are in regions.
+void InstrSetCallback(InstrCallback callback, void* ctx) ;
+
+/// Begin a region of the calling thread.  name must remain valid until
+/// the region ends.
+void InstrBegin(const char* name) ;
+
+/// End the innermost region of the calling thread.
+/// Requires: the thread is in a region (else, with NDEBUG, it does nothing).
+void InstrEnd(void) ;
+
+/// Format region as a line of JSON, with the named counters only:
+/// {"region":"name","depth":0,"wall_ns":1,"cpu_ns":1,"counters":{...}}
+/// The hardware events counted are added as "perf":{"cycles":1,...}.
+/// Writes at most size chars (including the terminating NUL) to buf,
+/// and returns the length of the whole line, like snprintf.
+int InstrRegionJSON(const InstrRegion* region, char* buf, size_t size) ;
+
+/// Format the header of CSV lines: region,depth,wall_ns,cpu_ns, the
+/// names of the named counters and of the hardware events.
+/// Returns like InstrRegionJSON.
+int InstrRegionCSVHeader(char* buf, size_t size) ;
+
+/// Format region as a CSV line, with the columns of InstrRegionCSVHeader
+/// (hardware events not counted are left empty).
+/// Returns like InstrRegionJSON.
+int InstrRegionCSV(const InstrRegion* region, char* buf, size_t size) ;
+
 #endif
 